@@ -4,14 +4,22 @@
 #include <iostream>
 #include <fstream>
 #include <iomanip>
-#include <sstream>
+#include <iterator>
+#include <vector>
 
 #include "cpu.h"
+#include "breakpoints.h"
+#include "rom.h"
 
 class Debugger {
 public:
+  // The timers tick once every this many steps, as they would at the
+  // scheduler's default rate
+  static const int STEPS_PER_FRAME = 10;
+
+  Debugger();
   void cycle();
-  void loadGame(std::istream &game);
+  bool loadGame(std::istream &game); // false if the ROM doesn't fit
   void printOpcode();
   void printRegisters();
   void printIndex();
@@ -20,31 +28,196 @@ public:
   void printStackPointer();
   void printDebug();
 
+  // Breakpoints only slow the cpu down while there are some. Stepping with
+  // cycle() ignores them.
+  void addBreakpoint(unsigned short address);
+  bool removeBreakpoint(unsigned short address); // false if there wasn't one
+  bool addCondition(const std::string& text); // e.g. "V3 == 5", false if invalid
+  void watch(unsigned short first, unsigned short last, unsigned char access);
+  void clearBreakpoints();
+  void printBreakpoints();
+
+  // Runs up to count instructions at full speed, ticking the timers as
+  // stepping does, until a breakpoint hits or the cpu traps. continueRun()
+  // also stops when the program waits for a key or jumps to itself, since
+  // nothing can change then. Both return the instructions run.
+  unsigned long run(unsigned long count);
+  unsigned long continueRun();
+  void printStop(); // says why the last run stopped
+
 private:
   cpu chip8;
+  unsigned long steps; // instructions stepped through so far
+  breakpoints stops;
+  const char* stalled; // why continueRun() gave up, if it did
+  void attach(); // gives the cpu the breakpoints, or none if there are none
   void updateDebugInfo();
-  std::string debug; // holds debug information for latest instruction
+  char debug[128]; // holds debug information for latest instruction
 };
 
 // Static helper functions to assist with certain debugger functions
 static void printOneRegister(unsigned char regIndex, std::ostream& out);
 static void printOneStack(unsigned short stackIndex, std::ostream& out);
 
+Debugger::Debugger() : steps(0), stalled(NULL) {
+  debug[0] = '\0';
+}
+
 // Completes one cycle of emulation for the internal cpu
 void Debugger::cycle(){
   chip8.cycle();
+  if(++steps % STEPS_PER_FRAME == 0){
+    chip8.tickTimers();
+  }
+  stops.moved();
   updateDebugInfo();
 }
 
-// Loads a game to the internal cpu
-void Debugger::loadGame(std::istream &game){
-  chip8.loadGame(game);
+void Debugger::addBreakpoint(unsigned short address){
+  stops.add(address);
+  attach();
+}
+
+bool Debugger::removeBreakpoint(unsigned short address){
+  bool removed = stops.remove(address);
+  attach();
+  return removed;
+}
+
+bool Debugger::addCondition(const std::string& text){
+  bool added = stops.addCondition(text);
+  attach();
+  return added;
+}
+
+void Debugger::watch(unsigned short first, unsigned short last, unsigned char access){
+  stops.watch(first, last, access);
+  attach();
+}
+
+void Debugger::clearBreakpoints(){
+  stops.clear();
+  attach();
+}
+
+void Debugger::attach(){
+  chip8.setBreakpoints(stops.empty() ? NULL : &stops);
+}
+
+// Lists the breakpoints, conditions and watched ranges of ram
+void Debugger::printBreakpoints(){
+  for(unsigned short address : stops.getAddresses()){
+    std::cout << "break 0x" << std::hex << address << std::endl;
+  }
+  for(const breakpoints::condition& c : stops.getConditions()){
+    std::cout << "cond  " << c.text << std::endl;
+  }
+  for(unsigned int a = 0; a < 0x10000; ){
+    unsigned char access = stops.getWatch(a);
+    unsigned int first = a;
+    while(a < 0x10000 && stops.getWatch(a) == access){
+      ++a;
+    }
+    if(access != 0){
+      std::cout << (access == breakpoints::WATCH_WRITE ? "watch  0x" :
+                    access == breakpoints::WATCH_READ ? "rwatch 0x" : "awatch 0x")
+                << std::hex << first << "-0x" << (a - 1) << std::endl;
+    }
+  }
+}
+
+unsigned long Debugger::run(unsigned long count){
+  unsigned long done = 0;
+  stalled = NULL;
+  stops.resume();
+  while(done < count && !chip8.trapflag){
+    // Run up to the next timer tick at most
+    unsigned long n = STEPS_PER_FRAME - steps % STEPS_PER_FRAME;
+    if(n > count - done){
+      n = count - done;
+    }
+    unsigned long ran = chip8.run(n);
+    done += ran;
+    steps += ran;
+    if(ran > 0 && steps % STEPS_PER_FRAME == 0){
+      chip8.tickTimers();
+    }
+    if(stops.getHit().why != breakpoints::NONE){
+      break;
+    }
+  }
+  if(done > 0){
+    updateDebugInfo();
+  }
+  return done;
+}
+
+unsigned long Debugger::continueRun(){
+  unsigned long done = 0;
+  for(;;){
+    unsigned long ran = run(STEPS_PER_FRAME);
+    done += ran;
+    if(ran < STEPS_PER_FRAME || stops.getHit().why != breakpoints::NONE){
+      break;
+    }
+    const unsigned short oc = chip8.getOpcode();
+    const unsigned short pc = chip8.getProgramCounter();
+    if((oc & 0xF0FF) == 0xF00A){
+      stalled = "Waiting for a key";
+      break;
+    }
+    if((oc & 0xF000) == 0x1000 && (oc & 0x0FFF) == pc){
+      // The jump may have come from elsewhere. It's only stuck if the
+      // instruction it landed on jumps right back.
+      done += run(1);
+      if(stops.getHit().why != breakpoints::NONE){
+        break;
+      }
+      if(chip8.getProgramCounter() == pc){
+        stalled = "Jumping to itself";
+        break;
+      }
+    }
+  }
+  return done;
 }
 
-// Prints the last opcode held by the cpu
+void Debugger::printStop(){
+  const breakpoints::hit& hit = stops.getHit();
+  std::cout << std::hex;
+  if(hit.why == breakpoints::ADDRESS){
+    std::cout << "Breakpoint at 0x" << hit.pc << std::endl;
+  }
+  else if(hit.why == breakpoints::CONDITION){
+    std::cout << stops.getConditions()[hit.condition].text << " after 0x" << hit.pc << std::endl;
+  }
+  else if(hit.why == breakpoints::READ || hit.why == breakpoints::WRITE){
+    std::cout << (hit.why == breakpoints::READ ? "Read of 0x" : "Write to 0x") << hit.address
+              << " by 0x" << hit.pc << std::endl;
+  }
+  else if(chip8.trapflag){
+    std::cout << "Opcode 0x" << chip8.getOpcode() << " isn't implemented" << std::endl;
+  }
+  else if(stalled != NULL){
+    std::cout << stalled << " at 0x" << chip8.getProgramCounter() << std::endl;
+  }
+}
+
+// Loads a game to the internal cpu, as the platform it's detected as
+bool Debugger::loadGame(std::istream &game){
+  std::vector<unsigned char> rom((std::istreambuf_iterator<char>(game)),
+                                 std::istreambuf_iterator<char>());
+  chip8.setPlatform(detectPlatform(rom.data(), rom.size()));
+  chip8.setQuirks(cpu::defaultQuirks(chip8.getPlatform()));
+  return chip8.loadGame(rom.data(), rom.size());
+}
+
+// Prints the last opcode held by the cpu and its assembly
 void Debugger::printOpcode(){
   const unsigned short oc = chip8.getOpcode();
-  std::cout << "Opcode: 0x" << std::hex << oc << std::endl;
+  char text[32];
+  cpu::disassemble(oc, text, sizeof(text));
+  std::cout << "Opcode: 0x" << std::hex << oc << " (" << text << ")" << std::endl;
 }
 
 // Prints the registers of the cpu
@@ -115,243 +288,10 @@ static void printOneStack(unsigned short stackIndex, std::ostream& out){
   }
 }
 
+// Describes the instruction that was just run. The text comes from the same
+// table the cpu decodes with and is written into a fixed buffer.
 void Debugger::updateDebugInfo(){
-  const unsigned short opcode = chip8.getOpcode();
-  const unsigned char* reg = chip8.getRegisters();
-  std::ostringstream ss;
-  std::string vx, vy;
-  switch(opcode & 0xF000){ // checks the first 4 bits of opcode
-    // Execute with large switch statement
-    case 0x0000:
-      switch(opcode & 0x000F){ // checks last 4 bits of opcode
-        case 0x000E: //0x00EE
-          debug = "Return from subroutine.";
-        break;
-
-        case 0x0000: //0x00E0
-          debug = "Cleared screen.";
-        break;
-      }
-    break;
-
-      case 0x1000: //0x1NNN
-        ss << "Jump to address 0x" << std::hex << (opcode & 0x0FFF);
-        debug = ss.str();
-      break;
-
-      case 0x2000: //0x2NNN
-        ss << "Call to subroutine at address 0x" << std::hex << (opcode & 0x0FFF);
-        debug = ss.str();
-      break;
-
-      case 0x3000: //0x3XNN
-        // Skips the next instruction if VX = NN
-        if(reg[(opcode & 0x0F00) >> 8] == (opcode & 0x00FF)){
-          ss << "Skip the next instruction because V" << std::hex << ((opcode & 0x0F00) >> 8)
-             << " = 0x" << std::hex << (opcode & 0x00FF);
-          debug = ss.str();
-        }
-        else{
-          ss << "Doesn't skip the next instruction because V" << std::hex << ((opcode & 0x0F00) >> 8)
-             << " != 0x" << std::hex << (opcode & 0x00FF);
-          debug = ss.str();
-        }
-      break;
-
-      case 0x4000: //0x4XNN
-        // Skips the next instruction if VX != NN
-        if(reg[(opcode & 0x0F00) >> 8] != (opcode & 0x00FF)){
-          ss << "Skip the next instruction because V" << std::hex << ((opcode & 0x0F00) >> 8)
-             << " != 0x" << std::hex << (opcode & 0x00FF);
-          debug = ss.str();
-        }
-        else{
-          ss << "Doesn't skip the next instruction because V" << std::hex << ((opcode & 0x0F00) >> 8)
-             << " = 0x" << std::hex << (opcode & 0x00FF);
-          debug = ss.str();
-        }
-      break;
-
-      case 0x5000: //0x5XY0
-        // Skips the next instruction if VX equals VY
-        if(reg[(opcode & 0x0F00) >> 8] == reg[(opcode & 0x00F0) >> 4]){
-          ss << "Skip the next instruction because V" << std::hex << ((opcode & 0x0F00) >> 8)
-             << " = V" << std::hex << ((opcode & 0x00F0) >> 4);
-          debug = ss.str();
-        }
-        else{
-          ss << "Doesn't skip the next instruction because V" << std::hex << ((opcode & 0x0F00) >> 8)
-             << " = V" << std::hex << ((opcode & 0x00F0) >> 4);
-          debug = ss.str();
-        }
-      break;
-
-      case 0x6000: //0x6XNN
-        ss << "Set V" << ((opcode & 0x0F00) >> 8) << " to 0x" << std::hex << (opcode & 0x00FF);
-        debug = ss.str();
-      break;
-
-      case 0x7000: //0x7XNN
-        ss << "Adds 0x" << std::hex << (opcode & 0x00FF) << " to V" << std::hex << ((opcode & 0x0F00) >> 8);
-        debug = ss.str();
-      break;
-
-      case 0x8000:
-      ss << "V" << std::hex << ((opcode & 0x0F00) >> 8);
-      vx = ss.str();
-      ss.str("");
-
-      ss << "V" << std::hex << ((opcode & 0x00F0) >> 4);
-      vy = ss.str();
-      ss.str("");
-
-        switch(opcode & 0x000F){
-          case 0x0000: //0x8XY0
-            ss << "Set " << vx << " to the value of " << vy;
-            debug = ss.str();
-          break;
-
-          case 0x0001: //0x8XY1
-            ss << "Set " << vx << " to " << vx << " OR " << vy;
-            debug = ss.str();
-          break;
-
-          case 0x0002: //0x8XY2
-            ss << "Set " << vx << " to " << vx << " AND " << vy;
-            debug = ss.str();
-          break;
-
-          case 0x0003: //0x8XY3
-            ss << "Set " << vx << " to " << vx << " XOR " << vy;
-            debug = ss.str();
-          break;
-
-          case 0x0004: //0x8XY4
-            ss << "Adds " << vy << " to " << vx << ". VF is set to 0 if there's a carry, 1 if not.";
-            debug = ss.str();
-          break;
-
-          case 0x0005: //0x8XY5
-            ss << "Subtracts " << vy << " from " << vx << ". VF is set to 0 if there's a borrow, 1 if not.";
-            debug = ss.str();
-          break;
-
-          case 0x0006: //0x8XY6
-            ss << "Shifts " << vx << " right by one bit. VF is set to the most significant bit before the shift.";
-            debug = ss.str();
-          break;
-
-          case 0x0007: //0x8XY7
-            ss << "Sets " << vx << " to " << vy << " minus " << vx << ". VF is set to 0 if there's a borrow, 1 if not.";
-            debug = ss.str();
-          break;
-
-          case 0x000E: //0x8XYE
-            ss << "Shifts " << vx << " left by one bit. VF is set to the most significant bit before the shift.";
-            debug = ss.str();
-          break;
-        }
-      break;
-
-      case 0x9000: //0x9XY0
-        ss << "Skips the next instruction if V" << std::hex << ((opcode & 0x0F00) >> 8)
-           << " doesn't equal V" << std::hex << ((opcode & 0x00F0) >> 4);
-        debug = ss.str();
-      break;
-
-      case 0xA000: //0xANNN
-        ss << "Sets I to the address 0x" << std::hex << (opcode & 0x0FFF);
-        debug = ss.str();
-      break;
-
-      case 0xB000: //0xBNNN
-        ss << "Jump to the address 0x" << std::hex << (opcode & 0x0FFF) << " plus V0";
-        debug = ss.str();
-      break;
-
-      case 0xC000: //0xCXNN
-        ss << "Set V" << std::hex << ((opcode & 0x0F00) >> 8) << " to a random number between 0 and 255 and "
-           << std::hex << (opcode & 0x00FF);
-        debug = ss.str();
-      break;
-
-      case 0xD000: //0xDXYN
-        debug = "Draws sprite";
-      break;
-
-      case 0xE000:
-        switch(opcode & 0x00FF){
-          case 0x009E: //0xEX9E
-            ss << "Skips the next instruction if the key stored in V" << std::hex
-               << ((opcode & 0x0F00) >> 8) << " is pressed";
-            debug = ss.str();
-          break;
-
-          case 0x00A1: //0xEXA1
-            ss << "Skips the next instruction if the key stored in V" << std::hex
-               << ((opcode & 0x0F00) >> 8) << " isn't pressed";
-            debug = ss.str();
-          break;
-        }
-      break;
-
-      case 0xF000:
-        ss << "V" << std::hex << ((opcode & 0x0F00) >> 8);
-        vx = ss.str();
-        ss.str("");
-
-        switch(opcode & 0x00FF){
-          case 0x0007: //0xFX07
-            ss << "Sets " << vx << " to the value of the delay timer";
-            debug = ss.str();
-          break;
-
-          case 0x000A: //0xFX0A
-            ss << "Awaiting key press to store in " << vx;
-            debug = ss.str();
-          break;
-
-          case 0x0015: //0xFX15
-            ss << "Sets the delay timer to " << vx;
-            debug = ss.str();
-          break;
-
-          case 0x0018: //0xFX18
-            ss << "Sets the sound timer to " << vx;
-            debug = ss.str();
-          break;
-
-          case 0x001E: //0xFX1E
-            ss << "Adds " << vx << " to I";
-            debug = ss.str();
-          break;
-
-          case 0x0029: //0xFX29
-            ss << "Sets I to the location of the sprite for the character in " << vx;
-            debug = ss.str();
-          break;
-
-          case 0x0033: //0xFX33
-            ss << "Stores the binary coded decimal represenation of VX in memory."
-               << " The hundreds digit at I, tens at I+1, and the ones at I+2";
-            debug = ss.str();
-          break;
-
-          case 0x0055: //0xFX55
-            ss << "Stores V0 to " << vx << " in memory starting at address I";
-            debug = ss.str();
-          break;
-
-          case 0x0065: //0xFX65
-            ss << "Fills V0 to " << vx << " with values from memory starting at address I";
-            debug = ss.str();
-          break;
-        }
-      break;
-
-      default:
-        debug = "n/a";
-  }
+  cpu::describe(chip8.getOpcode(), debug, sizeof(debug));
 }
 
-#endif  // SKYLARK_DEBUGGER_H_
\ No newline at end of file
+#endif  // SKYLARK_DEBUGGER_H_
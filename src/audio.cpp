@@ -0,0 +1,91 @@
+#include "audio.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using namespace std;
+
+// The square wave sounded when there's no pattern: 4 bits on, 4 off, which is
+// 500Hz at the default pitch
+static const unsigned char SQUARE[16] = {
+  0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0,
+  0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0
+};
+
+sample_ring::sample_ring() : head(0), tail(0), underruns(0), dropped(0) {
+  memset(samples, 0, sizeof(samples));
+}
+
+// The indexes only ever count up and are wrapped when used, so head - tail is
+// always the number of samples waiting. Each side publishes its index with a
+// release store after touching the samples, and reads the other's with an
+// acquire load before.
+size_t sample_ring::push(const int16_t* in, size_t count){
+  size_t h = head.load(memory_order_relaxed);
+  size_t t = tail.load(memory_order_acquire);
+  size_t n = min(count, CAPACITY - (h - t));
+  for(size_t k = 0; k < n; ++k){
+    samples[(h + k) & (CAPACITY - 1)] = in[k];
+  }
+  head.store(h + n, memory_order_release);
+  if(n < count){
+    dropped.fetch_add(count - n, memory_order_relaxed);
+  }
+  return n;
+}
+
+size_t sample_ring::pop(int16_t* out, size_t count){
+  size_t t = tail.load(memory_order_relaxed);
+  size_t h = head.load(memory_order_acquire);
+  size_t n = min(count, h - t);
+  for(size_t k = 0; k < n; ++k){
+    out[k] = samples[(t + k) & (CAPACITY - 1)];
+  }
+  tail.store(t + n, memory_order_release);
+  if(n < count){
+    memset(out + n, 0, (count - n) * sizeof(int16_t));
+    underruns.fetch_add(1, memory_order_relaxed);
+  }
+  return n;
+}
+
+size_t sample_ring::available(){
+  return head.load(memory_order_acquire) - tail.load(memory_order_acquire);
+}
+
+uint64_t sample_ring::getUnderruns(){
+  return underruns.load(memory_order_relaxed);
+}
+
+uint64_t sample_ring::getDropped(){
+  return dropped.load(memory_order_relaxed);
+}
+
+buzzer::buzzer(sample_ring& out) : out(out), phase(0) {
+}
+
+// Silence is pushed too, so the ring is fed at the same rate the host plays
+// it whether or not the timer is running
+void buzzer::frame(bool on, const unsigned char* pattern, unsigned char pitch){
+  int16_t samples[FRAME];
+  if(!on){
+    memset(samples, 0, sizeof(samples));
+    out.push(samples, FRAME);
+    return;
+  }
+
+  if(pattern == NULL){
+    pattern = SQUARE;
+    pitch = 64;
+  }
+  double step = 4000.0 * pow(2.0, (pitch - 64) / 48.0) / RATE; // bits per sample
+  for(int s = 0; s < FRAME; ++s){
+    unsigned int bit = (unsigned int) phase;
+    samples[s] = ((pattern[bit >> 3] >> (7 - (bit & 7))) & 1) ? VOLUME : -VOLUME;
+    phase += step;
+    if(phase >= 128){
+      phase -= 128;
+    }
+  }
+  out.push(samples, FRAME);
+}
@@ -0,0 +1,68 @@
+#ifndef SKYLARK_AUDIO_H_
+#define SKYLARK_AUDIO_H_
+/*
+ *  audio.h
+ *
+ *  The sound the cpu makes while its sound timer runs. Each time the timers
+ *  tick, a buzzer renders a 60th of a second of samples into a ring that the
+ *  host's audio thread drains. The ring has one writer and one reader and
+ *  neither ever waits for the other: a full ring drops what doesn't fit and
+ *  an empty one is read as silence, and both are counted.
+ *
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+// A lock-free queue of samples from the emulation thread (push) to the audio
+// thread (pop). Nothing is allocated after it's made.
+class sample_ring {
+public:
+  static const size_t CAPACITY = 4096; // samples, a power of two
+
+  sample_ring();
+
+  // Only called by the writer. Returns the number of samples taken, which
+  // is less than count when the ring is full.
+  size_t push(const int16_t* samples, size_t count);
+
+  // Only called by the reader. Fills out with count samples, padding with
+  // silence when the ring runs dry, and returns how many were real.
+  size_t pop(int16_t* out, size_t count);
+
+  size_t available(); // samples waiting to be read
+  uint64_t getUnderruns(); // pops that had to be padded with silence
+  uint64_t getDropped(); // samples pushed into a full ring
+
+private:
+  int16_t samples[CAPACITY];
+  // Each side only writes its own index, and they are kept on separate cache
+  // lines so the two threads don't fight over one
+  alignas(64) std::atomic<size_t> head; // next sample to write
+  alignas(64) std::atomic<size_t> tail; // next sample to read
+  alignas(64) std::atomic<uint64_t> underruns;
+  std::atomic<uint64_t> dropped;
+};
+
+// Renders the sound timer into a ring. CHIP-8 and SUPER-CHIP sound a plain
+// square wave; XO-CHIP plays its 128 bit pattern (F002) at the rate set by
+// its pitch (FX3A), 4000 bits a second at the default pitch of 64.
+class buzzer {
+public:
+  static const int RATE = 48000; // samples per second
+  static const int FRAME = RATE / 60; // samples in each 60Hz frame
+  static const int16_t VOLUME = 4000; // height of the wave
+
+  explicit buzzer(sample_ring& out);
+
+  // Called by the cpu each time the timers tick, with whether the sound timer
+  // is running and the pattern to play, or NULL for the square wave
+  void frame(bool on, const unsigned char* pattern, unsigned char pitch);
+
+private:
+  sample_ring& out;
+  double phase; // position in the pattern, in bits, so the wave carries on
+};
+
+#endif  // SKYLARK_AUDIO_H_
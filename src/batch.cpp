@@ -0,0 +1,415 @@
+/*
+ *  batch.cpp
+ *
+ *  Runs many emulator jobs in one process, one cpu per job, spread over every
+ *  core. Jobs come from a manifest file and each one reports its final state
+ *  hash, instructions run and wall time on one line of a results file as soon
+ *  as it finishes.
+ *
+ */
+
+#include "cpu.h"
+#include "input.h"
+#include "lockstep.h"
+#include "rom.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+
+using namespace std;
+
+// One line of the manifest
+struct job {
+  string rom;
+  uint64_t seed;
+  string input; // input file, or empty for no key presses
+  unsigned long instructions;
+  const rom_image* image; // the ROM's contents, shared by every job that runs it
+  rom_platform platform;
+  const vector<key_event>* events;
+};
+
+// Units of work waiting to run on one worker. The owner takes from the front
+// and idle workers steal from the back, so they rarely contend.
+struct work_queue {
+  mutex lock;
+  deque<size_t> units;
+};
+
+static bool loadManifest(const string& filename, vector<job>& jobs);
+static void printUsage();
+static void work(size_t self, vector<work_queue>& queues, const vector<vector<size_t> >& units,
+                 const vector<job>& jobs, unsigned long perFrame, bool jit, bool lanes,
+                 ostream& out, mutex& outLock, atomic<size_t>& trapped);
+static void runLanes(const vector<size_t>& unit, const vector<job>& jobs, unsigned long perFrame,
+                     ostream& out, mutex& outLock, atomic<size_t>& trapped);
+static void writeResult(size_t n, const job& j, unsigned long executed, const cpu::state& final,
+                        double seconds, ostream& out, mutex& outLock, atomic<size_t>& trapped);
+static void writeFailure(size_t n, const job& j, ostream& out, mutex& outLock);
+static bool takeUnit(size_t self, vector<work_queue>& queues, size_t& taken);
+static uint64_t hashState(const cpu::state& s);
+
+int main(int argc, char* argv[]){
+  string manifest;
+  string outputFile; // results go to stdout unless this is set
+  unsigned long perFrame = 10; // instructions emulated in each 60Hz frame
+  unsigned long threads = thread::hardware_concurrency();
+  bool jit = false; // runs hot code as native code if set
+  bool lanes = false; // runs jobs with the same ROM and budget side by side if set
+  string indexFile; // ROM library for looking ROMs up by hash, if any
+
+  // Parse arguments
+  for(int a = 1; a < argc; ++a){
+    string arg(argv[a]);
+    if(arg == "-o" && a + 1 < argc){
+      outputFile = argv[++a];
+    }
+    else if(arg == "-c" && a + 1 < argc){
+      perFrame = strtoul(argv[++a], NULL, 10);
+    }
+    else if(arg == "-p" && a + 1 < argc){
+      threads = strtoul(argv[++a], NULL, 10);
+    }
+    else if(arg == "-j"){
+      jit = true;
+    }
+    else if(arg == "-l"){
+      lanes = true;
+    }
+    else if(arg == "-x" && a + 1 < argc){
+      indexFile = argv[++a];
+    }
+    else if(manifest.empty() && arg[0] != '-'){
+      manifest = arg;
+    }
+    else{
+      printUsage();
+      exit(EXIT_FAILURE);
+    }
+  }
+  if(manifest.empty() || perFrame == 0){
+    printUsage();
+    exit(EXIT_FAILURE);
+  }
+  if(threads == 0){
+    threads = 1;
+  }
+  if(jit && !cpu().useJit(true)){
+    cout << "The JIT isn't available on this platform." << endl;
+    return EXIT_FAILURE;
+  }
+
+  vector<job> jobs;
+  if(!loadManifest(manifest, jobs)){
+    return EXIT_FAILURE;
+  }
+
+  // ROMs given as @HASH are found through the library index
+  rom_library library;
+  if(!indexFile.empty() && !library.load(indexFile)){
+    cout << "Not a valid index file." << endl;
+    return EXIT_FAILURE;
+  }
+
+  // Every ROM and input file is read once, however many jobs use it
+  map<string, rom_image> images;
+  map<string, rom_platform> platforms;
+  map<string, vector<key_event> > scripts;
+  for(job& j : jobs){
+    if(images.count(j.rom) == 0){
+      string path = j.rom;
+      if(path[0] == '@'){
+        const rom_info* found = library.find(strtoull(path.c_str() + 1, NULL, 16));
+        if(found == NULL){
+          cout << "No ROM with hash " << path.substr(1) << " in the index." << endl;
+          return EXIT_FAILURE;
+        }
+        path = found->path;
+      }
+      if(!images[j.rom].open(path)){
+        cout << "Not a valid file: " << path << endl;
+        return EXIT_FAILURE;
+      }
+      platforms[j.rom] = detectPlatform(images[j.rom].data(), images[j.rom].size());
+      if(images[j.rom].size() > cpu::maxRomSize(platforms[j.rom])){
+        cout << "ROM too big: " << path << endl;
+        return EXIT_FAILURE;
+      }
+    }
+    j.image = &images[j.rom];
+    j.platform = platforms[j.rom];
+
+    if(scripts.count(j.input) == 0 && !j.input.empty() &&
+       !loadInputFile(j.input, scripts[j.input])){
+      cout << "Not a valid input file: " << j.input << endl;
+      return EXIT_FAILURE;
+    }
+    j.events = &scripts[j.input];
+  }
+
+  ofstream file;
+  if(!outputFile.empty()){
+    file.open(outputFile);
+    if(!file.is_open()){
+      cout << "Couldn't open " << outputFile << endl;
+      return EXIT_FAILURE;
+    }
+  }
+  ostream& out = outputFile.empty() ? cout : file;
+  out << "# job\trom\tseed\tinstructions\thash\tseconds\tstatus" << endl;
+
+  // Each unit of work is one job, or with -l up to one job per lane out of
+  // the jobs that share a CHIP-8 ROM and budget. Lanes only run CHIP-8, so
+  // SUPER-CHIP and XO-CHIP jobs are always units of their own.
+  vector<vector<size_t> > units;
+  map<pair<string, unsigned long>, size_t> filling; // unit that's taking more lanes
+  for(size_t n = 0; n < jobs.size(); ++n){
+    pair<string, unsigned long> kind(jobs[n].rom, jobs[n].instructions);
+    if(jobs[n].platform != PLATFORM_CHIP8){
+      units.push_back(vector<size_t>(1, n));
+      continue;
+    }
+    if(!lanes || filling.count(kind) == 0 || units[filling[kind]].size() == lockstep::LANES){
+      filling[kind] = units.size();
+      units.push_back(vector<size_t>());
+    }
+    units[filling[kind]].push_back(n);
+  }
+
+  // Deal the units out round robin. Workers that run out steal from the rest.
+  if(threads > units.size() && !units.empty()){
+    threads = units.size();
+  }
+  vector<work_queue> queues(threads);
+  for(size_t u = 0; u < units.size(); ++u){
+    queues[u % threads].units.push_back(u);
+  }
+
+  mutex outLock;
+  atomic<size_t> trapped(0);
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  vector<thread> workers;
+  for(size_t t = 0; t < threads; ++t){
+    workers.push_back(thread(work, t, ref(queues), cref(units), cref(jobs), perFrame, jit,
+                             lanes, ref(out), ref(outLock), ref(trapped)));
+  }
+  for(thread& w : workers){
+    w.join();
+  }
+  chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+  cerr << jobs.size() << " jobs on " << threads << " threads in " << fixed
+       << setprecision(3) << elapsed.count() << "s, " << trapped << " trapped" << endl;
+  return 0;
+}
+
+// Reads the manifest. Each line holds a ROM file, a seed for CXNN, an input
+// file (or - for none) and the number of instructions to run. Blank lines and
+// lines starting with # are ignored.
+static bool loadManifest(const string& filename, vector<job>& jobs){
+  ifstream in(filename);
+  if(!in.is_open()){
+    cout << "Not a valid manifest file." << endl;
+    return false;
+  }
+
+  string line;
+  for(int number = 1; getline(in, line); ++number){
+    if(line.empty() || line[0] == '#'){
+      continue;
+    }
+    istringstream ss(line);
+    string seed;
+    job j;
+    if(!(ss >> j.rom >> seed >> j.input >> j.instructions)){
+      cout << filename << ":" << number << ": expected ROM SEED INPUT INSTRUCTIONS" << endl;
+      return false;
+    }
+    j.seed = strtoull(seed.c_str(), NULL, 0);
+    if(j.input == "-"){
+      j.input.clear();
+    }
+    jobs.push_back(j);
+  }
+  return true;
+}
+
+static void printUsage(){
+  cout << "USAGE: batch.exe <MANIFEST_FILE> [-o RESULTS_FILE] [-c INSTRUCTIONS_PER_FRAME]"
+       << " [-p THREADS] [-j] [-l] [-x INDEX_FILE]" << endl;
+  cout << "       (each manifest line is: ROM SEED INPUT_FILE|- INSTRUCTIONS, where" << endl;
+  cout << "        ROM can be @HASH to look it up in the index)" << endl;
+}
+
+// Runs units of work until there are none left anywhere, writing each
+// job's result as it's done
+static void work(size_t self, vector<work_queue>& queues, const vector<vector<size_t> >& units,
+                 const vector<job>& jobs, unsigned long perFrame, bool jit, bool lanes,
+                 ostream& out, mutex& outLock, atomic<size_t>& trapped){
+  size_t u;
+  while(takeUnit(self, queues, u)){
+    if(lanes && jobs[units[u][0]].platform == PLATFORM_CHIP8){
+      runLanes(units[u], jobs, perFrame, out, outLock, trapped);
+      continue;
+    }
+
+    size_t n = units[u][0];
+    const job& j = jobs[n];
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    cpu chip8;
+    chip8.seed(j.seed);
+    chip8.setPlatform(j.platform);
+    chip8.setQuirks(cpu::defaultQuirks(j.platform));
+    chip8.useJit(jit);
+    if(!chip8.loadGame(j.image->data(), j.image->size())){
+      writeFailure(n, j, out, outLock);
+      continue;
+    }
+    unsigned long executed = runWithInput(chip8, *j.events, j.instructions, perFrame);
+    cpu::state final;
+    chip8.saveState(final);
+
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    writeResult(n, j, executed, final, elapsed.count(), out, outLock, trapped);
+  }
+}
+
+// Runs a group of jobs with the same ROM and budget together on one lockstep
+// engine, one job per lane. It's the same frame loop as runWithInput().
+static void runLanes(const vector<size_t>& unit, const vector<job>& jobs, unsigned long perFrame,
+                     ostream& out, mutex& outLock, atomic<size_t>& trapped){
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  unique_ptr<lockstep> engine(new lockstep);
+  uint32_t failed = 0; // lanes that couldn't be loaded, and never run
+  for(size_t k = 0; k < unit.size(); ++k){
+    const job& j = jobs[unit[k]];
+    cpu chip8;
+    chip8.seed(j.seed);
+    cpu::state initial;
+    bool loaded = chip8.loadGame(j.image->data(), j.image->size());
+    if(loaded){
+      chip8.saveState(initial);
+      loaded = engine->loadState(k, initial);
+    }
+    if(!loaded){
+      failed |= 1u << k;
+      writeFailure(unit[k], j, out, outLock);
+    }
+  }
+
+  unsigned long instructions = jobs[unit[0]].instructions;
+  vector<size_t> next(unit.size(), 0);
+  uint32_t stopped = failed; // lanes that trapped in an earlier frame, or never loaded
+  unsigned long executed = 0;
+  while(executed < instructions){
+    unsigned long frame = executed / perFrame;
+    for(size_t k = 0; k < unit.size(); ++k){
+      const vector<key_event>& events = *jobs[unit[k]].events;
+      while(!(stopped & (1u << k)) && next[k] < events.size() && events[next[k]].frame <= frame){
+        engine->setKey(k, events[next[k]].key, events[next[k]].down);
+        ++next[k];
+      }
+    }
+
+    unsigned long batch = min(perFrame - executed % perFrame, instructions - executed);
+    engine->run(batch);
+    executed += batch;
+
+    // Every lane that was still running ends its frame, including one that
+    // trapped on the frame's last instruction
+    uint32_t ticks = 0;
+    for(size_t k = 0; k < unit.size(); ++k){
+      if(!(stopped & (1u << k)) && engine->getExecuted(k) % perFrame == 0){
+        ticks |= 1u << k;
+      }
+    }
+    engine->tickTimers(ticks);
+
+    stopped = engine->getTrapped() | failed;
+    if(stopped == (1ull << unit.size()) - 1){
+      break;
+    }
+  }
+
+  // Lanes finish together, so they all report the group's time
+  chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+  for(size_t k = 0; k < unit.size(); ++k){
+    if(failed & (1u << k)){
+      continue;
+    }
+    cpu::state final;
+    engine->saveState(k, final);
+    writeResult(unit[k], jobs[unit[k]], engine->getExecuted(k), final, elapsed.count(),
+                out, outLock, trapped);
+  }
+}
+
+// Writes one line of results
+static void writeResult(size_t n, const job& j, unsigned long executed, const cpu::state& final,
+                        double seconds, ostream& out, mutex& outLock, atomic<size_t>& trapped){
+  if(final.trapflag){
+    ++trapped;
+  }
+
+  // Formatted first so the lock is only held for the write
+  ostringstream line;
+  line << n << '\t' << j.rom << '\t' << j.seed << '\t' << executed << '\t'
+       << hex << setfill('0') << setw(16) << hashState(final) << dec << '\t'
+       << fixed << setprecision(6) << seconds << '\t'
+       << (final.trapflag ? "trap" : "ok") << '\n';
+  lock_guard<mutex> hold(outLock);
+  out << line.str() << flush;
+}
+
+// Writes the line of a job that couldn't be loaded, with no state to hash
+static void writeFailure(size_t n, const job& j, ostream& out, mutex& outLock){
+  ostringstream line;
+  line << n << '\t' << j.rom << '\t' << j.seed << "\t0\t-\t0.000000\tfail\n";
+  lock_guard<mutex> hold(outLock);
+  out << line.str() << flush;
+}
+
+// Takes the next unit from this worker's own queue, or steals the last one
+// from another worker's. Returns false once every queue is empty.
+static bool takeUnit(size_t self, vector<work_queue>& queues, size_t& taken){
+  {
+    lock_guard<mutex> hold(queues[self].lock);
+    if(!queues[self].units.empty()){
+      taken = queues[self].units.front();
+      queues[self].units.pop_front();
+      return true;
+    }
+  }
+  for(size_t k = 1; k < queues.size(); ++k){
+    work_queue& victim = queues[(self + k) % queues.size()];
+    lock_guard<mutex> hold(victim.lock);
+    if(!victim.units.empty()){
+      taken = victim.units.back();
+      victim.units.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+// 64-bit FNV-1a of the whole saved state, so two runs hash the same only if
+// they ended in the same machine state
+static uint64_t hashState(const cpu::state& s){
+  const unsigned char* bytes = (const unsigned char*) &s;
+  uint64_t hash = 14695981039346656037ULL;
+  for(size_t n = 0; n < sizeof(s); ++n){
+    hash = (hash ^ bytes[n]) * 1099511628211ULL;
+  }
+  return hash;
+}
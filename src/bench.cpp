@@ -0,0 +1,244 @@
+/*
+ *  bench.cpp
+ *
+ *  Measures how fast the cpu runs. Each microbenchmark is a synthetic ROM
+ *  that loops over one kind of opcode, and each end-to-end benchmark runs a
+ *  whole ROM in 60Hz frames the way the headless runner does. Every
+ *  benchmark runs the same number of instructions and reports one
+ *  tab-separated line, so results from two builds can be compared directly.
+ *
+ */
+
+#include "cpu.h"
+#include "input.h"
+#include "rom.h"
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace std;
+
+// Where the pieces of a synthetic ROM go
+static const unsigned short DATA = 0xC00; // scratch ram for FX33, FX55 and FX65
+static const unsigned short SPRITE = 0xD00; // 32 bytes of 0xFF for DXYN and DXY0
+static const unsigned short ROUTINE = 0xE00; // a lone 00EE for 2NNN to call
+static const unsigned short NEXT = 0xFFF; // in a body, NNN meaning "the next instruction"
+static const int LOOP_LENGTH = 512; // instructions in the loop before it jumps back
+
+// A microbenchmark: setup runs once, then body is repeated to fill the loop
+struct micro_bench {
+  const char* name;
+  vector<unsigned short> setup;
+  vector<unsigned short> body;
+};
+
+static vector<unsigned char> buildRom(const micro_bench& m);
+static double timeRun(cpu& chip8, unsigned long instructions, unsigned long perFrame,
+                      unsigned long& executed);
+static void report(const string& name, unsigned long executed, double seconds);
+
+int main(int argc, char* argv[]){
+  unsigned long instructions = 10000000;
+  unsigned long perFrame = 10; // instructions in each 60Hz frame of an end-to-end run
+  bool jit = false;
+  vector<string> roms;
+
+  // Parse arguments
+  for(int a = 1; a < argc; ++a){
+    string arg(argv[a]);
+    if(arg == "-n" && a + 1 < argc){
+      instructions = strtoul(argv[++a], NULL, 10);
+    }
+    else if(arg == "-c" && a + 1 < argc){
+      perFrame = strtoul(argv[++a], NULL, 10);
+    }
+    else if(arg == "-j"){
+      jit = true;
+    }
+    else if(arg[0] != '-'){
+      roms.push_back(arg);
+    }
+    else{
+      instructions = 0;
+      break;
+    }
+  }
+  if(instructions == 0 || perFrame == 0){
+    cout << "USAGE: bench.exe [-n INSTRUCTIONS] [-c INSTRUCTIONS_PER_FRAME] [-j] [ROM_FILENAME]..." << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // Each family of opcodes on its own. Skips are set up not to skip, so
+  // every instruction in the loop runs (EXA1 relies on key F being held).
+  const unsigned short V0_V1_AT_0 = 0x6000, V1_0 = 0x6100, HIGH = 0x00FF;
+  const unsigned short I_SPRITE = 0xA000 | SPRITE, I_DATA = 0xA000 | DATA;
+  vector<micro_bench> micros = {
+    {"00E0", {}, {0x00E0}},
+    {"2NNN+00EE", {}, {0x2000 | ROUTINE}},
+    {"1NNN", {}, {0x1000 | NEXT}},
+    {"3XNN", {}, {0x3001}},
+    {"4XNN", {}, {0x4000}},
+    {"5XY0", {0x6101}, {0x5010}},
+    {"6XNN", {}, {0x6012}},
+    {"7XNN", {}, {0x7001}},
+    {"8XY0", {}, {0x8010}},
+    {"8XY1", {}, {0x8011}},
+    {"8XY2", {}, {0x8012}},
+    {"8XY3", {}, {0x8013}},
+    {"8XY4", {}, {0x8014}},
+    {"8XY5", {}, {0x8015}},
+    {"8XY6", {}, {0x8016}},
+    {"8XY7", {}, {0x8017}},
+    {"8XYE", {}, {0x801E}},
+    {"9XY0", {}, {0x9010}},
+    {"ANNN", {}, {0xA300}},
+    {"BNNN", {V0_V1_AT_0}, {0xB000 | NEXT}},
+    {"CXNN", {}, {0xC0FF}},
+    {"EX9E", {}, {0xE09E}},
+    {"EXA1", {0x600F}, {0xE0A1}},
+    {"FX07", {}, {0xF007}},
+    {"FX15", {}, {0xF015}},
+    {"FX18", {}, {0xF018}},
+    {"FX1E", {0xA200}, {0xF01E}},
+    {"FX29", {}, {0xF029}},
+    {"FX33", {I_DATA}, {0xF033}},
+    {"FX55", {I_DATA}, {0xFF55}},
+    {"FX65", {I_DATA}, {0xFF65}},
+    // Sprites: aligned to a byte, not aligned, and wrapping off the right edge
+    {"DXYN/h1/x0", {V0_V1_AT_0, V1_0, I_SPRITE}, {0xD011}},
+    {"DXYN/h5/x0", {V0_V1_AT_0, V1_0, I_SPRITE}, {0xD015}},
+    {"DXYN/h8/x0", {V0_V1_AT_0, V1_0, I_SPRITE}, {0xD018}},
+    {"DXYN/h15/x0", {V0_V1_AT_0, V1_0, I_SPRITE}, {0xD01F}},
+    {"DXYN/h8/x3", {0x6003, V1_0, I_SPRITE}, {0xD018}},
+    {"DXYN/h15/x3", {0x6003, V1_0, I_SPRITE}, {0xD01F}},
+    {"DXYN/h8/x60", {0x603C, V1_0, I_SPRITE}, {0xD018}},
+    {"DXYN/h15/y24", {V0_V1_AT_0, 0x6118, I_SPRITE}, {0xD01F}},
+    // The 128x64 screen: 16x16 sprites, crossing the middle of a row, and
+    // full screen scrolls
+    {"DXY0/hires/x0", {HIGH, V0_V1_AT_0, V1_0, I_SPRITE}, {0xD010}},
+    {"DXY0/hires/x60", {HIGH, 0x603C, V1_0, I_SPRITE}, {0xD010}},
+    {"DXYN/hires/h8/x124", {HIGH, 0x607C, V1_0, I_SPRITE}, {0xD018}},
+    {"00CN/hires", {HIGH}, {0x00C1}},
+    {"00DN/hires", {HIGH}, {0x00D1}},
+    {"00FB/hires", {HIGH}, {0x00FB}},
+    {"00FC/hires", {HIGH}, {0x00FC}},
+    // Mixes that look more like real programs
+    {"mix/arith", {}, {0x6005, 0x7103, 0x8014, 0x8125, 0x8206, 0x3F99}},
+    {"mix/draw", {V0_V1_AT_0, V1_0, I_SPRITE}, {0xD018, 0x7008, 0xD018, 0x7108}},
+    {"mix/memory", {I_DATA}, {0xF333, 0xF265, 0x7001, 0xF155, 0xF01E, I_DATA}},
+    {"mix/calls", {}, {0x6001, 0x2000 | ROUTINE, 0x7001, 0x3000}},
+  };
+
+  cout << "# skylark bench, " << instructions << " instructions each"
+       << (jit ? ", jit" : "") << endl;
+  cout << "name\tinstructions\tseconds\tinstructions/sec\tns/instruction" << endl;
+
+  for(const micro_bench& m : micros){
+    vector<unsigned char> rom = buildRom(m);
+    cpu chip8;
+    chip8.seed(1);
+    chip8.skipIdleLoops(false); // the interpreter, not the idle loop skipping, is measured
+    if(jit && !chip8.useJit(true)){
+      cout << "The JIT isn't available on this platform." << endl;
+      return EXIT_FAILURE;
+    }
+    chip8.setPlatform(detectPlatform(rom.data(), rom.size()));
+    chip8.loadGame(rom.data(), rom.size());
+    chip8.key[0xF] = 1;
+    unsigned long executed;
+    double seconds = timeRun(chip8, instructions, 0, executed);
+    report(m.name, executed, seconds);
+    if(chip8.trapflag){ // a broken benchmark, not a slow one
+      cerr << m.name << " trapped on 0x" << hex << chip8.getOpcode() << dec << endl;
+    }
+  }
+
+  // Whole ROMs, in frames with the timers ticking
+  if(roms.empty()){
+    roms.push_back("demo.ch8");
+  }
+  for(const string& name : roms){
+    rom_image rom;
+    cpu chip8;
+    chip8.seed(1);
+    chip8.skipIdleLoops(false);
+    if(jit){
+      chip8.useJit(true);
+    }
+    if(!rom.open(name)){
+      cout << "# couldn't load " << name << endl;
+      continue;
+    }
+    chip8.setPlatform(detectPlatform(rom.data(), rom.size()));
+    if(!chip8.loadGame(rom.data(), rom.size())){
+      cout << "# couldn't load " << name << endl;
+      continue;
+    }
+    unsigned long executed;
+    double seconds = timeRun(chip8, instructions, perFrame, executed);
+    report(name, executed, seconds);
+  }
+  return 0;
+}
+
+// Lays out a microbenchmark at 0x200: the setup, the loop and a jump back
+// to the start of the loop, with the sprite and routine it may use
+static vector<unsigned char> buildRom(const micro_bench& m){
+  vector<unsigned short> code(m.setup);
+  unsigned short loop = 0x200 + 2 * code.size();
+  while(code.size() + m.body.size() < m.setup.size() + LOOP_LENGTH){
+    for(unsigned short op : m.body){
+      if((op & 0xFFF) == NEXT){
+        op = (op & 0xF000) | (0x200 + 2 * (code.size() + 1));
+      }
+      code.push_back(op);
+    }
+  }
+  code.push_back(0x1000 | loop);
+
+  vector<unsigned char> rom(ROUTINE + 2 - 0x200, 0);
+  for(size_t n = 0; n < code.size(); ++n){
+    rom[2 * n] = code[n] >> 8;
+    rom[2 * n + 1] = code[n] & 0xFF;
+  }
+  for(int n = 0; n < 32; ++n){
+    rom[SPRITE - 0x200 + n] = 0xFF;
+  }
+  rom[ROUTINE - 0x200] = 0x00;
+  rom[ROUTINE - 0x200 + 1] = 0xEE;
+  return rom;
+}
+
+// Runs the cpu for the given number of instructions, straight through or in
+// frames of perFrame if that isn't 0, after a short warm up so the decode
+// caches are filled. Returns the seconds taken by the measured run.
+static double timeRun(cpu& chip8, unsigned long instructions, unsigned long perFrame,
+                      unsigned long& executed){
+  static const vector<key_event> noKeys;
+  unsigned long warmup = instructions / 100;
+  if(perFrame == 0){
+    chip8.run(warmup);
+  }
+  else{
+    runWithInput(chip8, noKeys, warmup, perFrame);
+  }
+
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  if(perFrame == 0){
+    executed = chip8.run(instructions);
+  }
+  else{
+    executed = runWithInput(chip8, noKeys, instructions, perFrame);
+  }
+  chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+static void report(const string& name, unsigned long executed, double seconds){
+  printf("%s\t%lu\t%.6f\t%.0f\t%.3f\n", name.c_str(), executed, seconds,
+         seconds > 0 ? executed / seconds : 0.0,
+         executed > 0 ? seconds * 1e9 / executed : 0.0);
+  fflush(stdout);
+}
@@ -0,0 +1,113 @@
+#include "blockcache.h"
+#include "ops.h"
+
+// Instructions that end a block. Anything after them may not run next.
+static const unsigned char BLOCK_END = cpu::instruction::JUMP | cpu::instruction::SKIP |
+                                       cpu::instruction::DRAW | cpu::instruction::STORE |
+                                       cpu::instruction::WAIT | cpu::instruction::TRAP;
+
+// Pairs worth fusing into a superinstruction, with one for each quirk
+// policy's sprite drawing
+const cpu::ops::fusion cpu::ops::fusions[] = {
+  {&ops::op6XNN, &ops::op6XNN, &ops::op6XNN_6XNN},
+  {&ops::opANNN, &ops::quirky<ops::modern>::opDXYN, &ops::quirky<ops::modern>::opANNN_DXYN},
+  {&ops::opANNN, &ops::quirky<ops::cosmac>::opDXYN, &ops::quirky<ops::cosmac>::opANNN_DXYN},
+  {&ops::opANNN, &ops::quirky<ops::schip>::opDXYN, &ops::quirky<ops::schip>::opANNN_DXYN},
+  {&ops::opANNN, &ops::quirky<ops::xochip>::opDXYN, &ops::quirky<ops::xochip>::opANNN_DXYN},
+};
+
+cpu::block_cache::block_cache(){
+  for(int a = 0; a < 4096; ++a){
+    index[a] = NONE;
+    covered[a] = 0;
+  }
+}
+
+const cpu::block_cache::block& cpu::block_cache::fetch(const instruction* table,
+                                                       const unsigned char* ram,
+                                                       unsigned short address){
+  int slot = index[address];
+  if(slot == NONE){
+    slot = compile(table, ram, address);
+  }
+  return pool[slot];
+}
+
+void cpu::block_cache::invalidate(unsigned int address, unsigned int length){
+  for(unsigned int a = address; a < address + length && a < 4096; ++a){
+    // A block holding this byte has to start within one block's length before it
+    for(int start = a; covered[a] > 0 && start >= 0 && start > (int) a - 2 * MAX_LENGTH; --start){
+      if(index[start] != NONE && pool[index[start]].end > a){
+        drop(index[start]);
+      }
+    }
+  }
+}
+
+void cpu::block_cache::clear(){
+  for(int a = 0; a < 4096; ++a){
+    if(index[a] != NONE){
+      drop(index[a]);
+    }
+  }
+}
+
+// Decodes instructions from address until one that ends the block, fusing
+// pairs that have a superinstruction
+int cpu::block_cache::compile(const instruction* table, const unsigned char* ram,
+                              unsigned short address){
+  int slot;
+  if(unused.empty()){
+    slot = pool.size();
+    pool.push_back(block());
+  }
+  else{
+    slot = unused.back();
+    unused.pop_back();
+  }
+
+  block& b = pool[slot];
+  b.start = address;
+  b.length = 0;
+  unsigned int pc = address;
+  while(b.length < MAX_LENGTH && pc + 1 < 4096){
+    unsigned short opcode = ram[pc] << 8 | ram[pc + 1];
+    b.opcodes[b.length] = opcode;
+    b.ops[b.length] = table[opcode];
+    b.width[b.length] = 1;
+    ++b.length;
+    pc += 2;
+    if(table[opcode].flags & BLOCK_END){
+      break;
+    }
+  }
+  b.end = pc;
+
+  // Replace pairs with their superinstruction. The second half stays in place
+  // so the handler can read its operands.
+  for(int k = 0; k + 1 < b.length; ++k){
+    for(const ops::fusion& f : ops::fusions){
+      if(b.ops[k].exec == f.first && b.ops[k + 1].exec == f.second){
+        b.ops[k].exec = f.exec;
+        b.width[k] = 2;
+        ++k;
+        break;
+      }
+    }
+  }
+
+  index[address] = slot;
+  for(unsigned int a = b.start; a < b.end; ++a){
+    ++covered[a];
+  }
+  return slot;
+}
+
+void cpu::block_cache::drop(int slot){
+  block& b = pool[slot];
+  for(unsigned int a = b.start; a < b.end; ++a){
+    --covered[a];
+  }
+  index[b.start] = NONE;
+  unused.push_back(slot);
+}
@@ -0,0 +1,57 @@
+#ifndef SKYLARK_BLOCKCACHE_H_
+#define SKYLARK_BLOCKCACHE_H_
+/*
+ *  blockcache.h
+ *
+ *  Caches runs of straight-line code that have already been decoded so the
+ *  cpu doesn't have to fetch and decode them again every time they run.
+ *
+ */
+
+#include "cpu.h"
+#include <vector>
+
+// A block starts at some address in ram and runs up to and including the
+// first instruction that jumps, calls, skips, draws, writes to ram or waits.
+// Blocks are looked up by their start address. Anything that writes to ram
+// must call invalidate() so no block keeps running code that has changed.
+struct cpu::block_cache {
+  static const int MAX_LENGTH = 32; // most instructions held by one block
+
+  struct block {
+    unsigned short start; // address of the first instruction
+    unsigned short end; // address just past the last instruction
+    unsigned char length; // number of instructions
+    // Instructions covered by each entry: 1, or 2 when the entry is the
+    // first half of a superinstruction and the next entry is its second half
+    unsigned char width[MAX_LENGTH];
+    unsigned short opcodes[MAX_LENGTH];
+    instruction ops[MAX_LENGTH];
+  };
+
+  block_cache();
+
+  // Returns the block starting at address, decoding it first with table if
+  // needed. Blocks decoded with another table have to be cleared first.
+  const block& fetch(const instruction* table, const unsigned char* ram,
+                     unsigned short address);
+
+  // Drops every block that holds any of the bytes from address to
+  // address + length - 1
+  void invalidate(unsigned int address, unsigned int length);
+
+  void clear(); // drops every block
+
+private:
+  static const int NONE = -1;
+
+  int compile(const instruction* table, const unsigned char* ram, unsigned short address);
+  void drop(int slot);
+
+  int index[4096]; // block slot for each start address, or NONE
+  unsigned char covered[4096]; // number of blocks holding each byte
+  std::vector<block> pool;
+  std::vector<int> unused; // slots in pool that can be reused
+};
+
+#endif  // SKYLARK_BLOCKCACHE_H_
@@ -0,0 +1,205 @@
+#include "breakpoints.h"
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <sstream>
+
+using namespace std;
+
+breakpoints::breakpoints() : stops(0x10000, false), watched(0x10000, 0), watching(false),
+                             passing(NO_ADDRESS) {
+  resume();
+}
+
+void breakpoints::add(uint16_t address){
+  if(!stops[address]){
+    stops[address] = true;
+    addresses.push_back(address);
+  }
+}
+
+bool breakpoints::remove(uint16_t address){
+  if(!stops[address]){
+    return false;
+  }
+  stops[address] = false;
+  addresses.erase(find(addresses.begin(), addresses.end(), address));
+  return true;
+}
+
+// Parses "WHAT COMPARE VALUE", where WHAT is V0 to VF, I, DT or ST, COMPARE
+// is one of == != < > <= >= and VALUE is a number in any C base
+bool breakpoints::addCondition(const string& text){
+  istringstream in(text);
+  string what, compare, value;
+  if(!(in >> what >> compare >> value) || !(in >> ws).eof()){
+    return false;
+  }
+
+  condition c;
+  c.text = what + " " + compare + " " + value;
+  c.index = 0;
+  if(what.size() == 2 && toupper(what[0]) == 'V' && isxdigit(what[1])){
+    c.what = 'V';
+    c.index = strtoul(what.c_str() + 1, NULL, 16);
+  }
+  else if(what == "I" || what == "i"){
+    c.what = 'I';
+  }
+  else if(what == "DT" || what == "dt"){
+    c.what = 'D';
+  }
+  else if(what == "ST" || what == "st"){
+    c.what = 'S';
+  }
+  else{
+    return false;
+  }
+
+  static const char* const names[] = {"==", "!=", "<", ">", "<=", ">="};
+  static const char codes[] = {'=', '!', '<', '>', 'l', 'g'};
+  c.compare = 0;
+  for(int n = 0; n < 6; ++n){
+    if(compare == names[n]){
+      c.compare = codes[n];
+    }
+  }
+  char* end;
+  c.value = strtoul(value.c_str(), &end, 0);
+  if(c.compare == 0 || *end != '\0'){
+    return false;
+  }
+
+  c.known = false;
+  c.was = false;
+  conditions.push_back(c);
+  return true;
+}
+
+void breakpoints::watch(uint16_t first, uint16_t last, unsigned char access){
+  for(unsigned int a = first; a <= last; ++a){
+    watched[a] |= access;
+  }
+  watching = true;
+}
+
+void breakpoints::clear(){
+  stops.assign(stops.size(), false);
+  watched.assign(watched.size(), 0);
+  addresses.clear();
+  conditions.clear();
+  watching = false;
+  moved();
+  resume();
+}
+
+bool breakpoints::empty(){
+  return addresses.empty() && conditions.empty() && !watching;
+}
+
+const vector<uint16_t>& breakpoints::getAddresses(){
+  return addresses;
+}
+
+const vector<breakpoints::condition>& breakpoints::getConditions(){
+  return conditions;
+}
+
+unsigned char breakpoints::getWatch(uint16_t address){
+  return watched[address];
+}
+
+const breakpoints::hit& breakpoints::getHit(){
+  return last;
+}
+
+void breakpoints::moved(){
+  passing = NO_ADDRESS;
+}
+
+void breakpoints::resume(){
+  last.why = NONE;
+  last.pc = 0;
+  last.address = 0;
+  last.condition = -1;
+}
+
+// Works out from the operands which ram the instruction at pc is about to
+// read or write, before it runs. It only stops the cpu afterwards, so the
+// access can be seen.
+bool breakpoints::stopAccess(uint16_t pc, uint16_t opcode, uint16_t i){
+  if(!watching){
+    return false;
+  }
+
+  unsigned int length;
+  unsigned char access;
+  unsigned char x = (opcode >> 8) & 0xF;
+  if((opcode & 0xF000) == 0xD000){ // DXYN reads the sprite, DXY0 up to 32 bytes of it
+    length = (opcode & 0xF) != 0 ? opcode & 0xF : 32;
+    access = WATCH_READ;
+  }
+  else if((opcode & 0xF00E) == 0x5002){ // 5XY2 writes and 5XY3 reads VX to VY
+    unsigned char y = (opcode >> 4) & 0xF;
+    length = (x <= y ? y - x : x - y) + 1;
+    access = (opcode & 1) == 0 ? WATCH_WRITE : WATCH_READ;
+  }
+  else if((opcode & 0xF0FF) == 0xF033){
+    length = 3;
+    access = WATCH_WRITE;
+  }
+  else if((opcode & 0xF0FF) == 0xF055){
+    length = x + 1;
+    access = WATCH_WRITE;
+  }
+  else if((opcode & 0xF0FF) == 0xF065){
+    length = x + 1;
+    access = WATCH_READ;
+  }
+  else{
+    return false;
+  }
+
+  for(unsigned int n = 0; n < length; ++n){
+    uint16_t address = i + n;
+    if(watched[address] & access){
+      last.why = access == WATCH_READ ? READ : WRITE;
+      last.pc = pc;
+      last.address = address;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool breakpoints::stopCondition(uint16_t pc, const unsigned char* reg, uint16_t i,
+                                unsigned char delay, unsigned char sound){
+  bool stopped = false;
+  for(size_t n = 0; n < conditions.size(); ++n){
+    condition& c = conditions[n];
+    unsigned int value = c.what == 'V' ? reg[c.index] :
+                         c.what == 'I' ? i :
+                         c.what == 'D' ? delay : sound;
+    bool holds;
+    switch(c.compare){
+      case '=': holds = value == c.value; break;
+      case '!': holds = value != c.value; break;
+      case '<': holds = value < c.value; break;
+      case '>': holds = value > c.value; break;
+      case 'l': holds = value <= c.value; break;
+      default:  holds = value >= c.value; break;
+    }
+
+    // A condition that already held when it was first checked doesn't stop
+    if(c.known && holds && !c.was && !stopped){
+      last.why = CONDITION;
+      last.pc = pc;
+      last.condition = n;
+      stopped = true;
+    }
+    c.known = true;
+    c.was = holds;
+  }
+  return stopped;
+}
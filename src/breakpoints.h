@@ -0,0 +1,99 @@
+#ifndef SKYLARK_BREAKPOINTS_H_
+#define SKYLARK_BREAKPOINTS_H_
+/*
+ *  breakpoints.h
+ *
+ *  Places where a running cpu should stop: addresses about to be run,
+ *  conditions on the registers, I or the timers, and ranges of ram that are
+ *  read or written. A cpu only checks them while they are attached with
+ *  cpu::setBreakpoints(), so they cost nothing when no debugger is in use.
+ *
+ */
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class breakpoints {
+public:
+  static const uint16_t NO_ADDRESS = 0xFFFF;
+
+  // Why the cpu last stopped
+  enum reason {
+    NONE,
+    ADDRESS,   // pc reached a breakpoint, before running it
+    CONDITION, // a condition became true after an instruction
+    READ,      // an instruction read watched ram
+    WRITE      // an instruction wrote watched ram
+  };
+
+  struct hit {
+    reason why;
+    uint16_t pc; // instruction that stopped the cpu
+    uint16_t address; // the watched address for READ and WRITE
+    int condition; // index of the condition for CONDITION
+  };
+
+  // A comparison such as "V3 == 0x05", "I >= 0x300" or "DT == 0". It stops
+  // the cpu when it becomes true, not for as long as it stays true.
+  struct condition {
+    std::string text;
+    char what; // 'V', 'I', 'D' (delay timer) or 'S' (sound timer)
+    unsigned char index; // the register, for 'V'
+    char compare; // '=', '!', '<', '>', 'l' (<=) or 'g' (>=)
+    unsigned int value;
+    bool known; // was has been set
+    bool was; // whether it held after the last instruction
+  };
+
+  static const unsigned char WATCH_READ = 0x01;
+  static const unsigned char WATCH_WRITE = 0x02;
+
+  breakpoints();
+
+  void add(uint16_t address);
+  bool remove(uint16_t address); // false if there was no breakpoint there
+  bool addCondition(const std::string& text); // false if text can't be parsed
+  void watch(uint16_t first, uint16_t last, unsigned char access);
+  void clear(); // removes everything
+  bool empty();
+
+  const std::vector<uint16_t>& getAddresses();
+  const std::vector<condition>& getConditions();
+  unsigned char getWatch(uint16_t address);
+
+  const hit& getHit(); // why the cpu last stopped
+  void resume(); // forgets why the cpu last stopped, before running it again
+  void moved(); // the cpu ran without being checked, e.g. single stepping
+
+  // The checks a cpu makes around each instruction. stopAt() is asked before
+  // an instruction runs, the others after it. An address breakpoint the cpu
+  // has just stopped on lets it through the next time, so it can carry on.
+  bool stopAt(uint16_t pc){
+    if(!stops[pc]){
+      return false;
+    }
+    if(pc == passing){
+      passing = NO_ADDRESS;
+      return false;
+    }
+    passing = pc;
+    last.why = ADDRESS;
+    last.pc = pc;
+    return true;
+  }
+  bool stopAccess(uint16_t pc, uint16_t opcode, uint16_t i);
+  bool stopCondition(uint16_t pc, const unsigned char* reg, uint16_t i,
+                     unsigned char delay, unsigned char sound);
+
+private:
+  std::vector<bool> stops; // addresses with a breakpoint, all 65536 of them
+  std::vector<uint16_t> addresses;
+  std::vector<condition> conditions;
+  std::vector<unsigned char> watched; // WATCH_READ and WATCH_WRITE for each address
+  bool watching; // any of watched[] is set
+  uint16_t passing; // breakpoint just stopped on, let through next time
+  hit last;
+};
+
+#endif  // SKYLARK_BREAKPOINTS_H_
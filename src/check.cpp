@@ -0,0 +1,376 @@
+/*
+ *  check.cpp
+ *
+ *  Checks that the fast ways of running the cpu end up exactly where the
+ *  plain one does. Small programs are generated from a fixed seed, run once
+ *  the plain way and once the fast way, and the saved states are compared
+ *  byte for byte. Prints one line per check and exits with a failure if any
+ *  program came out different.
+ *
+ */
+
+#include "cpu.h"
+#include "input.h"
+#include "lockstep.h"
+#include "rom.h"
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include <memory>
+#include <random>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+
+using namespace std;
+
+static const int PROGRAMS = 200; // generated for each check
+static const unsigned long INSTRUCTIONS = 5000; // run by each program
+static const unsigned long CHUNK = 100; // run between comparisons of the registers
+
+static const int GROUPS = 100; // of lockstep::LANES jobs, sharing a generated ROM
+static const unsigned long FRAMES = 300; // run by each lockstep job
+
+static const quirk_profile PROFILES[] = {QUIRKS_MODERN, QUIRKS_COSMAC, QUIRKS_SCHIP, QUIRKS_XOCHIP};
+
+static vector<unsigned char> straightLine(mt19937& random);
+static vector<unsigned char> branching(mt19937& random);
+static int compareLanes(const vector<unsigned char>& rom, mt19937& random);
+static void load(cpu& chip8, const vector<unsigned char>& rom, quirk_profile quirks);
+static bool sameRegisters(cpu& a, cpu& b);
+static bool sameState(cpu& a, cpu& b);
+static void printRom(const vector<unsigned char>& rom);
+
+int main(){
+  bool ok = true;
+
+  // The jit against the interpreter, with each profile's quirks
+  if(!cpu().useJit(true)){
+    cout << "jit: not available on this platform, skipped" << endl;
+  }
+  else{
+    mt19937 random(1);
+    int differ = 0;
+    for(int p = 0; p < PROGRAMS; ++p){
+      vector<unsigned char> rom = straightLine(random);
+      for(quirk_profile quirks : PROFILES){
+        cpu plain, native;
+        load(plain, rom, quirks);
+        load(native, rom, quirks);
+        native.useJit(true);
+        bool same = true;
+        for(unsigned long done = 0; done < INSTRUCTIONS && same; done += CHUNK){
+          for(unsigned long n = 0; n < CHUNK; ++n){
+            plain.cycle();
+          }
+          native.run(CHUNK);
+          same = sameRegisters(plain, native);
+        }
+        if(!same || !sameState(plain, native)){
+          if(differ == 0){
+            cout << "jit: program " << p << " differs with " << quirksName(quirks) << " quirks:";
+            printRom(rom);
+          }
+          ++differ;
+        }
+      }
+    }
+    cout << "jit: " << PROGRAMS * 4 << " runs, " << differ << " differ" << endl;
+    ok = ok && differ == 0;
+  }
+
+  // The lanes against one cpu per job, the same jobs batch.exe -l would run
+  // together: one ROM with a different seed and key presses in each lane
+  {
+    mt19937 random(1);
+    int differ = 0, runs = 0;
+    for(int g = 0; g < GROUPS; ++g){
+      vector<unsigned char> rom = branching(random);
+      int lanes = compareLanes(rom, random);
+      if(lanes != 0 && differ == 0){
+        cout << "lockstep: program " << g << " differs:";
+        printRom(rom);
+      }
+      differ += lanes;
+      runs += lockstep::LANES;
+    }
+    ifstream demo("demo.ch8", ios::binary);
+    if(demo.is_open()){
+      vector<unsigned char> rom((istreambuf_iterator<char>(demo)), istreambuf_iterator<char>());
+      for(int g = 0; g < 4; ++g){
+        int lanes = compareLanes(rom, random);
+        if(lanes != 0 && differ == 0){
+          cout << "lockstep: demo.ch8 differs" << endl;
+        }
+        differ += lanes;
+        runs += lockstep::LANES;
+      }
+    }
+    cout << "lockstep: " << runs << " runs, " << differ << " differ" << endl;
+    ok = ok && differ == 0;
+  }
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// A loop of the register, index and skip instructions the jit translates,
+// ended by a jump back to the start so it runs often enough to be compiled.
+// Skips are never last, so they can't skip the jump.
+static vector<unsigned char> straightLine(mt19937& random){
+  // Each layout with the operands filled in at random
+  enum operands { X_NN, X_Y, X, NNN };
+  struct layout {
+    unsigned short pattern;
+    operands fill;
+  };
+  static const layout layouts[] = {
+    {0x6000, X_NN}, {0x7000, X_NN}, {0x8000, X_Y}, {0x8001, X_Y}, {0x8002, X_Y},
+    {0x8003, X_Y}, {0x8004, X_Y}, {0x8005, X_Y}, {0x8006, X_Y}, {0x8007, X_Y},
+    {0x800E, X_Y}, {0xA000, NNN}, {0xF01E, X}, {0xF029, X},
+    {0x3000, X_NN}, {0x4000, X_NN}, {0x5000, X_Y}, {0x9000, X_Y} // the skips, last
+  };
+  static const int LAYOUTS = sizeof(layouts) / sizeof(layouts[0]);
+  static const int SKIPS = 4;
+
+  vector<unsigned short> code;
+  int length = 4 + random() % 40;
+  for(int k = 0; k < length; ++k){
+    const layout& l = layouts[random() % (k + 1 == length ? LAYOUTS - SKIPS : LAYOUTS)];
+    unsigned short x = random() % 16, y = random() % 16;
+    switch(l.fill){
+    case X_NN:
+      code.push_back(l.pattern | x << 8 | random() % 256);
+      break;
+    case X_Y:
+      code.push_back(l.pattern | x << 8 | y << 4);
+      break;
+    case X:
+      code.push_back(l.pattern | x << 8);
+      break;
+    case NNN:
+      code.push_back(l.pattern | random() % 0x1000);
+      break;
+    }
+  }
+
+  // Back to the start with 1NNN, or with BNNN once V0 and V2 (the registers
+  // B200 adds, depending on the quirks) are cleared
+  if(random() % 4 == 0){
+    code.push_back(0x6000);
+    code.push_back(0x6200);
+    code.push_back(0xB200);
+  }
+  else{
+    code.push_back(0x1200);
+  }
+
+  vector<unsigned char> rom;
+  for(unsigned short op : code){
+    rom.push_back(op >> 8);
+    rom.push_back(op & 0xFF);
+  }
+  return rom;
+}
+
+// A loop and a subroutine it calls, made of every CHIP-8 instruction the
+// lanes run. Skips on random numbers, keys and timers send lanes given
+// different seeds and keys different ways. Jumps stay inside the loop or the
+// subroutine so calls and returns pair up, and skips are never last, so the
+// loop always jumps back and the subroutine always returns. I stays clear of
+// the code, except now and then to have the lanes rewrite their own code. Now
+// and then there's an opcode only later machines have, which CHIP-8 traps on,
+// or a skip over F000, which is only two words long on XO-CHIP. FX0A is left
+// out so the lanes don't spend their time waiting.
+static vector<unsigned char> branching(mt19937& random){
+  static const unsigned short layouts[] = {
+    0x00E0, 0x6000, 0x7000, 0x8000, 0x8001, 0x8002, 0x8003, 0x8004, 0x8005,
+    0x8006, 0x8007, 0x800E, 0xA000, 0xC000, 0xC000, 0xD000, 0xF007, 0xF015,
+    0xF018, 0xF01E, 0xF029, 0xF033, 0xF055, 0xF065, 0x1000, 0x2000, 0xB000,
+    0x3000, 0x4000, 0x5000, 0x9000, 0xE09E, 0xE0A1 // the skips, last
+  };
+  static const int LAYOUTS = sizeof(layouts) / sizeof(layouts[0]);
+  static const int SKIPS = 6;
+  static const unsigned short later[] = {
+    0x00C1, 0x00D1, 0x00FB, 0x00FC, 0x00FD, 0x00FE, 0x00FF, 0x5012, 0x5013,
+    0xF000, 0xF101, 0xF002, 0xF030, 0xF03A, 0xF075, 0xF085
+  };
+  static const int LATER = sizeof(later) / sizeof(later[0]);
+
+  int loop = 8 + random() % 40, subroutine = 4 + random() % 20;
+  vector<unsigned short> code;
+  // Fills the block of size instructions starting at first, ending with end
+  auto fill = [&](int first, int size, unsigned short end){
+    while((int) code.size() < first + size - 1){
+      bool last = (int) code.size() + 2 == first + size;
+      unsigned short op = layouts[random() % (last ? LAYOUTS - SKIPS : LAYOUTS)];
+      unsigned short x = random() % 16, y = random() % 16;
+      unsigned short target = 0x200 + 2 * (first + random() % size); // in the same block
+      if(random() % 64 == 0){
+        code.push_back(later[random() % LATER]);
+        continue;
+      }
+      switch(op & 0xF000){
+      case 0x0000:
+        break;
+      case 0x1000:
+        op |= target;
+        break;
+      case 0x2000:
+        op = end == 0x1200 ? op | (0x200 + 2 * loop) : 0x00E0; // only the loop calls
+        break;
+      case 0xA000:
+        op |= random() % 8 == 0 ? 0x200 + random() % (2 * loop) : 0x400 + random() % 0x800;
+        break;
+      case 0xB000:
+        if(last){
+          op = 0x6000; // no room to clear V0 first
+        }
+        else{
+          code.push_back(0x6000);
+          op |= target;
+        }
+        break;
+      case 0x3000: case 0x4000: case 0xC000:
+        op |= x << 8 | (random() % 2 == 0 ? random() % 4 : random() % 256); // small ones split lanes
+        if(op < 0x5000 && random() % 4 == 0 && (int) code.size() + 3 < first + size){
+          code.push_back(op);
+          code.push_back(0xF000);
+          op = 0x6000 | x << 8; // what a taken skip lands on
+        }
+        break;
+      case 0x6000: case 0x7000:
+        op |= x << 8 | random() % 256;
+        break;
+      case 0x5000: case 0x8000: case 0x9000:
+        op |= x << 8 | y << 4;
+        break;
+      case 0xD000:
+        op |= x << 8 | y << 4 | random() % 16;
+        break;
+      default:
+        op |= x << 8;
+        break;
+      }
+      code.push_back(op);
+    }
+    code.push_back(end);
+  };
+  fill(0, loop, 0x1200);
+  fill(loop, subroutine, 0x00EE);
+
+  // Code at the very end of ram, where the lanes fetch past 4KB. The
+  // subroutine stores the registers there, wrapping round to the start of
+  // ram, and goes there when a random number says so rather than returning.
+  if(random() % 2 == 0){
+    unsigned short end = 0xFF8 + random() % 8;
+    code.pop_back();
+    code.push_back(0xA000 | end);
+    code.push_back(0xFF55);
+    code.push_back(0xC001);
+    code.push_back(0x3000);
+    code.push_back(0x1000 | (end + random() % (0x1000 - end)));
+    code.push_back(0x00EE);
+  }
+
+  vector<unsigned char> rom;
+  for(unsigned short op : code){
+    rom.push_back(op >> 8);
+    rom.push_back(op & 0xFF);
+  }
+  return rom;
+}
+
+// Runs a ROM in every lane and through runWithInput(), each lane with its own
+// seed, key presses and instructions per frame shared by all, and returns the
+// number of lanes whose final state differs
+static int compareLanes(const vector<unsigned char>& rom, mt19937& random){
+  unsigned long perFrame = 1 + random() % 20;
+  unsigned long instructions = FRAMES * perFrame;
+  vector<vector<key_event> > events(lockstep::LANES);
+  vector<uint64_t> seeds(lockstep::LANES);
+  unique_ptr<lockstep> engine(new lockstep);
+  for(int k = 0; k < lockstep::LANES; ++k){
+    for(int e = random() % 20; e > 0; --e){
+      key_event press = {random() % FRAMES, (unsigned char) (random() % 16),
+                         (unsigned char) (random() % 2)};
+      events[k].push_back(press);
+    }
+    stable_sort(events[k].begin(), events[k].end(),
+                [](const key_event& a, const key_event& b){ return a.frame < b.frame; });
+
+    seeds[k] = random();
+    cpu chip8;
+    chip8.seed(seeds[k]);
+    chip8.loadGame(rom.data(), rom.size());
+    cpu::state initial;
+    chip8.saveState(initial);
+    engine->loadState(k, initial);
+  }
+
+  // The frame loop of runLanes() in batch.cpp
+  vector<size_t> next(lockstep::LANES, 0);
+  uint32_t stopped = 0;
+  unsigned long executed = 0;
+  while(executed < instructions && stopped != 0xFFFFFFFF){
+    unsigned long frame = executed / perFrame;
+    for(int k = 0; k < lockstep::LANES; ++k){
+      const vector<key_event>& script = events[k];
+      while(!(stopped & (1u << k)) && next[k] < script.size() && script[next[k]].frame <= frame){
+        engine->setKey(k, script[next[k]].key, script[next[k]].down);
+        ++next[k];
+      }
+    }
+    unsigned long batch = min(perFrame - executed % perFrame, instructions - executed);
+    engine->run(batch);
+    executed += batch;
+    uint32_t ticks = 0;
+    for(int k = 0; k < lockstep::LANES; ++k){
+      if(!(stopped & (1u << k)) && engine->getExecuted(k) % perFrame == 0){
+        ticks |= 1u << k;
+      }
+    }
+    engine->tickTimers(ticks);
+    stopped = engine->getTrapped();
+  }
+
+  int differ = 0;
+  for(int k = 0; k < lockstep::LANES; ++k){
+    cpu chip8;
+    chip8.seed(seeds[k]);
+    chip8.loadGame(rom.data(), rom.size());
+    runWithInput(chip8, events[k], instructions, perFrame);
+    static cpu::state alone, lane;
+    chip8.saveState(alone);
+    engine->saveState(k, lane);
+    if(memcmp(&alone, &lane, sizeof(alone)) != 0){
+      ++differ;
+    }
+  }
+  return differ;
+}
+
+static void load(cpu& chip8, const vector<unsigned char>& rom, quirk_profile quirks){
+  chip8.seed(1);
+  chip8.setQuirks(quirks);
+  chip8.loadGame(rom.data(), rom.size());
+}
+
+static bool sameRegisters(cpu& a, cpu& b){
+  return memcmp(a.getRegisters(), b.getRegisters(), 16) == 0 &&
+         a.getIndex() == b.getIndex() && a.getProgramCounter() == b.getProgramCounter();
+}
+
+static bool sameState(cpu& a, cpu& b){
+  static cpu::state first, second;
+  a.saveState(first);
+  b.saveState(second);
+  return memcmp(&first, &second, sizeof(first)) == 0;
+}
+
+static void printRom(const vector<unsigned char>& rom){
+  for(size_t n = 0; n + 1 < rom.size(); n += 2){
+    cout << ' ' << hex << (rom[n] << 8 | rom[n + 1]) << dec;
+  }
+  cout << endl;
+}
@@ -1,35 +1,48 @@
 #include "cpu.h"
+#include "ops.h"
+#include "blockcache.h"
+#include "jit.h"
+#include "trace.h"
+#include "breakpoints.h"
+#include "profiler.h"
+#include "audio.h"
 #include <string>
 #include <iostream>
 #include <fstream>
 #include <random>
+#include <cstring>
 using namespace::std;
 
-static unsigned char random_number();
 
-cpu::cpu() : opcode(0), i(0), pc(0x200), sp(0) {
+cpu::cpu() : opcode(0), decoded(decodeTable(QUIRKS_MODERN, PLATFORM_CHIP8)), blocks(new block_cache), tracing(NULL),
+             stops(NULL), profiling(NULL), sounding(NULL), i(0), pc(0x200), sp(0), mask(0xFFF),
+             platform(PLATFORM_CHIP8), quirks(QUIRKS_MODERN), skipping(true), touched(~0ULL), hires(false), planes(1), pitch(64) {
   // Clear display
-  clearScreen();
+  memset(screen, 0, sizeof(screen));
+  memset(presented, 0, sizeof(presented));
+  memset(pattern, 0, sizeof(pattern));
 
   // Clear stack
   for(int i = 0; i < 16; ++i){
     stack[i] = 0;
   }
 
-  // Clear registers V0-VF
+  // Clear registers V0-VF and the flags
   for(int i = 0; i < 16; ++i){
     reg[i] = 0;
+    flags[i] = 0;
   }
 
   // Clear memory
-  for(int i = 0; i < 4096; ++i){
-    ram[i] = 0;
-  }
+  memset(ram, 0, sizeof(ram));
 
-  // Load fontset into memory
+  // Load both fontsets into memory
   for(int i = 0; i < 80; ++i){
     ram[i] = chip8_fontset[i];
   }
+  for(int i = 0; i < 160; ++i){
+    ram[0x50 + i] = big_fontset[i];
+  }
 
   // Clear keypad array
   for(int i = 0; i < 16; ++i){
@@ -39,364 +52,1162 @@ cpu::cpu() : opcode(0), i(0), pc(0x200), sp(0) {
   // Reset timers
   delay_timer = 0;
   sound_timer = 0;
+
+  // Seed the random number generator differently each run unless seed() is called
+  seed(((uint64_t) random_device()() << 32) | random_device()());
+}
+
+cpu::~cpu(){
 }
 
-void cpu::loadGame(istream &game){
+// Each platform has its own decode table, so a change of platform drops
+// whatever was decoded with the old one, as a change of quirks does
+void cpu::setPlatform(rom_platform p){
+  mask = p == PLATFORM_XOCHIP ? 0xFFFF : 0xFFF;
+  if(p == platform){
+    return;
+  }
+  platform = p;
+  decoded = decodeTable(quirks, p);
+  blocks->clear();
+  if(compiled){
+    compiled->clear();
+  }
+}
+
+rom_platform cpu::getPlatform(){
+  return platform;
+}
+
+// Decoded blocks and native code hold the old table's handlers, so they're
+// dropped
+void cpu::setQuirks(quirk_profile q){
+  if(q == quirks){
+    return;
+  }
+  quirks = q;
+  decoded = decodeTable(q, platform);
+  blocks->clear();
+  if(compiled){
+    compiled->clear();
+  }
+}
+
+quirk_profile cpu::getQuirks(){
+  return quirks;
+}
+
+bool cpu::loadGame(istream &game){
   // get length of file
   game.seekg(0, game.end);
-  int length = game.tellg();
+  streamoff length = game.tellg();
   game.seekg(0, game.beg);
+  if(length < 0 || length > maxRomSize(platform)){
+    return false;
+  }
+
+  // Read straight into memory starting at position 512 (0x200)
+  if(!game.read((char*) ram + 0x200, length)){
+    return false;
+  }
+  memset(ram + 0x200 + length, 0, sizeof(ram) - 0x200 - length);
+
+  // Anything decoded before is stale now
+  blocks->clear();
+  if(compiled){
+    compiled->clear();
+  }
+  return true;
+}
+
+bool cpu::loadGame(const unsigned char* rom, size_t length){
+  if(length > maxRomSize(platform)){
+    return false;
+  }
 
-  // Create dynamic array for size of file. Reads one byte at a time to buffer
-  char * buffer = new char [length];
-  game.read(buffer, length);
+  // Set the ROM into memory starting at position 512 (0x200). An empty ROM
+  // may come with no data at all, which memcpy mustn't be given.
+  if(length > 0){
+    memcpy(ram + 0x200, rom, length);
+  }
+  memset(ram + 0x200 + length, 0, sizeof(ram) - 0x200 - length);
 
-  // Set buffer into memory starting at position 512 (0x200)
-  for(int i = 0; i < length; ++i){
-    ram[i + 512] = buffer[i];
+  // Anything decoded before is stale now
+  blocks->clear();
+  if(compiled){
+    compiled->clear();
   }
+  return true;
+}
 
-  // Free dynamically allocated memory
-  delete[] buffer;
+// The state's arrays are copied straight into the members they mirror
+static_assert(sizeof(unsigned short) == sizeof(uint16_t), "state layout mismatch");
+static_assert(sizeof(cpu::state) % 8 == 0, "state has a tail of padding");
+
+void cpu::saveState(state& out){
+  memcpy(out.magic, "SKST", 4);
+  out.version = state::VERSION;
+  out.platform = platform;
+  out.hires = hires;
+  out.size = sizeof(state);
+  out.planes = planes;
+  out.pitch = pitch;
+  memcpy(out.ram, ram, sizeof(ram));
+  memcpy(out.screen, screen, sizeof(screen));
+  out.rng = rng;
+  memcpy(out.stack, stack, sizeof(stack));
+  out.i = i;
+  out.pc = pc;
+  out.sp = sp;
+  memcpy(out.reg, reg, sizeof(reg));
+  memcpy(out.key, key, sizeof(key));
+  out.delay_timer = delay_timer;
+  out.sound_timer = sound_timer;
+  memcpy(out.flags, flags, sizeof(flags));
+  memcpy(out.pattern, pattern, sizeof(pattern));
+  out.drawflag = drawflag;
+  out.trapflag = trapflag;
+}
+
+bool cpu::loadState(const state& in){
+  if(memcmp(in.magic, "SKST", 4) != 0 || in.version != state::VERSION ||
+     in.size != sizeof(state) || in.sp > 16 || in.platform > PLATFORM_XOCHIP ||
+     in.planes > 3){
+    return false;
+  }
+  setPlatform((rom_platform) in.platform);
+
+  // Only code that actually changed is dropped from the caches, so restoring
+  // a recent snapshot over and over keeps everything that's been decoded
+  for(unsigned int a = 0; a < sizeof(ram); a += 64){
+    if(memcmp(ram + a, in.ram + a, 64) != 0){
+      memcpy(ram + a, in.ram + a, 64);
+      invalidate(a, 64);
+    }
+  }
+
+  memcpy(screen, in.screen, sizeof(screen));
+  hires = in.hires != 0;
+  planes = in.planes;
+  touched = ~0ULL; // takeDirtyRows() reports whatever differs from before
+  rng = in.rng;
+  memcpy(stack, in.stack, sizeof(stack));
+  i = in.i;
+  pc = in.pc;
+  opcode = ram[pc] << 8 | ram[(unsigned short) (pc + 1)]; // what a trapped cpu is stuck on
+  sp = in.sp;
+  memcpy(reg, in.reg, sizeof(reg));
+  memcpy(key, in.key, sizeof(key));
+  memcpy(flags, in.flags, sizeof(flags));
+  memcpy(pattern, in.pattern, sizeof(pattern));
+  pitch = in.pitch;
+  delay_timer = in.delay_timer;
+  sound_timer = in.sound_timer;
+  drawflag = true;
+  trapflag = in.trapflag != 0;
+  return true;
+}
+
+const cpu::ops::spec cpu::ops::specs[] = {
+  {0xFFFF, 0x00E0, "00E0", &ops::op00E0, 0, PLATFORM_CHIP8,
+   "CLS", "Clear the screen"},
+  {0xFFFF, 0x00EE, "00EE", &ops::op00EE, instruction::JUMP, PLATFORM_CHIP8,
+   "RET", "Return from the subroutine"},
+  {0xFFF0, 0x00C0, "00CN", &ops::op00CN, instruction::DRAW, PLATFORM_SCHIP,
+   "SCD {n}", "Scroll the screen down {n} rows"},
+  {0xFFF0, 0x00D0, "00DN", &ops::op00DN, instruction::DRAW, PLATFORM_XOCHIP,
+   "SCU {n}", "Scroll the screen up {n} rows"},
+  {0xFFFF, 0x00FB, "00FB", &ops::op00FB, instruction::DRAW, PLATFORM_SCHIP,
+   "SCR", "Scroll the screen right 4 pixels"},
+  {0xFFFF, 0x00FC, "00FC", &ops::op00FC, instruction::DRAW, PLATFORM_SCHIP,
+   "SCL", "Scroll the screen left 4 pixels"},
+  {0xFFFF, 0x00FD, "00FD", &ops::op00FD, instruction::WAIT, PLATFORM_SCHIP,
+   "EXIT", "Stop the program"},
+  {0xFFFF, 0x00FE, "00FE", &ops::op00FE, instruction::DRAW, PLATFORM_SCHIP,
+   "LOW", "Switch to the 64x32 screen and clear it"},
+  {0xFFFF, 0x00FF, "00FF", &ops::op00FF, instruction::DRAW, PLATFORM_SCHIP,
+   "HIGH", "Switch to the 128x64 screen and clear it"},
+  {0xF000, 0x1000, "1NNN", &ops::op1NNN, instruction::JUMP, PLATFORM_CHIP8,
+   "JP {nnn}", "Jump to {nnn}"},
+  {0xF000, 0x2000, "2NNN", &ops::op2NNN, instruction::JUMP, PLATFORM_CHIP8,
+   "CALL {nnn}", "Call the subroutine at {nnn}"},
+  {0xF000, 0x3000, "3XNN", &ops::op3XNN, instruction::SKIP, PLATFORM_CHIP8,
+   "SE V{x}, {nn}", "Skip the next instruction if V{x} = {nn}"},
+  {0xF000, 0x4000, "4XNN", &ops::op4XNN, instruction::SKIP, PLATFORM_CHIP8,
+   "SNE V{x}, {nn}", "Skip the next instruction if V{x} != {nn}"},
+  {0xF00F, 0x5000, "5XY0", &ops::op5XY0, instruction::SKIP, PLATFORM_CHIP8,
+   "SE V{x}, V{y}", "Skip the next instruction if V{x} = V{y}"},
+  {0xF00F, 0x5002, "5XY2", &ops::op5XY2, instruction::STORE, PLATFORM_XOCHIP,
+   "SAVE V{x} - V{y}", "Store V{x} to V{y} in memory starting at I"},
+  {0xF00F, 0x5003, "5XY3", &ops::op5XY3, 0, PLATFORM_XOCHIP,
+   "LOAD V{x} - V{y}", "Fill V{x} to V{y} from memory starting at I"},
+  {0xF000, 0x6000, "6XNN", &ops::op6XNN, 0, PLATFORM_CHIP8,
+   "LD V{x}, {nn}", "Set V{x} to {nn}"},
+  {0xF000, 0x7000, "7XNN", &ops::op7XNN, 0, PLATFORM_CHIP8,
+   "ADD V{x}, {nn}", "Add {nn} to V{x}"},
+  {0xF00F, 0x8000, "8XY0", &ops::op8XY0, 0, PLATFORM_CHIP8,
+   "LD V{x}, V{y}", "Set V{x} to V{y}"},
+  {0xF00F, 0x8001, "8XY1", &ops::quirky<ops::modern>::op8XY1, 0, PLATFORM_CHIP8,
+   "OR V{x}, V{y}", "Set V{x} to V{x} OR V{y}"},
+  {0xF00F, 0x8002, "8XY2", &ops::quirky<ops::modern>::op8XY2, 0, PLATFORM_CHIP8,
+   "AND V{x}, V{y}", "Set V{x} to V{x} AND V{y}"},
+  {0xF00F, 0x8003, "8XY3", &ops::quirky<ops::modern>::op8XY3, 0, PLATFORM_CHIP8,
+   "XOR V{x}, V{y}", "Set V{x} to V{x} XOR V{y}"},
+  {0xF00F, 0x8004, "8XY4", &ops::op8XY4, 0, PLATFORM_CHIP8,
+   "ADD V{x}, V{y}", "Add V{y} to V{x}. VF is set to 1 if there's a carry, 0 if not"},
+  {0xF00F, 0x8005, "8XY5", &ops::op8XY5, 0, PLATFORM_CHIP8,
+   "SUB V{x}, V{y}", "Subtract V{y} from V{x}. VF is set to 0 if there's a borrow, 1 if not"},
+  {0xF00F, 0x8006, "8XY6", &ops::quirky<ops::modern>::op8XY6, 0, PLATFORM_CHIP8,
+   "SHR V{x}", "Shift V{x} right by one bit. VF is set to the least significant bit before the shift"},
+  {0xF00F, 0x8007, "8XY7", &ops::op8XY7, 0, PLATFORM_CHIP8,
+   "SUBN V{x}, V{y}", "Set V{x} to V{y} minus V{x}. VF is set to 0 if there's a borrow, 1 if not"},
+  {0xF00F, 0x800E, "8XYE", &ops::quirky<ops::modern>::op8XYE, 0, PLATFORM_CHIP8,
+   "SHL V{x}", "Shift V{x} left by one bit. VF is set to the most significant bit before the shift"},
+  {0xF00F, 0x9000, "9XY0", &ops::op9XY0, instruction::SKIP, PLATFORM_CHIP8,
+   "SNE V{x}, V{y}", "Skip the next instruction if V{x} != V{y}"},
+  {0xF000, 0xA000, "ANNN", &ops::opANNN, 0, PLATFORM_CHIP8,
+   "LD I, {nnn}", "Set I to {nnn}"},
+  {0xF000, 0xB000, "BNNN", &ops::quirky<ops::modern>::opBNNN, instruction::JUMP, PLATFORM_CHIP8,
+   "JP V0, {nnn}", "Jump to {nnn} plus V0"},
+  {0xF000, 0xC000, "CXNN", &ops::opCXNN, 0, PLATFORM_CHIP8,
+   "RND V{x}, {nn}", "Set V{x} to a random number AND {nn}"},
+  {0xF000, 0xD000, "DXYN", &ops::quirky<ops::modern>::opDXYN, instruction::DRAW, PLATFORM_CHIP8,
+   "DRW V{x}, V{y}, {n}", "Draw the {n} row sprite at I at (V{x}, V{y}), 16x16 if {n} is 0. VF is set to 1 if any pixel is turned off"},
+  {0xF0FF, 0xE09E, "EX9E", &ops::opEX9E, instruction::SKIP, PLATFORM_CHIP8,
+   "SKP V{x}", "Skip the next instruction if the key in V{x} is pressed"},
+  {0xF0FF, 0xE0A1, "EXA1", &ops::opEXA1, instruction::SKIP, PLATFORM_CHIP8,
+   "SKNP V{x}", "Skip the next instruction if the key in V{x} isn't pressed"},
+  {0xFFFF, 0xF000, "F000", &ops::opF000, instruction::JUMP, PLATFORM_XOCHIP,
+   "LD I, LONG", "Set I to the 16-bit address in the next two bytes"},
+  {0xF0FF, 0xF001, "FN01", &ops::opFN01, 0, PLATFORM_XOCHIP,
+   "PLANE {x}", "Draw to, scroll and clear bit-planes {x} (1 is the first, 2 the second)"},
+  {0xFFFF, 0xF002, "F002", &ops::opF002, 0, PLATFORM_XOCHIP,
+   "AUDIO", "Load the 16 byte audio pattern at I"},
+  {0xF0FF, 0xF007, "FX07", &ops::opFX07, 0, PLATFORM_CHIP8,
+   "LD V{x}, DT", "Set V{x} to the delay timer"},
+  {0xF0FF, 0xF00A, "FX0A", &ops::opFX0A, instruction::WAIT, PLATFORM_CHIP8,
+   "LD V{x}, K", "Wait for a key press and store the key in V{x}"},
+  {0xF0FF, 0xF015, "FX15", &ops::opFX15, 0, PLATFORM_CHIP8,
+   "LD DT, V{x}", "Set the delay timer to V{x}"},
+  {0xF0FF, 0xF018, "FX18", &ops::opFX18, 0, PLATFORM_CHIP8,
+   "LD ST, V{x}", "Set the sound timer to V{x}"},
+  {0xF0FF, 0xF01E, "FX1E", &ops::opFX1E, 0, PLATFORM_CHIP8,
+   "ADD I, V{x}", "Add V{x} to I"},
+  {0xF0FF, 0xF029, "FX29", &ops::opFX29, 0, PLATFORM_CHIP8,
+   "LD F, V{x}", "Set I to the font sprite for the digit in V{x}"},
+  {0xF0FF, 0xF030, "FX30", &ops::opFX30, 0, PLATFORM_SCHIP,
+   "LD HF, V{x}", "Set I to the big font sprite for the digit in V{x}"},
+  {0xF0FF, 0xF033, "FX33", &ops::opFX33, instruction::STORE, PLATFORM_CHIP8,
+   "LD B, V{x}", "Store the decimal digits of V{x} at I, I+1 and I+2"},
+  {0xF0FF, 0xF055, "FX55", &ops::quirky<ops::modern>::opFX55, instruction::STORE, PLATFORM_CHIP8,
+   "LD [I], V{x}", "Store V0 to V{x} in memory starting at I"},
+  {0xF0FF, 0xF065, "FX65", &ops::quirky<ops::modern>::opFX65, 0, PLATFORM_CHIP8,
+   "LD V{x}, [I]", "Fill V0 to V{x} from memory starting at I"},
+  {0xF0FF, 0xF03A, "FX3A", &ops::opFX3A, 0, PLATFORM_XOCHIP,
+   "PITCH V{x}", "Set the pitch of the audio pattern to V{x}"},
+  {0xF0FF, 0xF075, "FX75", &ops::opFX75, 0, PLATFORM_SCHIP,
+   "LD R, V{x}", "Store V0 to V{x} in the flags"},
+  {0xF0FF, 0xF085, "FX85", &ops::opFX85, 0, PLATFORM_SCHIP,
+   "LD V{x}, R", "Fill V0 to V{x} from the flags"},
+};
+const int cpu::ops::SPEC_COUNT = sizeof(specs) / sizeof(specs[0]);
+
+const cpu::instruction* cpu::decodeTable(quirk_profile quirks, rom_platform platform){
+  switch(quirks){
+  case QUIRKS_COSMAC:
+    return ops::table<ops::cosmac>(platform);
+  case QUIRKS_SCHIP:
+    return ops::table<ops::schip>(platform);
+  case QUIRKS_XOCHIP:
+    return ops::table<ops::xochip>(platform);
+  default:
+    return ops::table<ops::modern>(platform);
+  }
+}
+
+cpu::ops::quirk_set cpu::ops::quirksOf(quirk_profile profile){
+  switch(profile){
+  case QUIRKS_COSMAC:
+    return {cosmac::SHIFT_VY, cosmac::MOVE_I, cosmac::JUMP_VX, cosmac::CLIP, cosmac::RESET_VF};
+  case QUIRKS_SCHIP:
+    return {schip::SHIFT_VY, schip::MOVE_I, schip::JUMP_VX, schip::CLIP, schip::RESET_VF};
+  case QUIRKS_XOCHIP:
+    return {xochip::SHIFT_VY, xochip::MOVE_I, xochip::JUMP_VX, xochip::CLIP, xochip::RESET_VF};
+  default:
+    return {modern::SHIFT_VY, modern::MOVE_I, modern::JUMP_VX, modern::CLIP, modern::RESET_VF};
+  }
+}
+
+// specs names the modern handlers. This is the one Q uses instead.
+template <class Q>
+cpu::ops::handler cpu::ops::pick(handler h){
+  typedef quirky<modern> from;
+  typedef quirky<Q> to;
+  const handler swaps[][2] = {
+    {&from::op8XY1, &to::op8XY1},
+    {&from::op8XY2, &to::op8XY2},
+    {&from::op8XY3, &to::op8XY3},
+    {&from::op8XY6, &to::op8XY6},
+    {&from::op8XYE, &to::op8XYE},
+    {&from::opBNNN, &to::opBNNN},
+    {&from::opDXYN, &to::opDXYN},
+    {&from::opFX55, &to::opFX55},
+    {&from::opFX65, &to::opFX65},
+  };
+  for(const auto& swap : swaps){
+    if(h == swap[0]){
+      return swap[1];
+    }
+  }
+  return h;
+}
+
+// Maps each of the 65536 possible opcodes to its handler with the operands
+// already pulled out. There's one for each quirk profile and platform, shared
+// by every cpu. A later machine's opcodes trap on the platforms before it.
+template <class Q>
+const cpu::instruction* cpu::ops::table(rom_platform platform){
+  static instruction tables[PLATFORM_XOCHIP + 1][0x10000];
+  static bool built[PLATFORM_XOCHIP + 1] = {false, false, false};
+  instruction* table = tables[platform];
+  if(built[platform]){
+    return table;
+  }
+  for(unsigned int oc = 0; oc < 0x10000; ++oc){
+    instruction& op = table[oc];
+    op.exec = &trap; // anything not in specs is an unknown opcode
+    op.flags = instruction::TRAP;
+    for(const spec& s : specs){
+      if((oc & s.mask) == s.pattern && s.platform <= platform){
+        op.exec = pick<Q>(s.exec);
+        op.flags = s.flags;
+        break;
+      }
+    }
+    op.nnn = oc & 0x0FFF;
+    op.x = (oc & 0x0F00) >> 8;
+    op.y = (oc & 0x00F0) >> 4;
+    op.n = oc & 0x000F;
+    op.nn = oc & 0x00FF;
+  }
+  built[platform] = true;
+  return table;
 }
 
 void cpu::cycle(){
   // Obtain next opcode
   // Works by shifting the first byte to the left by adding 8 zeroes. Then,
   // by using OR, it combines both into a two byte value.
-  opcode = ram[pc] << 8 | ram[pc + 1];
-
-  // Decode the opcode
-  switch(opcode & 0xF000){ // checks the first 4 bits of opcode
-    // Execute with large switch statement
-    case 0x0000:
-      switch(opcode & 0x000F){ // checks last 4 bits of opcode
-        case 0x000E: //0x00EE
-          // return from subroutine
-          --sp;
-          pc = stack[sp];
-          stack[sp] = 0;
-          pc += 2;
-        break;
+  opcode = ram[pc] << 8 | ram[(unsigned short) (pc + 1)];
+
+  // Decode and execute the opcode with a single table lookup
+  const instruction& op = decoded[opcode];
+  op.exec(*this, op);
+}
 
-        case 0x0000: //0x00E0
-          // clear the screen
-          clearScreen();
-          pc += 2;
+unsigned long cpu::run(unsigned long count){
+  // Tracing, breakpoints and profiling are checked once per call so they
+  // cost nothing when they're off
+  if(stops != NULL || profiling != NULL){
+    return runChecked(count);
+  }
+  if(tracing != NULL){
+    return runTraced(count);
+  }
+
+  // Only this fast path skips idle loops. Traced, debugged and profiled runs
+  // go round them instruction by instruction, so every one is recorded.
+  unsigned long executed = skipping ? skipIdle(count) : 0;
+  while(executed < count){
+    unsigned short from = pc;
+    unsigned long n = compiled ? compiled->execute(*this, count - executed) : 0;
+    if(n == 0){
+      n = runBlock(count - executed);
+      if(trapflag){
+        executed += n;
         break;
       }
-    break;
-
-      case 0x1000: //0x1NNN
-        // Jumps to address NNN
-        pc = opcode & 0x0FFF;
-      break;
+    }
+    executed += n;
 
-      case 0x2000: //0x2NNN
-        // Calls subroutine at NNN
-        stack[sp] = pc;
-        ++sp;
-        pc = opcode & 0x0FFF;
-      break;
+    // Idle loops only ever go backwards or nowhere, so that's the only time
+    // they're looked for
+    if(pc <= from && executed < count && skipping){
+      executed += skipIdle(count - executed);
+    }
+  }
+  return executed;
+}
 
-      case 0x3000: //0x3XNN
-        // Skips the next instruction if VX = NN
-        if(reg[(opcode & 0x0F00) >> 8] == (opcode & 0x00FF)){
-          pc += 4;
-        }
-        else{
-          pc += 2;
-        }
-      break;
+// Keys only change and the timers only tick between calls to run(), so once
+// the cpu is idle it stays idle for the rest of the call. Waiting for a key,
+// jumping to itself or exited with 00FD, nothing changes at all. A delay timer
+// loop sets VX to the timer and goes round again, so whole times round are
+// counted and the cpu is left just as running them would have.
+unsigned long cpu::skipIdle(unsigned long count){
+  // Most instructions can't be an idle loop, and that's cheap to rule out
+  // from the opcode alone: only FX0A, FX07, a jump to itself and 00FD can be
+  unsigned char high = ram[pc], low = ram[(unsigned short) (pc + 1)];
+  bool candidate = (high & 0xF0) == 0xF0 ? low == 0x0A || low == 0x07 :
+                   (high & 0xF0) == 0x10 ? ((high & 0x0F) << 8 | low) == pc :
+                   high == 0x00 && low == 0xFD;
+  if(!candidate){
+    return 0;
+  }
 
-      case 0x4000: //0x4XNN
-        // Skips the next instruction if VX != NN
-        if(reg[(opcode & 0x0F00) >> 8] != (opcode & 0x00FF)){
-          pc += 4;
-        }
-        else{
-          pc += 2;
-        }
-      break;
+  switch(getIdle()){
+  case WAIT_KEY:
+  case HALTED:
+    opcode = ram[pc] << 8 | ram[(unsigned short) (pc + 1)];
+    return count;
+  case WAIT_TIMER:
+    if(count < 3){
+      return 0;
+    }
+    reg[ram[pc] & 0x0F] = delay_timer;
+    opcode = 0x1000 | pc; // the jump back
+    return count - count % 3;
+  default:
+    return 0;
+  }
+}
 
-      case 0x5000: //0x5XY0
-        // Skips the next instruction if VX equals VY
-        if(reg[(opcode & 0x0F00) >> 8] == reg[(opcode & 0x00F0) >> 4]){
-          pc += 4;
-        }
-        else{
-          pc += 2;
-        }
-      break;
+cpu::idle_state cpu::getIdle(){
+  const instruction& op = decoded[ram[pc] << 8 | ram[(unsigned short) (pc + 1)]];
+  if(op.exec == &ops::opFX0A){
+    for(int n = 0; n < 16; ++n){
+      if(key[n] != 0){
+        return BUSY;
+      }
+    }
+    return WAIT_KEY;
+  }
+  if((op.exec == &ops::op1NNN && op.nnn == pc) || op.exec == &ops::op00FD){
+    return HALTED;
+  }
 
-      case 0x6000: //0x6XNN
-        // Sets VX to NN
-        reg[(opcode & 0x0F00) >> 8] = (opcode & 0x00FF);
-        pc += 2;
-      break;
+  // FX07, then 3XNN or 4XNN on the same register, then a jump back to the
+  // FX07, for as long as the skip isn't taken
+  if(op.exec == &ops::opFX07){
+    unsigned short at = pc + 2;
+    const instruction& test = decoded[ram[at] << 8 | ram[(unsigned short) (at + 1)]];
+    at += 2;
+    const instruction& back = decoded[ram[at] << 8 | ram[(unsigned short) (at + 1)]];
+    if(test.x == op.x && back.exec == &ops::op1NNN && back.nnn == pc &&
+       ((test.exec == &ops::op3XNN && delay_timer != test.nn) ||
+        (test.exec == &ops::op4XNN && delay_timer == test.nn))){
+      return WAIT_TIMER;
+    }
+  }
+  return BUSY;
+}
 
-      case 0x7000: //0x7XNN
-        // Adds NN to VX
-        reg[(opcode & 0x0F00) >> 8] += (opcode & 0x00FF);
-        pc += 2;
-      break;
+unsigned long cpu::runBlock(unsigned long count){
+  if(pc >= 4096){ // XO-CHIP code past the blocks the cache holds
+    cycle();
+    return 1;
+  }
+  const block_cache::block& b = blocks->fetch(decoded, ram, pc);
+  if(b.length == 0){ // the last byte of ram, decoded the slow way
+    cycle();
+    return 1;
+  }
 
-      case 0x8000:
-        switch(opcode & 0x000F){
-          case 0x0000: //0x8XY0
-            // Sets VX to the value of VY
-            reg[(opcode & 0x0F00) >> 8] = reg[(opcode & 0x00F0) >> 4];
-            pc += 2;
-          break;
-
-          case 0x0001: //0x8XY1
-            // Sets VX to VX or VY
-            reg[(opcode & 0x0F00) >> 8] = reg[(opcode & 0x0F00) >> 8] | reg[(opcode & 0x00F0) >> 4];
-            pc += 2;
-          break;
-
-          case 0x0002: //0x8XY2
-            // Sets VX to VX and VY
-            reg[(opcode & 0x0F00) >> 8] = reg[(opcode & 0x0F00) >> 8] & reg[(opcode & 0x00F0) >> 4];
-            pc += 2;
-          break;
-
-          case 0x0003: //0x8XY3
-            // Sets VX to VX xor VY
-            reg[(opcode & 0x0F00) >> 8] = reg[(opcode & 0x0F00) >> 8] ^ reg[(opcode & 0x00F0) >> 4];
-            pc += 2;
-          break;
-
-          case 0x0004: //0x8XY4
-            // Adds VY to VX. VF set to 1 when there's a carry and to 0 when there isn't
-            // Explicit cast to int to tell if there's overflow
-            if((int) reg[(opcode & 0x0F00) >> 8] + (int) reg[(opcode & 0x00F0) >> 4] > 255){
-              reg[0xF] = 1;
-            }
-            else{
-              reg[0xF] = 0;
-            }
-            reg[(opcode & 0x0F00) >>8] += reg[(opcode & 0x00F0) >> 4];
-            pc += 2;
-          break;
-
-          case 0x0005: //0x8XY5
-            // Subtracts VY from VX. VF is set to 0 when there's a borrow, 1 otherwise
-            if((int) reg[(opcode & 0x0F00) >> 8] - (int) reg[(opcode & 0x00F0) >> 4] < 0){
-              reg[0xF] = 0;
-            }
-            else{
-              reg[0xF] = 1;
-            }
-            reg[(opcode & 0x0F00) >> 8] -= reg[(opcode & 0x00F0) >> 4];
-            pc += 2;
-          break;
-
-          case 0x0006: //0x8XY6
-            // Shifts VX right by one. VF set to least significant bit before shift
-            reg[0xF] = reg[(opcode & 0x0F00) >> 8] & 0x1;
-            reg[(opcode & 0x0F00) >> 8] = reg[(opcode & 0x0F00) >> 8] >> 1;
-            pc += 2;
-          break;
-
-          case 0x0007: //0x8XY7
-            // Sets VX to VY - VX. If there's a borrow, VF set to 0. 1 otherwise.
-            if((int) reg[(opcode & 0x00F0) >> 4] - (int) reg[(opcode & 0x0F00) >> 8] < 0){
-              reg[0xF] = 0;
-            }
-            else{
-              reg[0xF] = 1;
-            }
-            reg[(opcode & 0x0F00) >> 8] = reg[(opcode & 0x00F0) >> 4] -reg[(opcode & 0x0F00) >> 8];
-            pc += 2;
-          break;
-
-          case 0x000E: //0x8XYE
-            // Shifts VX left by one. VF is set to the value of the most significant bit of VX
-            reg[0xF] = reg[(opcode & 0x0F00) >> 8] & 0x80;
-            reg[(opcode & 0x0F00) >> 8] = reg[(opcode & 0x0F00) >> 8] << 1;
-            pc += 2;
-          break;
-        }
-      break;
+  // Only the last instruction of a block can move pc anywhere but forward
+  unsigned long executed = 0;
+  for(int k = 0; k < b.length && executed < count; k += b.width[k]){
+    if(b.width[k] > count - executed){
+      // Not enough cycles left for the whole superinstruction
+      cycle();
+      return count;
+    }
+    const instruction& op = b.ops[k];
+    opcode = b.opcodes[k + b.width[k] - 1];
+    op.exec(*this, op);
+    executed += b.width[k];
+  }
+  return executed;
+}
 
-      case 0x9000: //0x9XY0
-        // Skips next instruction if VX doesn't equal VY
-        if(reg[(opcode & 0x0F00) >> 8] != reg[(opcode & 0x00F0) >> 4]){
-          pc += 4;
-        }
-        else{
-          pc += 2;
-        }
-      break;
+// Runs one instruction at a time, recording each one along with the first
+// register it changed
+unsigned long cpu::runTraced(unsigned long count){
+  unsigned long executed = 0;
+  while(executed < count){
+    unsigned short at = pc;
+    unsigned char before[16];
+    memcpy(before, reg, sizeof(before));
 
-      case 0xA000: //0xANNN
-        // Sets I to the address NNN
-        i = opcode & 0x0FFF;
-        pc += 2;
-      break;
+    cycle();
+    ++executed;
 
-      case 0xB000: //0xBNNN
-        // Jumps to the address NNN plus V0
-        pc = reg[0] + (opcode & 0x0FFF);
-      break;
+    unsigned char changed = tracer::NO_REGISTER;
+    for(int n = 0; n < 16; ++n){
+      if(reg[n] != before[n]){
+        changed = n;
+        break;
+      }
+    }
+    tracing->record(at, opcode, i, changed, changed < 16 ? reg[changed] : 0);
 
-      case 0xC000: //0xCXNN
-        // Sets VX to the result of a bitwise AND operation on a random number
-        // (typically 0 through 255) and NN
-        reg[(opcode & 0x0F00) >> 8] = random_number() & (opcode & 0x00FF);
-        pc += 2;
+    if(trapflag){
       break;
+    }
+  }
+  return executed;
+}
 
-      case 0xD000: //0xDXYN
-        // Draws a sprite at coordinate (VX, VY) that has width 8 pixels and
-        // height N pixels. Each row of 8 pixels is read as bit-coded starting
-        // from memory location I (I doesn't change after this). VF is set to 1
-        // if any screen pixels are flipped from set to unset when the sprite
-        // is drawn and 0 if it doesn't
-      {
-        // x and y represent coordinates. height is the height of the sprite
-        // to be drawn (width is always 8)
-        unsigned short x = reg[(opcode & 0x0F00) >> 8];
-        unsigned short y = reg[(opcode & 0x00F0) >> 4];
-        unsigned short height = opcode & 0x000F;
-        unsigned short pixel;
-
-        reg[0xF] = 0; //VF set to 0 to start. will be set to 1 if a lit pixel is turned off
-        for(int yline = 0; yline < height; ++yline){ // for each row...
-          pixel = ram[i + yline]; // set pixel to the string of bits starting at I + row
-          for(int xline = 0; xline < 8; ++xline){ // for each column...
-            if((pixel & (0x80 >> xline)) != 0){ // checks one bit of pixel
-              if(screen[(x + xline + ((y + yline) * 64))] == 1){
-                reg[0xF] = 1;
-              }
-              screen[x + xline + ((y + yline) * 64)] ^= 1; //xor with 1.
-            }
-          }
-        }
-        drawflag = true;
-        pc += 2;
+// Runs one instruction at a time, stopping early when a breakpoint hits and
+// counting each instruction into the profiler. The instruction is still
+// traced if tracing is on.
+unsigned long cpu::runChecked(unsigned long count){
+  unsigned long executed = 0;
+  while(executed < count){
+    unsigned short at = pc;
+    bool accessed = false;
+    if(stops != NULL){
+      if(stops->stopAt(at)){
+        break;
       }
-      break;
+      unsigned short next = ram[at] << 8 | ram[(unsigned short) (at + 1)];
+      accessed = stops->stopAccess(at, next, i);
+    }
+
+    if(tracing != NULL){
+      runTraced(1);
+    }
+    else{
+      cycle();
+    }
+    ++executed;
+    if(profiling != NULL){
+      profiling->record(at, opcode, pc);
+    }
 
-      case 0xE000:
-        switch(opcode & 0x00FF){
-          case 0x009E: //0xEX9E
-            // Skips the next instruction if the ket stored in VX is pressed
-            if(key[reg[(opcode & 0x0F00) >> 8]] != 0){
-              pc += 4;
-            }
-            else{
-              pc += 2;
-            }
-          break;
-
-          case 0x00A1: //0xEXA1
-            // Skips the next instruction if the key stored in VX isn't pressed
-            if(key[reg[(opcode & 0x0F00) >> 8]] == 0){
-              pc += 4;
-            }
-            else{
-              pc += 2;
-            }
-          break;
-        }
+    if(trapflag){
       break;
+    }
+    if(stops != NULL &&
+       (stops->stopCondition(at, reg, i, delay_timer, sound_timer) || accessed)){
+      break;
+    }
+  }
+  return executed;
+}
 
-      case 0xF000:
-        switch(opcode & 0x00FF){
-          case 0x0007: //0xFX07
-            // Sets VX to the value of the delay timer
-            reg[(opcode & 0x0F00) >> 8] = delay_timer;
-            pc += 2;
-          break;
-
-          case 0x000A: //0xFX0A
-            // A key press is awaited, then stored in VX. All instruction is
-            // halted until the next key event.
-            for(int n = 0; n < 16; ++n){
-              if(key[n] != 0){
-                reg[(opcode & 0x0F00) >> 8] = n;
-                pc += 2;
-              }
-            }
-          break;
-
-          case 0x0015: //0xFX15
-            // Sets the delay timer to VX
-            delay_timer = reg[(opcode & 0x0F00) >> 8];
-            pc += 2;
-          break;
-
-          case 0x0018: //0xFX18
-            // Sets the sound timer to VX
-            sound_timer = reg[(opcode & 0x0F00) >> 8];
-            pc += 2;
-          break;
-
-          case 0x001E: //0xFX1E
-            // Adds VX to I
-            i += reg[(opcode & 0x0F00) >> 8];
-            pc += 2;
-          break;
-
-          case 0x0029: //0xFX29
-            // Sets I to the location of the sprite for the character in VX
-            i = reg[(opcode & 0x0F00) >> 8] * 0x5;
-            pc += 2;
-          break;
-
-          case 0x0033: //0xFX33
-            // Stores the binary coded decimal representation of VX, with the
-            // most significant of three digits at the address in I, the middle
-            // digit at I plys 1, and the least significant digit at I plus 2.
-            ram[i]     = (reg[(opcode & 0x0F00) >> 8] / 100);
-            ram[i + 1] = (reg[(opcode & 0x0F00) >> 8] / 10) % 10;
-            ram[i + 2] = (reg[(opcode & 0x0F00) >> 8] % 10);
-            pc += 2;
-          break;
-
-          case 0x0055: //0xFX55
-            // Stores V0 through VX in memory starting at address I
-            for(int n = 0; n <= ((opcode & 0x0F00) >> 8); ++n){
-              ram[i + n] = reg[n];
-            }
-
-            pc += 2;
-          break;
-
-          case 0x0065: //0xFX65
-            // Fills V0 through VX with values from memory starting ad address I
-            for(int n = 0; n <= (opcode & 0x0F00) >> 8; ++n){
-              reg[n] = ram[i + n];
-            }
-
-            pc += 2;
-          break;
-        }
-        break;
+void cpu::setTracer(tracer* t){
+  tracing = t;
+}
+
+void cpu::setBreakpoints(breakpoints* b){
+  stops = b;
+}
 
-      default:
-        cout << "Ruh roh! This opcode wasn't implemented!" << endl;
-        pc += 2;
+void cpu::setProfiler(profiler* p){
+  profiling = p;
+}
+
+void cpu::setBuzzer(buzzer* b){
+  sounding = b;
+}
+
+bool cpu::useJit(bool enabled){
+  if(enabled && jit::available()){
+    compiled.reset(new jit);
+    return true;
+  }
+  compiled.reset();
+  return !enabled;
+}
+
+// Measuring how fast instructions run means running every one, so benchmarks
+// turn skipping off
+void cpu::skipIdleLoops(bool enabled){
+  skipping = enabled;
+}
+
+void cpu::tickTimers(){
+  // The frame that's ending sounds if the sound timer ran through it. XO-CHIP
+  // programs play their pattern, the rest a plain buzz.
+  if(sounding != NULL){
+    sounding->frame(sound_timer > 0, platform == PLATFORM_XOCHIP ? pattern : NULL, pitch);
   }
 
-  // Update timers
   if(delay_timer > 0){
     --delay_timer;
   }
   if(sound_timer > 0){
-    if(sound_timer == 1){
-      // make sound
-    }
     --sound_timer;
   }
+  if(profiling != NULL){
+    profiling->frame();
+  }
+}
+
+void cpu::invalidate(unsigned int address, unsigned int length){
+  address &= mask;
+  if(address + length > mask + 1u){ // wrapped around to the start of ram
+    invalidate(0, address + length - (mask + 1u));
+    length = mask + 1u - address;
+  }
+  blocks->invalidate(address, length);
+  if(compiled){
+    compiled->invalidate(address, length);
+  }
 }
 
+void cpu::ops::op00E0(cpu& c, const instruction&){
+  // clear the screen
+  c.clearScreen();
+  c.pc += 2;
+}
+
+void cpu::ops::op00EE(cpu& c, const instruction& op){
+  // return from subroutine. With nothing on the stack it traps instead.
+  if(c.sp == 0){
+    trap(c, op);
+    return;
+  }
+  --c.sp;
+  c.pc = c.stack[c.sp];
+  c.stack[c.sp] = 0;
+  c.pc += 2;
+}
+
+void cpu::ops::op00CN(cpu& c, const instruction& op){
+  // Scrolls the selected planes down N rows, a row at a time
+  unsigned int height = c.hires ? 64 : 32;
+  for(int p = 0; p < 2; ++p){
+    if(c.planes & (1 << p)){
+      memmove(c.screen[p][op.n], c.screen[p][0], (height - op.n) * sizeof(c.screen[p][0]));
+      memset(c.screen[p][0], 0, op.n * sizeof(c.screen[p][0]));
+    }
+  }
+  c.touchAll();
+  c.drawflag = true;
+  c.pc += 2;
+}
+
+void cpu::ops::op00DN(cpu& c, const instruction& op){
+  // Scrolls the selected planes up N rows
+  unsigned int height = c.hires ? 64 : 32;
+  for(int p = 0; p < 2; ++p){
+    if(c.planes & (1 << p)){
+      memmove(c.screen[p][0], c.screen[p][op.n], (height - op.n) * sizeof(c.screen[p][0]));
+      memset(c.screen[p][height - op.n], 0, op.n * sizeof(c.screen[p][0]));
+    }
+  }
+  c.touchAll();
+  c.drawflag = true;
+  c.pc += 2;
+}
+
+void cpu::ops::op00FB(cpu& c, const instruction&){
+  // Scrolls the selected planes right 4 pixels. A high resolution row
+  // carries the pixels from its first word into its second.
+  unsigned int height = c.hires ? 64 : 32;
+  for(int p = 0; p < 2; ++p){
+    if(c.planes & (1 << p)){
+      for(unsigned int y = 0; y < height; ++y){
+        uint64_t* row = c.screen[p][y];
+        row[1] = c.hires ? (row[1] >> 4) | (row[0] << 60) : 0;
+        row[0] >>= 4;
+      }
+    }
+  }
+  c.touchAll();
+  c.drawflag = true;
+  c.pc += 2;
+}
+
+void cpu::ops::op00FC(cpu& c, const instruction&){
+  // Scrolls the selected planes left 4 pixels
+  unsigned int height = c.hires ? 64 : 32;
+  for(int p = 0; p < 2; ++p){
+    if(c.planes & (1 << p)){
+      for(unsigned int y = 0; y < height; ++y){
+        uint64_t* row = c.screen[p][y];
+        row[0] = (row[0] << 4) | (row[1] >> 60);
+        row[1] <<= 4;
+      }
+    }
+  }
+  c.touchAll();
+  c.drawflag = true;
+  c.pc += 2;
+}
+
+void cpu::ops::op00FD(cpu&, const instruction&){
+  // Exits the interpreter. The program counter stays here from now on.
+}
+
+void cpu::ops::op00FE(cpu& c, const instruction&){
+  // Switches to the 64x32 screen, clearing both planes
+  c.hires = false;
+  memset(c.screen, 0, sizeof(c.screen));
+  c.touched = ~0ULL;
+  c.drawflag = true;
+  c.pc += 2;
+}
+
+void cpu::ops::op00FF(cpu& c, const instruction&){
+  // Switches to the 128x64 screen, clearing both planes
+  c.hires = true;
+  memset(c.screen, 0, sizeof(c.screen));
+  c.touched = ~0ULL;
+  c.drawflag = true;
+  c.pc += 2;
+}
+
+void cpu::ops::op1NNN(cpu& c, const instruction& op){
+  // Jumps to address NNN
+  c.pc = op.nnn;
+}
+
+void cpu::ops::op2NNN(cpu& c, const instruction& op){
+  // Calls subroutine at NNN. With the stack full it traps instead.
+  if(c.sp == 16){
+    trap(c, op);
+    return;
+  }
+  c.stack[c.sp] = c.pc;
+  ++c.sp;
+  c.pc = op.nnn;
+}
+
+// Moves pc past the next instruction if taken is set, or on to it if not.
+// XO-CHIP's F000 NNNN is two words long, so skipping it skips both. The
+// platforms before it have no F000, and skip a word like any other.
+void cpu::ops::skip(cpu& c, bool taken){
+  if(!taken){
+    c.pc += 2;
+    return;
+  }
+  bool isLong = c.platform == PLATFORM_XOCHIP && c.ram[(unsigned short) (c.pc + 2)] == 0xF0 &&
+                c.ram[(unsigned short) (c.pc + 3)] == 0x00;
+  c.pc += isLong ? 6 : 4;
+}
+
+void cpu::ops::op3XNN(cpu& c, const instruction& op){
+  // Skips the next instruction if VX = NN
+  skip(c, c.reg[op.x] == op.nn);
+}
+
+void cpu::ops::op4XNN(cpu& c, const instruction& op){
+  // Skips the next instruction if VX != NN
+  skip(c, c.reg[op.x] != op.nn);
+}
+
+void cpu::ops::op5XY0(cpu& c, const instruction& op){
+  // Skips the next instruction if VX equals VY
+  skip(c, c.reg[op.x] == c.reg[op.y]);
+}
+
+void cpu::ops::op5XY2(cpu& c, const instruction& op){
+  // Stores VX through VY in memory starting at address I, in reverse order
+  // if Y is below X. I doesn't change.
+  int step = op.x <= op.y ? 1 : -1;
+  int count = (op.x <= op.y ? op.y - op.x : op.x - op.y) + 1;
+  for(int n = 0; n < count; ++n){
+    c.ram[(c.i + n) & c.mask] = c.reg[op.x + n * step];
+  }
+  c.invalidate(c.i, count);
+  c.pc += 2;
+}
+
+void cpu::ops::op5XY3(cpu& c, const instruction& op){
+  // Fills VX through VY from memory starting at address I
+  int step = op.x <= op.y ? 1 : -1;
+  int count = (op.x <= op.y ? op.y - op.x : op.x - op.y) + 1;
+  for(int n = 0; n < count; ++n){
+    c.reg[op.x + n * step] = c.ram[(c.i + n) & c.mask];
+  }
+  c.pc += 2;
+}
+
+void cpu::ops::op6XNN(cpu& c, const instruction& op){
+  // Sets VX to NN
+  c.reg[op.x] = op.nn;
+  c.pc += 2;
+}
+
+void cpu::ops::op7XNN(cpu& c, const instruction& op){
+  // Adds NN to VX
+  c.reg[op.x] += op.nn;
+  c.pc += 2;
+}
+
+void cpu::ops::op8XY0(cpu& c, const instruction& op){
+  // Sets VX to the value of VY
+  c.reg[op.x] = c.reg[op.y];
+  c.pc += 2;
+}
+
+template <class Q>
+void cpu::ops::quirky<Q>::op8XY1(cpu& c, const instruction& op){
+  // Sets VX to VX or VY. The COSMAC VIP also sets VF to 0.
+  c.reg[op.x] = c.reg[op.x] | c.reg[op.y];
+  if(Q::RESET_VF){
+    c.reg[0xF] = 0;
+  }
+  c.pc += 2;
+}
+
+template <class Q>
+void cpu::ops::quirky<Q>::op8XY2(cpu& c, const instruction& op){
+  // Sets VX to VX and VY
+  c.reg[op.x] = c.reg[op.x] & c.reg[op.y];
+  if(Q::RESET_VF){
+    c.reg[0xF] = 0;
+  }
+  c.pc += 2;
+}
+
+template <class Q>
+void cpu::ops::quirky<Q>::op8XY3(cpu& c, const instruction& op){
+  // Sets VX to VX xor VY
+  c.reg[op.x] = c.reg[op.x] ^ c.reg[op.y];
+  if(Q::RESET_VF){
+    c.reg[0xF] = 0;
+  }
+  c.pc += 2;
+}
+
+void cpu::ops::op8XY4(cpu& c, const instruction& op){
+  // Adds VY to VX. VF set to 1 when there's a carry and to 0 when there isn't
+  // Explicit cast to int to tell if there's overflow. VF is written last, so
+  // when X is F it ends up holding the flag, not the sum.
+  unsigned char flag = (int) c.reg[op.x] + (int) c.reg[op.y] > 255 ? 1 : 0;
+  c.reg[op.x] += c.reg[op.y];
+  c.reg[0xF] = flag;
+  c.pc += 2;
+}
+
+void cpu::ops::op8XY5(cpu& c, const instruction& op){
+  // Subtracts VY from VX. VF is set to 0 when there's a borrow, 1 otherwise
+  unsigned char flag = (int) c.reg[op.x] - (int) c.reg[op.y] < 0 ? 0 : 1;
+  c.reg[op.x] -= c.reg[op.y];
+  c.reg[0xF] = flag;
+  c.pc += 2;
+}
+
+template <class Q>
+void cpu::ops::quirky<Q>::op8XY6(cpu& c, const instruction& op){
+  // Shifts VX right by one, or sets VX to VY shifted right by one. VF set to
+  // least significant bit before shift
+  unsigned char from = c.reg[Q::SHIFT_VY ? op.y : op.x];
+  c.reg[op.x] = from >> 1;
+  c.reg[0xF] = from & 0x1;
+  c.pc += 2;
+}
+
+void cpu::ops::op8XY7(cpu& c, const instruction& op){
+  // Sets VX to VY - VX. If there's a borrow, VF set to 0. 1 otherwise.
+  unsigned char flag = (int) c.reg[op.y] - (int) c.reg[op.x] < 0 ? 0 : 1;
+  c.reg[op.x] = c.reg[op.y] - c.reg[op.x];
+  c.reg[0xF] = flag;
+  c.pc += 2;
+}
+
+template <class Q>
+void cpu::ops::quirky<Q>::op8XYE(cpu& c, const instruction& op){
+  // Shifts VX, or VY into VX, left by one. VF is set to the most
+  // significant bit of what's shifted, 0 or 1
+  unsigned char from = c.reg[Q::SHIFT_VY ? op.y : op.x];
+  c.reg[op.x] = from << 1;
+  c.reg[0xF] = from >> 7;
+  c.pc += 2;
+}
+
+void cpu::ops::op9XY0(cpu& c, const instruction& op){
+  // Skips next instruction if VX doesn't equal VY
+  skip(c, c.reg[op.x] != c.reg[op.y]);
+}
+
+void cpu::ops::opANNN(cpu& c, const instruction& op){
+  // Sets I to the address NNN
+  c.i = op.nnn;
+  c.pc += 2;
+}
+
+template <class Q>
+void cpu::ops::quirky<Q>::opBNNN(cpu& c, const instruction& op){
+  // Jumps to the address NNN plus V0, or on SUPER-CHIP to XNN plus VX
+  c.pc = c.reg[Q::JUMP_VX ? op.x : 0] + op.nnn;
+}
+
+void cpu::ops::opCXNN(cpu& c, const instruction& op){
+  // Sets VX to the result of a bitwise AND operation on a random number
+  // (typically 0 through 255) and NN
+  c.reg[op.x] = c.randomNumber() & op.nn;
+  c.pc += 2;
+}
+
+template <class Q>
+void cpu::ops::quirky<Q>::opDXYN(cpu& c, const instruction& op){
+  // Draws a sprite at coordinate (VX, VY) that has width 8 pixels and
+  // height N pixels. Each row of 8 pixels is read as bit-coded starting
+  // from memory location I (I doesn't change after this). VF is set to 1
+  // if any screen pixels are flipped from set to unset when the sprite
+  // is drawn and 0 if it doesn't
+
+  // DXY0 draws a 16x16 sprite of two bytes per row instead, except on the
+  // CHIP-8 screen where it draws nothing. Each selected plane takes the next
+  // rows of sprite data from I onwards.
+
+  // x and y represent coordinates, wrapped onto the screen. height is the
+  // height of the sprite to be drawn. With clipping, the parts of the sprite
+  // past the right or bottom edge are cut off instead of wrapping around.
+  unsigned int width = c.hires ? 128 : 64;
+  unsigned int lines = c.hires ? 64 : 32;
+  unsigned int x = c.reg[op.x] & (width - 1);
+  unsigned int y = c.reg[op.y] & (lines - 1);
+  unsigned int height = op.n;
+  unsigned int bytes = 1; // per row of the sprite
+  if(op.n == 0 && (c.hires || c.platform != PLATFORM_CHIP8)){
+    height = 16;
+    bytes = 2;
+  }
+  unsigned short address = c.i;
+  uint64_t collision = 0;
+
+  for(int p = 0; p < 2; ++p){
+    if((c.planes & (1 << p)) == 0){
+      continue;
+    }
+    uint64_t (*rows)[2] = c.screen[p];
+    for(unsigned int yline = 0; yline < height; ++yline, address += bytes){ // for each row...
+      // The row of pixels, starting from the leftmost bit
+      uint64_t left = (uint64_t) c.ram[address & c.mask] << 56;
+      if(bytes == 2){
+        left |= (uint64_t) c.ram[(address + 1) & c.mask] << 48;
+      }
+      if(Q::CLIP && y + yline >= lines){
+        continue;
+      }
+      unsigned int at = (y + yline) & (lines - 1);
+      c.touched |= 1ULL << at;
+
+      // Move it to column x, wrapping past the right edge
+      if(!c.hires){
+        left = x == 0 || Q::CLIP ? left >> x : (left >> x) | (left << (64 - x));
+        collision |= rows[at][0] & left; // lit pixels about to be turned off
+        rows[at][0] ^= left;
+        continue;
+      }
+
+      // A high resolution row is 128 bits across two words, so it's rotated
+      // a word at a time and then by what's left
+      uint64_t right = 0;
+      if(x >= 64){
+        right = left;
+        left = 0;
+      }
+      unsigned int shift = x & 63;
+      if(shift != 0){
+        uint64_t carried = left << (64 - shift);
+        left = (left >> shift) | (Q::CLIP ? 0 : right << (64 - shift));
+        right = (right >> shift) | carried;
+      }
+      collision |= (rows[at][0] & left) | (rows[at][1] & right);
+      rows[at][0] ^= left;
+      rows[at][1] ^= right;
+    }
+  }
+  c.reg[0xF] = collision != 0 ? 1 : 0;
+  c.drawflag = true;
+  c.pc += 2;
+}
+
+void cpu::ops::opEX9E(cpu& c, const instruction& op){
+  // Skips the next instruction if the ket stored in VX is pressed. Values
+  // above F aren't keys, so they're never pressed.
+  skip(c, c.reg[op.x] < 16 && c.key[c.reg[op.x]] != 0);
+}
+
+void cpu::ops::opEXA1(cpu& c, const instruction& op){
+  // Skips the next instruction if the key stored in VX isn't pressed
+  skip(c, c.reg[op.x] >= 16 || c.key[c.reg[op.x]] == 0);
+}
+
+void cpu::ops::opF000(cpu& c, const instruction&){
+  // Sets I to the 16-bit address in the next two bytes and moves past them
+  c.i = c.ram[(unsigned short) (c.pc + 2)] << 8 | c.ram[(unsigned short) (c.pc + 3)];
+  c.pc += 4;
+}
+
+void cpu::ops::opFN01(cpu& c, const instruction& op){
+  // Selects the bit-planes that are drawn to, scrolled and cleared
+  c.planes = op.x & 0x3;
+  c.pc += 2;
+}
+
+void cpu::ops::opF002(cpu& c, const instruction&){
+  // Loads the 16 byte audio pattern at I
+  for(int n = 0; n < 16; ++n){
+    c.pattern[n] = c.ram[(c.i + n) & c.mask];
+  }
+  c.pc += 2;
+}
+
+void cpu::ops::opFX07(cpu& c, const instruction& op){
+  // Sets VX to the value of the delay timer
+  c.reg[op.x] = c.delay_timer;
+  c.pc += 2;
+}
+
+void cpu::ops::opFX0A(cpu& c, const instruction& op){
+  // A key press is awaited, then stored in VX. All instruction is
+  // halted until the next key event.
+  for(int n = 0; n < 16; ++n){
+    if(c.key[n] != 0){
+      c.reg[op.x] = n;
+      c.pc += 2;
+    }
+  }
+}
+
+void cpu::ops::opFX15(cpu& c, const instruction& op){
+  // Sets the delay timer to VX
+  c.delay_timer = c.reg[op.x];
+  c.pc += 2;
+}
+
+void cpu::ops::opFX18(cpu& c, const instruction& op){
+  // Sets the sound timer to VX
+  c.sound_timer = c.reg[op.x];
+  c.pc += 2;
+}
+
+void cpu::ops::opFX1E(cpu& c, const instruction& op){
+  // Adds VX to I
+  c.i += c.reg[op.x];
+  c.pc += 2;
+}
+
+void cpu::ops::opFX29(cpu& c, const instruction& op){
+  // Sets I to the location of the sprite for the character in VX
+  c.i = c.reg[op.x] * 0x5;
+  c.pc += 2;
+}
+
+void cpu::ops::opFX33(cpu& c, const instruction& op){
+  // Stores the binary coded decimal representation of VX, with the
+  // most significant of three digits at the address in I, the middle
+  // digit at I plys 1, and the least significant digit at I plus 2.
+  c.ram[c.i & c.mask]       = (c.reg[op.x] / 100);
+  c.ram[(c.i + 1) & c.mask] = (c.reg[op.x] / 10) % 10;
+  c.ram[(c.i + 2) & c.mask] = (c.reg[op.x] % 10);
+  c.invalidate(c.i, 3);
+  c.pc += 2;
+}
+
+template <class Q>
+void cpu::ops::quirky<Q>::opFX55(cpu& c, const instruction& op){
+  // Stores V0 through VX in memory starting at address I. The COSMAC VIP
+  // and XO-CHIP leave I just past them.
+  for(int n = 0; n <= op.x; ++n){
+    c.ram[(c.i + n) & c.mask] = c.reg[n];
+  }
+  c.invalidate(c.i, op.x + 1);
+  if(Q::MOVE_I){
+    c.i += op.x + 1;
+  }
+
+  c.pc += 2;
+}
+
+template <class Q>
+void cpu::ops::quirky<Q>::opFX65(cpu& c, const instruction& op){
+  // Fills V0 through VX with values from memory starting ad address I
+  for(int n = 0; n <= op.x; ++n){
+    c.reg[n] = c.ram[(c.i + n) & c.mask];
+  }
+  if(Q::MOVE_I){
+    c.i += op.x + 1;
+  }
+
+  c.pc += 2;
+}
+
+void cpu::ops::opFX30(cpu& c, const instruction& op){
+  // Sets I to the location of the big sprite for the character in VX
+  c.i = 0x50 + (c.reg[op.x] & 0xF) * 10;
+  c.pc += 2;
+}
+
+void cpu::ops::opFX3A(cpu& c, const instruction& op){
+  // Sets the pitch the audio pattern plays at
+  c.pitch = c.reg[op.x];
+  c.pc += 2;
+}
+
+void cpu::ops::opFX75(cpu& c, const instruction& op){
+  // Stores V0 through VX in the flags, which outlast the program
+  for(int n = 0; n <= op.x; ++n){
+    c.flags[n] = c.reg[n];
+  }
+  c.pc += 2;
+}
+
+void cpu::ops::opFX85(cpu& c, const instruction& op){
+  // Fills V0 through VX from the flags
+  for(int n = 0; n <= op.x; ++n){
+    c.reg[n] = c.flags[n];
+  }
+  c.pc += 2;
+}
+
+void cpu::ops::op6XNN_6XNN(cpu& c, const instruction& op){
+  // Sets VX to NN and then another register to the NN after it
+  const instruction& next = (&op)[1];
+  c.reg[op.x] = op.nn;
+  c.reg[next.x] = next.nn;
+  c.pc += 4;
+}
+
+template <class Q>
+void cpu::ops::quirky<Q>::opANNN_DXYN(cpu& c, const instruction& op){
+  // Sets I to NNN and draws the sprite found there
+  c.i = op.nnn;
+  c.pc += 2;
+  opDXYN(c, (&op)[1]);
+}
+
+void cpu::ops::trap(cpu& c, const instruction&){
+  // The opcode isn't implemented, or is a call or return the stack has no
+  // room for. The program counter is left where it is so the cpu stops
+  // here, and the frontend is told through the trapflag.
+  c.trapflag = true;
+}
+
+// Only the rows on the screen are cleared. Rows below them and the second
+// word of each row stay 0 on the 64x32 screen.
 void cpu::clearScreen(){
-  for(int i = 0; i < 64 * 32; ++i){
-    screen[i] = 0;
+  size_t used = (hires ? 64 : 32) * sizeof(screen[0][0]);
+  for(int p = 0; p < 2; ++p){
+    if(planes & (1 << p)){
+      memset(screen[p], 0, used);
+    }
   }
+  touchAll();
+}
+
+void cpu::touchAll(){
+  touched |= hires ? ~0ULL : 0xFFFFFFFFULL;
+}
+
+uint64_t cpu::takeDirtyRows(){
+  uint64_t dirty = 0;
+  for(int row = 0; touched != 0; ++row, touched >>= 1){
+    if((touched & 1) && (memcmp(screen[0][row], presented[0][row], sizeof(screen[0][row])) != 0 ||
+                         memcmp(screen[1][row], presented[1][row], sizeof(screen[1][row])) != 0)){
+      memcpy(presented[0][row], screen[0][row], sizeof(screen[0][row]));
+      memcpy(presented[1][row], screen[1][row], sizeof(screen[1][row]));
+      dirty |= 1ULL << row;
+    }
+  }
+  return dirty;
 }
 
 const unsigned short& cpu::getOpcode(){
@@ -417,10 +1228,57 @@ const unsigned short* cpu::getStack(){
 const unsigned short& cpu::getStackPointer(){
   return sp;
 }
+const unsigned char& cpu::getDelayTimer(){
+  return delay_timer;
+}
+const unsigned char& cpu::getSoundTimer(){
+  return sound_timer;
+}
+bool cpu::isHires(){
+  return hires;
+}
+int cpu::getWidth(){
+  return hires ? 128 : 64;
+}
+int cpu::getHeight(){
+  return hires ? 64 : 32;
+}
+const uint64_t* cpu::getPlane(int plane){
+  return screen[plane & 1][0];
+}
+unsigned char cpu::getPixel(int x, int y){
+  int bit = 63 - (x & 63);
+  return ((screen[0][y][x >> 6] >> bit) & 1) | (((screen[1][y][x >> 6] >> bit) & 1) << 1);
+}
+void cpu::getPixels(unsigned char* pixels){
+  int width = getWidth();
+  for(int y = 0; y < getHeight(); ++y){
+    for(int x = 0; x < width; ++x){
+      pixels[x + y * width] = getPixel(x, y);
+    }
+  }
+}
+
+// Spreads a seed over all 64 bits of state (splitmix64), so small or similar
+// seeds still give unrelated sequences and the state is never 0
+void cpu::seed(uint64_t seed){
+  uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z ^= z >> 31;
+  rng = z != 0 ? z : 0x9E3779B97F4A7C15ULL;
+}
 
-static unsigned char random_number(){
-  std::mt19937 rng;
-  rng.seed(std::random_device()());
-  std::uniform_int_distribution<std::mt19937::result_type> dist(0,255);
-  return dist(rng);
+// Returns the next random byte (xorshift64*)
+unsigned char cpu::randomNumber(){
+  rng ^= rng >> 12;
+  rng ^= rng << 25;
+  rng ^= rng >> 27;
+  return (rng * 0x2545F4914F6CDD1DULL) >> 56;
 }
+
+// Each quirk policy's handlers, see ops.h
+template struct cpu::ops::quirky<cpu::ops::modern>;
+template struct cpu::ops::quirky<cpu::ops::cosmac>;
+template struct cpu::ops::quirky<cpu::ops::schip>;
+template struct cpu::ops::quirky<cpu::ops::xochip>;
@@ -8,16 +8,153 @@
  */
 
 #include<string>
+#include<memory>
+#include<cstdint>
+#include<cstddef>
+
+class tracer;
+class breakpoints;
+class profiler;
+class buzzer;
+
+// Which machine a program is written for. The platform decides which opcodes
+// decode (the later machines' opcodes trap on the earlier ones), how much ram
+// a ROM may fill, how much of it I can reach and what DXY0 draws in low
+// resolution.
+enum rom_platform {
+  PLATFORM_CHIP8,
+  PLATFORM_SCHIP, // SUPER-CHIP: 128x64 high resolution, scrolling, 16x16 sprites
+  PLATFORM_XOCHIP // XO-CHIP: SUPER-CHIP plus 64KB of ram, two bit-planes and audio
+};
+
+// Which of the interpreters that disagree about some opcodes a program
+// expects. They differ in whether 8XY6 and 8XYE shift VY or VX, whether FX55
+// and FX65 leave I past the last register, whether BNNN adds V0 or is BXNN
+// adding VX, whether sprites are cut off or wrap at the edges of the screen,
+// and whether 8XY1, 8XY2 and 8XY3 set VF to 0.
+enum quirk_profile {
+  QUIRKS_MODERN, // what skylark has always done: shifts of VX, I left alone, BNNN, wrapping
+  QUIRKS_COSMAC, // the original COSMAC VIP: shifts of VY, I moved, BNNN, clipping, VF reset
+  QUIRKS_SCHIP,  // SUPER-CHIP 1.1: shifts of VX, I left alone, BXNN, clipping
+  QUIRKS_XOCHIP  // XO-CHIP: shifts of VY, I moved, BNNN, wrapping
+};
 
 class cpu {
 public:
+  // An opcode decoded ahead of time into the handler that executes it and
+  // its operands. Opcode layouts use X and Y for registers, N for a nibble,
+  // NN for a byte and NNN for an address.
+  struct instruction {
+    void (*exec)(cpu& chip8, const instruction& op);
+    unsigned short nnn;
+    unsigned char x, y, n, nn;
+    unsigned char flags; // what else the instruction does, see below
+
+    enum {
+      JUMP  = 0x01, // moves pc somewhere other than the next instruction
+      SKIP  = 0x02, // may skip the next instruction
+      DRAW  = 0x04, // draws to the screen
+      STORE = 0x08, // writes to ram
+      WAIT  = 0x10, // may stay on the same instruction
+      TRAP  = 0x20  // isn't implemented
+    };
+  };
+
+  // Everything needed to resume the machine, in a fixed layout with no
+  // pointers so it can be written out with one write() and read or mapped
+  // straight back in. Anything added to it needs a new VERSION.
+  struct state {
+    static const uint16_t VERSION = 2;
+
+    char magic[4]; // "SKST"
+    uint16_t version;
+    uint8_t platform; // a rom_platform
+    uint8_t hires;
+    uint32_t size; // sizeof(state)
+    uint8_t planes; // bit-planes selected by FN01
+    uint8_t pitch;
+    uint8_t drawflag, trapflag;
+    uint8_t ram[65536];
+    uint64_t screen[2][64][2]; // see getPlane()
+    uint64_t rng;
+    uint16_t stack[16];
+    uint16_t i, pc, sp;
+    uint8_t delay_timer, sound_timer;
+    uint8_t reg[16];
+    uint8_t key[16];
+    uint8_t flags[16]; // FX75 and FX85
+    uint8_t pattern[16]; // audio pattern, F002
+  };
+
   cpu(); // default constructor
+  ~cpu();
   bool drawflag = false; // if the drawflag is set to true, the screen is drawn
+  // set when an opcode that isn't implemented is hit, or a call with the stack
+  // full or a return with it empty
+  bool trapflag = false;
 
   void cycle(); // completes one cycle of emulation
-  void loadGame(std::istream &game); // loads the game
+  unsigned long run(unsigned long count); // runs count cycles from the block cache
+  bool useJit(bool enabled); // run() uses native code when possible
+  void skipIdleLoops(bool enabled); // run() counts idle loops instead of running them, on by default
+  void setTracer(tracer* t); // run() records every instruction to t, or NULL
+  void setBreakpoints(breakpoints* b); // run() stops when one of b hits, or NULL
+  void setProfiler(profiler* p); // run() counts every instruction into p, or NULL
+  void setBuzzer(buzzer* b); // tickTimers() renders the sound into b, or NULL
+  void tickTimers(); // counts the timers down, called 60 times per second
+
+  // What a program that's only waiting is waiting for. Until it's woken the
+  // cpu goes round the same loop without changing anything, so run() counts
+  // the instructions it would spend there instead of running them (unless
+  // skipIdleLoops(false) was called, or while tracing, debugging or profiling),
+  // and a frontend can sleep instead of running frames.
+  enum idle_state {
+    BUSY,       // not waiting
+    WAIT_KEY,   // FX0A with no key down: wakes when one is pressed
+    WAIT_TIMER, // reading the delay timer in a loop: wakes when it reaches a value
+    HALTED      // jumping to itself, or exited with 00FD: never wakes
+  };
+  idle_state getIdle();
+  void seed(uint64_t seed); // makes the random numbers of CXNN repeatable
+  // Programs are loaded at 0x200, so a ROM can be at most this big, or
+  // MAX_XO_ROM_SIZE for XO-CHIP, which has 64KB of ram
+  static const unsigned int MAX_ROM_SIZE = 4096 - 0x200;
+  static const unsigned int MAX_XO_ROM_SIZE = 0x10000 - 0x200;
+  static unsigned int maxRomSize(rom_platform platform){
+    return platform == PLATFORM_XOCHIP ? MAX_XO_ROM_SIZE : MAX_ROM_SIZE;
+  }
+
+  // Sets the machine the next game is loaded for. The default is CHIP-8.
+  void setPlatform(rom_platform p);
+  rom_platform getPlatform();
+
+  // Chooses the decode table built with the handlers for the quirks, which
+  // takes effect from the next instruction. The default is QUIRKS_MODERN.
+  void setQuirks(quirk_profile q);
+  quirk_profile getQuirks();
+  // What a program written for the platform most likely expects
+  static quirk_profile defaultQuirks(rom_platform platform){
+    return platform == PLATFORM_SCHIP ? QUIRKS_SCHIP :
+           platform == PLATFORM_XOCHIP ? QUIRKS_XOCHIP : QUIRKS_MODERN;
+  }
+
+  // Loads the game, or returns false if it doesn't fit in ram
+  bool loadGame(std::istream &game);
+  bool loadGame(const unsigned char* rom, size_t length);
+  // Writes opcode into out, which holds size bytes, as assembly such as
+  // "LD V3, 0x1F" or as a sentence saying what it does. If label is given it
+  // is written in place of a jump or call address. Like snprintf, out is
+  // always terminated and the untruncated length is returned. Neither
+  // allocates.
+  static size_t disassemble(unsigned short opcode, char* out, size_t size,
+                            const char* label = NULL);
+  static size_t describe(unsigned short opcode, char* out, size_t size);
+  // The layout opcode is decoded as, e.g. "8XY4", or NULL if it isn't implemented
+  static const char* opcodeName(unsigned short opcode);
+
+  void saveState(state& out); // captures the whole machine
+  bool loadState(const state& in); // false if in isn't a valid state
   unsigned char key[16]; // used for keypad control
-  unsigned char screen[64 * 32]; // represents the 64x32 pixel b/w screen
 
   const unsigned short& getOpcode();
   const unsigned char* getRegisters();
@@ -25,12 +162,43 @@ public:
   const unsigned short& getProgramCounter();
   const unsigned short* getStack();
   const unsigned short& getStackPointer();
+  const unsigned char& getDelayTimer();
+  const unsigned char& getSoundTimer();
+
+  // The screen is 64x32 pixels, or 128x64 in high resolution (00FF), and
+  // has two bit-planes. Each row of a plane is two 64-bit words with the
+  // leftmost pixel in the most significant bit of the first word. A 64x32
+  // screen only uses the first word of the first 32 rows.
+  bool isHires();
+  int getWidth();
+  int getHeight();
+  const uint64_t* getPlane(int plane); // 64 rows of 2 words, row after row
+  // The pixel's colour: bit 0 from the first plane and bit 1 from the second
+  unsigned char getPixel(int x, int y);
+  void getPixels(unsigned char* pixels); // fills width * height bytes, one per pixel
+
+  // Returns the rows that differ from when this was last called, one bit per
+  // row with row 0 in the least significant bit. Rows that were drawn to but
+  // ended up the same (e.g. a sprite drawn twice) aren't included.
+  uint64_t takeDirtyRows();
 
 private:
+  struct ops; // the opcode handlers, see ops.h
+  struct block_cache; // decoded runs of straight-line code, see blockcache.h
+  struct jit; // native code translated from hot regions, see jit.h
+  static const instruction* decodeTable(quirk_profile quirks, rom_platform platform);
+
   unsigned short opcode; // holds the current 2-byte opcode
+  const instruction* decoded; // maps every 2-byte opcode to its instruction
+  std::unique_ptr<block_cache> blocks;
+  std::unique_ptr<jit> compiled; // only set while the jit is in use
+  tracer* tracing; // only set while tracing
+  breakpoints* stops; // only set while debugging
+  profiler* profiling; // only set while profiling
+  buzzer* sounding; // only set while sound is played
 
   unsigned char reg[16]; // represents the CPU registers V0 through VE
-  unsigned char fontset[80]; // the fontset for the CHIP-8 stored in memory
+  unsigned char flags[16]; // SUPER-CHIP's persistent flags, see FX75 and FX85
 
   unsigned short i; // index register
   unsigned short pc; // program counter
@@ -44,8 +212,31 @@ private:
   unsigned short stack[16];
   unsigned short sp; // stack pointer stores the current stack level
 
-  unsigned char ram[4096]; // represents the 4096 8-bit memory locations
-  void clearScreen(); // clears the screen
+  // Represents the memory. CHIP-8 and SUPER-CHIP only reach the first 4096
+  // bytes through I, and addresses past the end wrap around.
+  unsigned char ram[0x10000];
+  unsigned short mask; // what an address through I is ANDed with
+  rom_platform platform;
+  quirk_profile quirks;
+  bool skipping; // run() skips idle loops
+
+  uint64_t screen[2][64][2]; // two bit-planes, see getPlane()
+  uint64_t presented[2][64][2]; // the screen when takeDirtyRows() was last called
+  uint64_t touched; // rows written to since then, one bit per row
+  bool hires; // 128x64 if set, 64x32 if not
+  unsigned char planes; // the bit-planes drawn to, one bit each
+  unsigned char pattern[16]; // XO-CHIP's 128 sample audio pattern
+  unsigned char pitch; // playback rate of the pattern
+  void clearScreen(); // clears the selected planes
+  void touchAll(); // marks every row of the screen as written to
+  unsigned char randomNumber(); // next random byte for CXNN
+
+  uint64_t rng; // state of the random number generator
+  unsigned long runBlock(unsigned long count); // runs at most one block
+  unsigned long skipIdle(unsigned long count); // instructions an idle cpu needn't run
+  unsigned long runTraced(unsigned long count); // run() while tracing
+  unsigned long runChecked(unsigned long count); // run() with breakpoints or profiling
+  void invalidate(unsigned int address, unsigned int length); // ram was written
 
   // Defines the fontset
   unsigned char chip8_fontset[80] =
@@ -67,6 +258,28 @@ private:
     0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
     0xF0, 0x80, 0xF0, 0x80, 0x80  // F
   };
+
+  // The 8x10 digits of SUPER-CHIP (and XO-CHIP's A to F), loaded after the
+  // small fontset at 0x50
+  unsigned char big_fontset[160] =
+  {
+    0x3C, 0x7E, 0xE7, 0xC3, 0xC3, 0xC3, 0xC3, 0xE7, 0x7E, 0x3C, // 0
+    0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, // 1
+    0x3E, 0x7F, 0xC3, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xFF, 0xFF, // 2
+    0x3C, 0x7E, 0xC3, 0x03, 0x0E, 0x0E, 0x03, 0xC3, 0x7E, 0x3C, // 3
+    0x06, 0x0E, 0x1E, 0x36, 0x66, 0xC6, 0xFF, 0xFF, 0x06, 0x06, // 4
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFE, 0x03, 0xC3, 0x7E, 0x3C, // 5
+    0x3E, 0x7C, 0xC0, 0xC0, 0xFC, 0xFE, 0xC3, 0xC3, 0x7E, 0x3C, // 6
+    0xFF, 0xFF, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x60, 0x60, // 7
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7E, 0x7E, 0xC3, 0xC3, 0x7E, 0x3C, // 8
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7F, 0x3F, 0x03, 0x03, 0x3E, 0x7C, // 9
+    0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+    0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, // B
+    0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, // C
+    0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // E
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  // F
+  };
 };
 
 #endif  // SKYLARK_CPU_H_
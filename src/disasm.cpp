@@ -0,0 +1,42 @@
+/*
+ *  disasm.cpp
+ *
+ *  Lists ROMs as assembly. Each ROM is mapped rather than read, and its
+ *  listing is formatted without allocating, so whole collections can be
+ *  listed quickly.
+ *
+ */
+
+#include "disassembler.h"
+#include "rom.h"
+#include <iostream>
+#include <cstdlib>
+
+using namespace std;
+
+int main(int argc, char* argv[]){
+
+  // Makes sure there's a proper number of arguments
+  if(argc < 2){
+    cout << "USAGE: disasm.exe <ROM_FILE>..." << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  int failed = 0;
+  for(int a = 1; a < argc; ++a){
+    rom_image rom;
+    if(!rom.open(argv[a])){
+      cerr << "Couldn't read " << argv[a] << endl;
+      ++failed;
+      continue;
+    }
+
+    // Several listings are told apart by a comment naming the ROM
+    if(argc > 2){
+      cout << (a > 1 ? "\n; " : "; ") << argv[a] << '\n';
+    }
+    listRom(rom.data(), rom.size(), cout);
+  }
+  cout << flush;
+  return failed == 0 ? 0 : EXIT_FAILURE;
+}
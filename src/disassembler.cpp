@@ -0,0 +1,205 @@
+#include "disassembler.h"
+#include "ops.h"
+#include <cstring>
+
+using namespace std;
+
+// Label kinds for listRom()
+static const unsigned char JUMP_TARGET = 1;
+static const unsigned char CALL_TARGET = 2;
+
+static const char HEX[] = "0123456789ABCDEF";
+
+// Maps each of the 65536 opcodes to its index in specs. It is built once and
+// shared, so disassembling an opcode is one lookup plus the formatting.
+int cpu::ops::find(unsigned short opcode){
+  struct lookup {
+    unsigned char index[0x10000];
+    lookup(){
+      for(unsigned int oc = 0; oc < 0x10000; ++oc){
+        index[oc] = SPEC_COUNT;
+        for(int s = 0; s < SPEC_COUNT; ++s){
+          if((oc & specs[s].mask) == specs[s].pattern){
+            index[oc] = s;
+            break;
+          }
+        }
+      }
+    }
+  };
+  static const lookup table;
+  return table.index[opcode];
+}
+
+// Copies text into out, filling in the operands of opcode. Only the first
+// size - 1 characters are kept, but the full length is counted.
+size_t cpu::ops::format(const char* text, unsigned short opcode, const char* label,
+                        char* out, size_t size){
+  size_t length = 0;
+  char field[8];
+  for(const char* c = text; *c != '\0'; ++c){
+    const char* put = field;
+    size_t count = 0;
+    if(*c != '{'){
+      field[0] = *c;
+      count = 1;
+    }
+    else if(strncmp(c, "{x}", 3) == 0 || strncmp(c, "{y}", 3) == 0){
+      field[0] = HEX[(opcode >> (c[1] == 'x' ? 8 : 4)) & 0xF];
+      count = 1;
+      c += 2;
+    }
+    else if(strncmp(c, "{n}", 3) == 0){ // sprite heights read better in decimal
+      unsigned int n = opcode & 0xF;
+      if(n >= 10){
+        field[count++] = '1';
+      }
+      field[count++] = '0' + n % 10;
+      c += 2;
+    }
+    else if(strncmp(c, "{nn}", 4) == 0){
+      memcpy(field, "0x", 2);
+      field[2] = HEX[(opcode >> 4) & 0xF];
+      field[3] = HEX[opcode & 0xF];
+      count = 4;
+      c += 3;
+    }
+    else if(strncmp(c, "{nnn}", 5) == 0){
+      if(label != NULL){
+        put = label;
+        count = strlen(label);
+      }
+      else{
+        memcpy(field, "0x", 2);
+        field[2] = HEX[(opcode >> 8) & 0xF];
+        field[3] = HEX[(opcode >> 4) & 0xF];
+        field[4] = HEX[opcode & 0xF];
+        count = 5;
+      }
+      c += 4;
+    }
+    else{
+      field[0] = *c;
+      count = 1;
+    }
+
+    for(size_t k = 0; k < count; ++k, ++length){
+      if(length + 1 < size){
+        out[length] = put[k];
+      }
+    }
+  }
+  if(size > 0){
+    out[length < size ? length : size - 1] = '\0';
+  }
+  return length;
+}
+
+size_t cpu::disassemble(unsigned short opcode, char* out, size_t size, const char* label){
+  int s = ops::find(opcode);
+  if(s == ops::SPEC_COUNT){
+    char word[] = "DW 0x0000";
+    for(int k = 0; k < 4; ++k){
+      word[5 + k] = HEX[(opcode >> (12 - 4 * k)) & 0xF];
+    }
+    return ops::format(word, opcode, NULL, out, size);
+  }
+  return ops::format(ops::specs[s].text, opcode, label, out, size);
+}
+
+size_t cpu::describe(unsigned short opcode, char* out, size_t size){
+  int s = ops::find(opcode);
+  if(s == ops::SPEC_COUNT){
+    return ops::format("Opcode isn't implemented", opcode, NULL, out, size);
+  }
+  return ops::format(ops::specs[s].about, opcode, NULL, out, size);
+}
+
+const char* cpu::opcodeName(unsigned short opcode){
+  int s = ops::find(opcode);
+  return s == ops::SPEC_COUNT ? NULL : ops::specs[s].name;
+}
+
+// Writes a label such as L2A4 into out, which holds at least 5 bytes
+static void labelName(unsigned char kind, unsigned int address, char* out){
+  out[0] = kind == CALL_TARGET ? 'S' : 'L';
+  out[1] = HEX[(address >> 8) & 0xF];
+  out[2] = HEX[(address >> 4) & 0xF];
+  out[3] = HEX[address & 0xF];
+  out[4] = '\0';
+}
+
+void listRom(const unsigned char* rom, size_t length, ostream& out){
+  if(length > cpu::MAX_XO_ROM_SIZE){
+    length = cpu::MAX_XO_ROM_SIZE;
+  }
+
+  // First pass: find every address that is jumped or called to. Only
+  // targets that start a line of the listing get a label, and a call
+  // outranks a jump so subroutines are always named Snnn.
+  unsigned char labels[4096] = {}; // jumps and calls only reach the first 4096 bytes
+  for(size_t at = 0; at + 1 < length; at += 2){
+    unsigned short opcode = rom[at] << 8 | rom[at + 1];
+    unsigned int target = opcode & 0x0FFF;
+    if(target < 0x200 || target >= 0x200 + length || (target & 1) != 0){
+      continue;
+    }
+    if((opcode & 0xF000) == 0x1000 && labels[target] == 0){
+      labels[target] = JUMP_TARGET;
+    }
+    else if((opcode & 0xF000) == 0x2000){
+      labels[target] = CALL_TARGET;
+    }
+  }
+
+  // Second pass: one line per instruction, with a line for each label
+  char line[80];
+  char label[8];
+  bool longAddress = false; // the word is the address of an F000 before it
+  for(size_t at = 0; at < length; at += 2){
+    unsigned int address = 0x200 + at;
+    if(address < 0x1000 && labels[address] != 0){
+      labelName(labels[address], address, label);
+      out << label << ":\n";
+    }
+
+    if(at + 1 == length){ // a byte left over at the end
+      memcpy(line, "  0000  00    DB 0x00\n", 23);
+      line[19] = line[8] = HEX[rom[at] >> 4];
+      line[20] = line[9] = HEX[rom[at] & 0xF];
+      for(int k = 0; k < 4; ++k){
+        line[2 + k] = HEX[(address >> (12 - 4 * k)) & 0xF];
+      }
+      out.write(line, 22);
+      break;
+    }
+
+    unsigned short opcode = rom[at] << 8 | rom[at + 1];
+    memcpy(line, "  0000  0000  ", 14);
+    for(int k = 0; k < 4; ++k){
+      line[2 + k] = HEX[(address >> (12 - 4 * k)) & 0xF];
+      line[8 + k] = HEX[(opcode >> (12 - 4 * k)) & 0xF];
+    }
+
+    // Jumps and calls into the ROM refer to their labels
+    const char* target = NULL;
+    unsigned int family = opcode & 0xF000;
+    if((family == 0x1000 || family == 0x2000) && labels[opcode & 0x0FFF] != 0){
+      labelName(labels[opcode & 0x0FFF], opcode & 0x0FFF, label);
+      target = label;
+    }
+    size_t text;
+    if(longAddress){
+      memcpy(line + 14, "DW 0x", 5);
+      memcpy(line + 19, line + 8, 4);
+      text = 9;
+    }
+    else{
+      text = cpu::disassemble(opcode, line + 14, sizeof(line) - 15, target);
+    }
+    longAddress = opcode == 0xF000 && !longAddress;
+    size_t used = 14 + (text < sizeof(line) - 16 ? text : sizeof(line) - 16);
+    line[used] = '\n';
+    out.write(line, used + 1);
+  }
+}
@@ -0,0 +1,20 @@
+#ifndef SKYLARK_DISASSEMBLER_H_
+#define SKYLARK_DISASSEMBLER_H_
+/*
+ *  disassembler.h
+ *
+ *  Lists a whole ROM as assembly, one instruction per line. Every address
+ *  jumped to gets a label Lnnn and every address called gets Snnn, and the
+ *  jumps and calls refer to the labels. Single opcodes are disassembled by
+ *  cpu::disassemble(), from the same table the cpu decodes with.
+ *
+ */
+
+#include "cpu.h"
+#include <ostream>
+
+// Writes the listing of rom, as it is loaded at 0x200, to out. Data mixed in
+// with the code is listed as DW (or DB for an odd byte at the end).
+void listRom(const unsigned char* rom, size_t length, std::ostream& out);
+
+#endif  // SKYLARK_DISASSEMBLER_H_
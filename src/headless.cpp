@@ -0,0 +1,289 @@
+/*
+ *  headless.cpp
+ *
+ *  Runs the emulator without any display or SDL dependency. A ROM is run for
+ *  a fixed number of instructions or frames, optionally with key presses read
+ *  from an input file, and the speed of the interpreter along with the final
+ *  framebuffer and registers are reported.
+ *
+ */
+
+#include "cpu.h"
+#include "trace.h"
+#include "profiler.h"
+#include "input.h"
+#include "movie.h"
+#include "scheduler.h"
+#include "rom.h"
+#include <iostream> // for input/output to terminal
+#include <fstream> // to open and read from ROM and input files
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+
+using namespace std;
+
+static unsigned long playMovie(cpu& chip8, movie& replay, unsigned long& frames);
+static void printUsage();
+static void printScreen(cpu& chip8, ostream& out);
+static void printState(cpu& chip8, ostream& out);
+
+int main(int argc, char* argv[]){
+  string game;
+  string inputFile;
+  unsigned long instructions = 0; // instruction budget, 0 if running by frames
+  unsigned long frames = 0; // frame budget, 0 if running by instructions
+  unsigned long perFrame = 10; // instructions emulated in each 60Hz frame
+  bool quiet = false; // skips the framebuffer dump if set
+  bool jit = false; // runs hot code as native code if set
+  string traceFile; // where to dump the instruction trace, if anywhere
+  string profileFile; // where to write the profile report, if anywhere
+  string seed; // seed for the random number generator, if given
+  string resumeFile; // state to start from instead of a fresh ROM, if any
+  string stateFile; // where to save the final state, if anywhere
+  string playFile; // movie to play back instead of an input file, if any
+  string quirks; // quirk profile to run with, if not the ROM's platform's
+
+  // Parse arguments
+  for(int a = 1; a < argc; ++a){
+    string arg(argv[a]);
+    if(arg == "-n" && a + 1 < argc){
+      instructions = strtoul(argv[++a], NULL, 10);
+    }
+    else if(arg == "-f" && a + 1 < argc){
+      frames = strtoul(argv[++a], NULL, 10);
+    }
+    else if(arg == "-c" && a + 1 < argc){
+      perFrame = strtoul(argv[++a], NULL, 10);
+    }
+    else if(arg == "-i" && a + 1 < argc){
+      inputFile = argv[++a];
+    }
+    else if(arg == "-q"){
+      quiet = true;
+    }
+    else if(arg == "-j"){
+      jit = true;
+    }
+    else if(arg == "-t" && a + 1 < argc){
+      traceFile = argv[++a];
+    }
+    else if(arg == "-P" && a + 1 < argc){
+      profileFile = argv[++a];
+    }
+    else if(arg == "-s" && a + 1 < argc){
+      seed = argv[++a];
+    }
+    else if(arg == "-R" && a + 1 < argc){
+      resumeFile = argv[++a];
+    }
+    else if(arg == "-w" && a + 1 < argc){
+      stateFile = argv[++a];
+    }
+    else if(arg == "-p" && a + 1 < argc){
+      playFile = argv[++a];
+    }
+    else if(arg == "-Q" && a + 1 < argc){
+      quirks = argv[++a];
+    }
+    else if(game.empty() && arg[0] != '-'){
+      game = arg;
+    }
+    else{
+      printUsage();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Makes sure there's a ROM or a state and exactly one kind of budget. A
+  // movie runs by frames, and for its whole length unless told otherwise.
+  bool budget = playFile.empty() ? (instructions == 0) != (frames == 0) : instructions == 0;
+  if(game.empty() == resumeFile.empty() || !budget || perFrame == 0 ||
+     (!playFile.empty() && (!inputFile.empty() || !seed.empty()))){
+    printUsage();
+    exit(EXIT_FAILURE);
+  }
+  if(frames != 0){
+    instructions = frames * perFrame;
+  }
+
+  // The movie decides the seed and the instructions in each frame
+  movie replay;
+  if(!playFile.empty()){
+    if(!movie::load(playFile, replay) || replay.getRate() == 0){
+      cout << "Not a valid movie file." << endl;
+      return EXIT_FAILURE;
+    }
+    seed = to_string(replay.getSeed());
+    if(frames == 0){
+      frames = replay.getLength();
+    }
+  }
+
+  // Initialize the emulator
+  cpu skylark;
+  if(!seed.empty()){
+    skylark.seed(strtoull(seed.c_str(), NULL, 0));
+  }
+  if(jit && !skylark.useJit(true)){
+    cout << "The JIT isn't available on this platform." << endl;
+    return EXIT_FAILURE;
+  }
+  skylark.skipIdleLoops(false); // instructions/sec counts only instructions really run
+
+  // Load ROM file, or pick up where a saved state left off
+  if(!game.empty()){
+    rom_image rom;
+    if(!rom.open(game)){
+      cout << "Not a valid file." << endl;
+      return EXIT_FAILURE;
+    }
+    skylark.setPlatform(detectPlatform(rom.data(), rom.size()));
+    if(!skylark.loadGame(rom.data(), rom.size())){
+      cout << "The ROM is too big. It can be at most "
+           << cpu::maxRomSize(skylark.getPlatform()) << " bytes." << endl;
+      return EXIT_FAILURE;
+    }
+  }
+  else{
+    ifstream is(resumeFile, ifstream::binary);
+    cpu::state saved;
+    if(!is.read((char*) &saved, sizeof(saved)) || !skylark.loadState(saved)){
+      cout << "Not a valid state file." << endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Run with the quirks the platform expects unless told otherwise
+  quirk_profile chosen = cpu::defaultQuirks(skylark.getPlatform());
+  if(!quirks.empty() && !parseQuirks(quirks, chosen)){
+    cout << "Unknown quirk profile. It can be modern, cosmac, schip or xochip." << endl;
+    return EXIT_FAILURE;
+  }
+  skylark.setQuirks(chosen);
+
+  // Record the last instructions run, and keep them if the emulator crashes
+  tracer trace;
+  if(!traceFile.empty()){
+    skylark.setTracer(&trace);
+    trace.dumpOnCrash(traceFile);
+  }
+
+  // Count where the instructions go. The folded stacks go next to the report.
+  profiler profile;
+  if(!profileFile.empty()){
+    skylark.setProfiler(&profile);
+  }
+
+  // Load key presses
+  vector<key_event> events;
+  if(!inputFile.empty() && !loadInputFile(inputFile, events)){
+    cout << "Not a valid input file." << endl;
+    return EXIT_FAILURE;
+  }
+
+  // Emulate
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  unsigned long executed;
+  if(playFile.empty()){
+    executed = runWithInput(skylark, events, instructions, perFrame);
+  }
+  else{
+    executed = playMovie(skylark, replay, frames);
+  }
+  chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+  // Report
+  double seconds = elapsed.count();
+  cout << "instructions: " << dec << executed << endl;
+  cout << "frames: " << (playFile.empty() ? executed / perFrame : frames) << endl;
+  cout << "seconds: " << fixed << setprecision(6) << seconds << endl;
+  cout << "instructions/sec: " << fixed << setprecision(0)
+       << (seconds > 0 ? executed / seconds : 0) << endl;
+  if(skylark.trapflag){
+    cout << "trapped on opcode 0x" << hex << skylark.getOpcode() << dec << endl;
+  }
+  if(!quiet){
+    printScreen(skylark, cout);
+  }
+  printState(skylark, cout);
+
+  if(!stateFile.empty()){
+    cpu::state saved;
+    skylark.saveState(saved);
+    ofstream os(stateFile, ofstream::binary);
+    if(!os.write((const char*) &saved, sizeof(saved))){
+      cout << "Couldn't write the state file." << endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  if(!traceFile.empty() && !trace.dump(traceFile)){
+    cout << "Couldn't write the trace file." << endl;
+    return EXIT_FAILURE;
+  }
+
+  if(!profileFile.empty() &&
+     (!profile.writeReport(profileFile) || !profile.writeFolded(profileFile + ".folded"))){
+    cout << "Couldn't write the profile." << endl;
+    return EXIT_FAILURE;
+  }
+
+  return 0;
+}
+
+// Runs the first frames frames of a movie as fast as possible, feeding in the
+// keys the same way the SDL frontend does. Returns the instructions run, and
+// sets frames to the number run if the cpu traps before the end.
+static unsigned long playMovie(cpu& chip8, movie& replay, unsigned long& frames){
+  scheduler clock(replay.getRate());
+  unsigned long executed = 0;
+  while(clock.getFrame() < frames && !chip8.trapflag){
+    replay.play(clock.getFrame(), chip8.key);
+    executed += clock.runFrame(chip8);
+  }
+  frames = clock.getFrame();
+  return executed;
+}
+
+static void printUsage(){
+  cout << "USAGE: headless.exe (<ROM_FILENAME> | -R STATE_FILE) (-n INSTRUCTIONS | -f FRAMES)"
+       << " [-c INSTRUCTIONS_PER_FRAME] [-i INPUT_FILE] [-j] [-q] [-s SEED]"
+       << " [-t TRACE_FILE] [-P PROFILE_FILE] [-w STATE_FILE] [-Q QUIRKS]" << endl;
+  cout << "       headless.exe <ROM_FILENAME> -p MOVIE_FILE [-f FRAMES] [-j] [-q]"
+       << " [-t TRACE_FILE] [-P PROFILE_FILE] [-w STATE_FILE] [-Q QUIRKS]" << endl;
+}
+
+// Prints the framebuffer, one character per pixel: # for the first plane,
+// + for the second and * for both
+static void printScreen(cpu& chip8, ostream& out){
+  static const char colours[] = ".#+*";
+  for(int y = 0; y < chip8.getHeight(); ++y){
+    for(int x = 0; x < chip8.getWidth(); ++x){
+      out << colours[chip8.getPixel(x, y)];
+    }
+    out << endl;
+  }
+}
+
+// Prints the registers, index, program counter, stack and timers
+static void printState(cpu& chip8, ostream& out){
+  const unsigned char* V = chip8.getRegisters();
+  const unsigned short* stack = chip8.getStack();
+
+  out << hex << setfill('0');
+  for(int n = 0; n < 16; ++n){
+    out << "V" << uppercase << n << nouppercase << "=" << setw(2) << (int) V[n]
+        << (n % 8 == 7 ? "\n" : " ");
+  }
+  out << "I=" << setw(4) << chip8.getIndex()
+      << " PC=" << setw(4) << chip8.getProgramCounter()
+      << " SP=" << setw(2) << chip8.getStackPointer()
+      << " DT=" << setw(2) << (int) chip8.getDelayTimer()
+      << " ST=" << setw(2) << (int) chip8.getSoundTimer() << endl;
+  out << "stack:";
+  for(int n = 0; n < 16; ++n){
+    out << " " << setw(4) << stack[n];
+  }
+  out << dec << setfill(' ') << endl;
+}
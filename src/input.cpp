@@ -0,0 +1,58 @@
+#include "input.h"
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+using namespace std;
+
+bool loadInputFile(const string& filename, vector<key_event>& events){
+  ifstream in(filename);
+  if(!in.is_open()){
+    return false;
+  }
+
+  string line;
+  while(getline(in, line)){
+    if(line.empty() || line[0] == '#'){
+      continue;
+    }
+    istringstream ss(line);
+    unsigned long frame;
+    unsigned int key, down;
+    if(!(ss >> dec >> frame >> hex >> key >> dec >> down) || key > 0xF || down > 1){
+      return false;
+    }
+    key_event e = {frame, (unsigned char) key, (unsigned char) down};
+    events.push_back(e);
+  }
+
+  // Events on the same frame keep the order they appear in the file
+  stable_sort(events.begin(), events.end(),
+              [](const key_event& a, const key_event& b){ return a.frame < b.frame; });
+  return true;
+}
+
+unsigned long runWithInput(cpu& chip8, const vector<key_event>& events,
+                           unsigned long instructions, unsigned long perFrame){
+  size_t next = 0;
+  unsigned long executed = 0;
+  while(executed < instructions){
+    unsigned long frame = executed / perFrame;
+    while(next < events.size() && events[next].frame <= frame){
+      chip8.key[events[next].key] = events[next].down;
+      ++next;
+    }
+
+    unsigned long batch = min(perFrame - executed % perFrame, instructions - executed);
+    executed += chip8.run(batch);
+    if(executed % perFrame == 0){
+      chip8.tickTimers(); // the end of a frame
+    }
+
+    // The cpu stays on an opcode that isn't implemented, so stop early
+    if(chip8.trapflag){
+      break;
+    }
+  }
+  return executed;
+}
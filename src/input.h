@@ -0,0 +1,35 @@
+#ifndef SKYLARK_INPUT_H_
+#define SKYLARK_INPUT_H_
+/*
+ *  input.h
+ *
+ *  Scripted key presses for running ROMs without a keyboard. A script is a
+ *  list of key changes, each applied at the start of a 60Hz frame, so the
+ *  same script always produces the same run.
+ *
+ */
+
+#include "cpu.h"
+#include <string>
+#include <vector>
+
+// A single change of key state, applied at the start of the given frame
+struct key_event {
+  unsigned long frame;
+  unsigned char key;
+  unsigned char down;
+};
+
+// Reads key events from a text file. Each line holds the frame, the key (0-F)
+// and 1 for pressed or 0 for released. Blank lines and lines starting with #
+// are ignored. Returns false if the file can't be read or a line is invalid.
+bool loadInputFile(const std::string& filename, std::vector<key_event>& events);
+
+// Runs up to instructions instructions, perFrame to each frame, applying the
+// events as their frames come up and ticking the timers at the end of every
+// frame. Stops early on an opcode that isn't implemented. Returns the number
+// of instructions run.
+unsigned long runWithInput(cpu& chip8, const std::vector<key_event>& events,
+                           unsigned long instructions, unsigned long perFrame);
+
+#endif  // SKYLARK_INPUT_H_
@@ -0,0 +1,623 @@
+#include "jit.h"
+#include "ops.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#define SKYLARK_JIT 1
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifdef SKYLARK_JIT
+
+static const unsigned long MEMORY_SIZE = 1 << 20; // bytes of native code
+static const unsigned long REGION_SIZE = 4096; // most bytes one region can take
+
+// x86-64 registers. rdi holds the cpu, rsi the budget and rax the number of
+// instructions executed. rdx and rcx are scratch.
+enum { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7 };
+
+// Host registers given to guest registers, in the order they're handed out
+static const int POOL[] = {RBX, RBP, 8, 9, 10, 11, 12, 13, 14, 15};
+static const int POOL_SIZE = sizeof(POOL) / sizeof(POOL[0]);
+static const int SAVED[] = {RBX, RBP, 12, 13, 14, 15}; // callee-saved
+
+// Opcodes of register to register instructions and the /digit of their
+// register/immediate forms
+enum { ADD = 0x01, OR = 0x09, AND = 0x21, SUB = 0x29, XOR = 0x31, CMP = 0x39, MOV = 0x89 };
+enum { ADDI = 0, ORI = 1, ANDI = 4, SUBI = 5, XORI = 6, CMPI = 7 };
+enum { SHL = 4, SHR = 5 };
+
+// Condition codes
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5 };
+
+// Sets the protection of the whole pages holding bytes from to to - 1 of
+// memory. Code is never writable and executable at once: pages are made
+// writable while a region is written into them and executable after.
+static bool protect(unsigned char* memory, unsigned long from, unsigned long to, int prot){
+  unsigned long page = sysconf(_SC_PAGESIZE);
+  from &= ~(page - 1);
+  to = (to + page - 1) & ~(page - 1);
+  return mprotect(memory + from, to - from, prot) == 0;
+}
+
+// Writes x86-64 machine code into a buffer. Every memory operand is an offset
+// from rdi, the cpu being run.
+class emitter {
+public:
+  emitter(unsigned char* out) : code(out), size(0) {}
+
+  unsigned char* code;
+  unsigned long size;
+
+  void byte(unsigned int b){ code[size++] = b; }
+  void word(unsigned int w){ byte(w & 0xFF); byte(w >> 8); }
+  void dword(unsigned int d){ word(d & 0xFFFF); word(d >> 16); }
+
+  // REX prefix with the high bits of the reg and rm fields
+  void rex(bool w, int reg, int rm, bool force){
+    unsigned int r = 0x40 | (w ? 0x08 : 0) | (reg >= 8 ? 0x04 : 0) | (rm >= 8 ? 0x01 : 0);
+    if(r != 0x40 || force){
+      byte(r);
+    }
+  }
+  void modrm(int mod, int reg, int rm){ byte(mod << 6 | (reg & 7) << 3 | (rm & 7)); }
+  void memory(int reg, int disp){ modrm(2, reg, RDI); dword(disp); }
+
+  // movzx r32, byte/word [rdi + disp]
+  void loadByte(int r, int disp){ rex(false, r, 0, false); byte(0x0F); byte(0xB6); memory(r, disp); }
+  void loadWord(int r, int disp){ rex(false, r, 0, false); byte(0x0F); byte(0xB7); memory(r, disp); }
+
+  // mov byte/word [rdi + disp], r
+  void storeByte(int disp, int r){ rex(false, r, 0, true); byte(0x88); memory(r, disp); }
+  void storeWord(int disp, int r){ byte(0x66); rex(false, r, 0, false); byte(0x89); memory(r, disp); }
+  void storeWordImm(int disp, unsigned int imm){ byte(0x66); byte(0xC7); memory(0, disp); word(imm); }
+
+  void movImm(int r, unsigned int imm){ rex(false, 0, r, false); byte(0xB8 + (r & 7)); dword(imm); }
+  void alu(int op, int dst, int src){ rex(false, src, dst, false); byte(op); modrm(3, src, dst); }
+  void aluImm(int ext, int dst, unsigned int imm){ rex(false, 0, dst, false); byte(0x81); modrm(3, ext, dst); dword(imm); }
+  void shift(int ext, int r, int count){ rex(false, 0, r, false); byte(0xC1); modrm(3, ext, r); byte(count); }
+  void imul(int dst, int src, unsigned int imm){ rex(false, dst, src, false); byte(0x69); modrm(3, dst, src); dword(imm); }
+
+  void push(int r){ rex(false, 0, r, false); byte(0x50 + (r & 7)); }
+  void pop(int r){ rex(false, 0, r, false); byte(0x58 + (r & 7)); }
+  void ret(){ byte(0xC3); }
+
+  void clearCount(){ alu(XOR, RAX, RAX); }
+  void addCount(unsigned int n){ byte(0x48); byte(0x81); modrm(3, ADDI, RAX); dword(n); }
+
+  // rdx = budget - executed, compared against n
+  void budgetLeft(unsigned int n){
+    byte(0x48); byte(0x89); modrm(3, RSI, RDX);
+    byte(0x48); byte(0x29); modrm(3, RAX, RDX);
+    byte(0x48); byte(0x81); modrm(3, CMPI, RDX); dword(n);
+  }
+
+  // Jumps return where their target has to be patched in
+  unsigned long jcc(int cc){ byte(0x0F); byte(0x80 + cc); dword(0); return size - 4; }
+  unsigned long jmp(){ byte(0xE9); dword(0); return size - 4; }
+  void patch(unsigned long at, unsigned long target){
+    unsigned int rel = target - (at + 4);
+    code[at] = rel & 0xFF;
+    code[at + 1] = (rel >> 8) & 0xFF;
+    code[at + 2] = (rel >> 16) & 0xFF;
+    code[at + 3] = rel >> 24;
+  }
+};
+
+#endif  // SKYLARK_JIT
+
+bool cpu::jit::available(){
+#ifdef SKYLARK_JIT
+  return true;
+#else
+  return false;
+#endif
+}
+
+#ifdef SKYLARK_JIT
+
+cpu::jit::jit() : used(0) {
+  for(int a = 0; a < 4096; ++a){
+    index[a] = NONE;
+    heat[a] = 0;
+    covered[a] = 0;
+  }
+  void* m = mmap(NULL, MEMORY_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  memory = m == MAP_FAILED ? NULL : (unsigned char*) m;
+}
+
+cpu::jit::~jit(){
+  if(memory != NULL){
+    munmap(memory, MEMORY_SIZE);
+  }
+}
+
+unsigned long cpu::jit::execute(cpu& c, unsigned long budget){
+  if(c.pc >= 4096){
+    return 0;
+  }
+  int slot = index[c.pc];
+  if(slot < 0){
+    if(slot == NEVER || ++heat[c.pc] < HOT){
+      return 0;
+    }
+    slot = compile(c, c.pc);
+    if(slot < 0){
+      return 0;
+    }
+  }
+
+  const region& r = regions[slot];
+  if(budget < r.needs){
+    return 0;
+  }
+  return r.code(&c, budget);
+}
+
+// Translates instructions from address until one that can't be translated,
+// MAX_LENGTH is reached or the host runs out of registers
+int cpu::jit::compile(cpu& c, unsigned short address){
+  heat[address] = 0;
+  if(memory == NULL){
+    index[address] = NEVER;
+    return NEVER;
+  }
+  if(used + REGION_SIZE > MEMORY_SIZE){
+    clear(); // start over rather than track free space
+  }
+  if(!protect(memory, used, used + REGION_SIZE, PROT_READ | PROT_WRITE)){
+    index[address] = NEVER;
+    return NEVER;
+  }
+
+  // Handlers the translator understands, each named by an opcode with its
+  // layout. They're looked up in the cpu's own decode table, which holds the
+  // handlers for its quirks, and translated with the same quirks.
+  enum kind { UNSUPPORTED, PLAIN, SKIP, JUMP, JUMP_V0 }; // JUMP_V0 adds VX for BXNN
+  struct translation {
+    unsigned short layout;
+    kind what;
+    bool x, y, f, i; // registers read or written
+  };
+  static const translation translations[] = {
+    {0x1000, JUMP, false, false, false, false},
+    {0x3000, SKIP, true, false, false, false},
+    {0x4000, SKIP, true, false, false, false},
+    {0x5000, SKIP, true, true, false, false},
+    {0x6000, PLAIN, true, false, false, false},
+    {0x7000, PLAIN, true, false, false, false},
+    {0x8000, PLAIN, true, true, false, false},
+    {0x8001, PLAIN, true, true, false, false},
+    {0x8002, PLAIN, true, true, false, false},
+    {0x8003, PLAIN, true, true, false, false},
+    {0x8004, PLAIN, true, true, true, false},
+    {0x8005, PLAIN, true, true, true, false},
+    {0x8006, PLAIN, true, false, true, false},
+    {0x8007, PLAIN, true, true, true, false},
+    {0x800E, PLAIN, true, false, true, false},
+    {0x9000, SKIP, true, true, false, false},
+    {0xA000, PLAIN, false, false, false, true},
+    {0xB000, JUMP_V0, false, false, false, false},
+    {0xF01E, PLAIN, true, false, false, true},
+    {0xF029, PLAIN, true, false, false, true},
+  };
+
+  // Find the region and give each register it uses a host register
+  const instruction* table = c.decoded;
+  const ops::quirk_set quirks = ops::quirksOf(c.quirks);
+  auto jumpBase = [&quirks](const instruction& op){ // register BNNN adds
+    return quirks.jumpVX ? op.x : 0;
+  };
+  const instruction* found[MAX_LENGTH];
+  const translation* how[MAX_LENGTH];
+  int host[16]; // host register for each guest register, or -1
+  int hostI = -1; // host register for the index register, or -1
+  int allocated = 0;
+  for(int g = 0; g < 16; ++g){
+    host[g] = -1;
+  }
+
+  int length = 0;
+  for(unsigned int pc = address; length < MAX_LENGTH && pc + 1 < 4096; pc += 2){
+    const instruction& op = table[c.ram[pc] << 8 | c.ram[pc + 1]];
+    const translation* t = NULL;
+    for(const translation& candidate : translations){
+      if(table[candidate.layout].exec == op.exec){
+        t = &candidate;
+        break;
+      }
+    }
+    if(t == NULL){
+      break;
+    }
+    // Native skips go 4 bytes ahead, which is wrong when the instruction
+    // skipped over is XO-CHIP's two-word F000 NNNN
+    if(t->what == SKIP && c.platform == PLATFORM_XOCHIP && pc + 3 < 4096 &&
+       c.ram[pc + 2] == 0xF0 && c.ram[pc + 3] == 0x00){
+      break;
+    }
+
+    // Registers this instruction needs that don't have a host register yet.
+    // Some quirks read VY when shifting or clear VF after logic ops.
+    bool shift = t->layout == 0x8006 || t->layout == 0x800E;
+    bool logic = t->layout >= 0x8001 && t->layout <= 0x8003;
+    bool y = t->y || (shift && quirks.shiftVY);
+    bool f = t->f || (logic && quirks.resetVF);
+    int wanted[4];
+    int count = 0;
+    if(t->x && host[op.x] < 0) wanted[count++] = op.x;
+    if(y && host[op.y] < 0 && op.y != op.x) wanted[count++] = op.y;
+    if(f && host[0xF] < 0 && op.x != 0xF && (!y || op.y != 0xF)) wanted[count++] = 0xF;
+    if(t->what == JUMP_V0 && host[jumpBase(op)] < 0) wanted[count++] = jumpBase(op);
+    bool wantI = t->i && hostI < 0;
+    if(allocated + count + (wantI ? 1 : 0) > POOL_SIZE){
+      break;
+    }
+    for(int w = 0; w < count; ++w){
+      host[wanted[w]] = POOL[allocated++];
+    }
+    if(wantI){
+      hostI = POOL[allocated++];
+    }
+
+    found[length] = &op;
+    how[length] = t;
+    ++length;
+  }
+
+  if(length == 0){
+    protect(memory, used, used + REGION_SIZE, PROT_READ | PROT_EXEC);
+    index[address] = NEVER;
+    return NEVER;
+  }
+
+  // Work out where each instruction can go next. Internal targets get a
+  // label; jumping anywhere else exits the region.
+  int skipTo[MAX_LENGTH]; // skip target, or -1 if it's outside the region
+  int jumpTo[MAX_LENGTH]; // jump target, or -1 if it's outside the region
+  bool label[MAX_LENGTH];
+  for(int k = 0; k < length; ++k){
+    label[k] = false;
+  }
+  for(int k = 0; k < length; ++k){
+    skipTo[k] = -1;
+    jumpTo[k] = -1;
+    if(how[k]->what == SKIP && k + 2 < length){
+      skipTo[k] = k + 2;
+      label[k + 2] = true;
+    }
+    int offset = found[k]->nnn - address;
+    if(how[k]->what == JUMP && offset >= 0 && offset % 2 == 0 && offset / 2 < length){
+      jumpTo[k] = offset / 2;
+      label[offset / 2] = true;
+    }
+  }
+
+  // Longest run of instructions from each one until the region exits or
+  // jumps backwards. Backward jumps check the budget can cover their target.
+  unsigned long longest[MAX_LENGTH + 1];
+  longest[length] = 0;
+  for(int k = length - 1; k >= 0; --k){
+    unsigned long next = 0;
+    if(how[k]->what == PLAIN || how[k]->what == SKIP){
+      next = longest[k + 1];
+    }
+    if(skipTo[k] >= 0 && longest[skipTo[k]] > next){
+      next = longest[skipTo[k]];
+    }
+    if(jumpTo[k] > k){
+      next = longest[jumpTo[k]];
+    }
+    longest[k] = 1 + next;
+  }
+
+  // Guest state is reached through rdi
+  const unsigned char* base = (const unsigned char*) &c;
+  const int regAt = c.reg - base;
+  const int iAt = (const unsigned char*) &c.i - base;
+  const int pcAt = (const unsigned char*) &c.pc - base;
+
+  emitter e(memory + used);
+  unsigned long labels[MAX_LENGTH];
+  std::vector<unsigned long> toLabel[MAX_LENGTH]; // jumps waiting on each label
+  std::vector<unsigned long> toExit; // jumps waiting on the epilogue
+  unsigned int pending = 0; // instructions not yet added to rax
+
+  // Prologue
+  for(int r : SAVED){
+    e.push(r);
+  }
+  e.clearCount();
+  for(int g = 0; g < 16; ++g){
+    if(host[g] >= 0){
+      e.loadByte(host[g], regAt + g);
+    }
+  }
+  if(hostI >= 0){
+    e.loadWord(hostI, iAt);
+  }
+
+  for(int k = 0; k < length; ++k){
+    const instruction& op = *found[k];
+    const unsigned short pc = address + 2 * k;
+    const int vx = host[op.x], vy = host[op.y], vf = host[0xF];
+    const unsigned short layout = how[k]->layout;
+
+    if(label[k]){
+      if(pending > 0){
+        e.addCount(pending);
+        pending = 0;
+      }
+      labels[k] = e.size;
+    }
+    ++pending;
+    if(how[k]->what != PLAIN){
+      e.addCount(pending);
+      pending = 0;
+    }
+
+    if(layout == 0x6000){
+      e.movImm(vx, op.nn);
+    }
+    else if(layout == 0x7000){
+      e.aluImm(ADDI, vx, op.nn);
+      e.aluImm(ANDI, vx, 0xFF);
+    }
+    else if(layout == 0x8000){
+      e.alu(MOV, vx, vy);
+    }
+    else if(layout == 0x8001){
+      e.alu(OR, vx, vy);
+      if(quirks.resetVF){
+        e.movImm(vf, 0);
+      }
+    }
+    else if(layout == 0x8002){
+      e.alu(AND, vx, vy);
+      if(quirks.resetVF){
+        e.movImm(vf, 0);
+      }
+    }
+    else if(layout == 0x8003){
+      e.alu(XOR, vx, vy);
+      if(quirks.resetVF){
+        e.movImm(vf, 0);
+      }
+    }
+    // The flag is worked out in RDX before VX changes and written to VF
+    // last, exactly as the interpreter does, so instructions where X or Y is
+    // F come out the same
+    else if(layout == 0x8004){
+      e.alu(MOV, RDX, vx);
+      e.alu(ADD, RDX, vy);
+      e.shift(SHR, RDX, 8);
+      e.alu(ADD, vx, vy);
+      e.aluImm(ANDI, vx, 0xFF);
+      e.alu(MOV, vf, RDX);
+    }
+    else if(layout == 0x8005){
+      e.alu(MOV, RDX, vx);
+      e.alu(SUB, RDX, vy);
+      e.shift(SHR, RDX, 31);
+      e.aluImm(XORI, RDX, 1);
+      e.alu(SUB, vx, vy);
+      e.aluImm(ANDI, vx, 0xFF);
+      e.alu(MOV, vf, RDX);
+    }
+    else if(layout == 0x8006){
+      e.alu(MOV, RDX, quirks.shiftVY ? vy : vx);
+      e.aluImm(ANDI, RDX, 0x1);
+      if(quirks.shiftVY){
+        e.alu(MOV, vx, vy);
+      }
+      e.shift(SHR, vx, 1);
+      e.alu(MOV, vf, RDX);
+    }
+    else if(layout == 0x8007){
+      e.alu(MOV, RDX, vy);
+      e.alu(SUB, RDX, vx);
+      e.shift(SHR, RDX, 31);
+      e.aluImm(XORI, RDX, 1);
+      e.alu(MOV, RCX, vy);
+      e.alu(SUB, RCX, vx);
+      e.aluImm(ANDI, RCX, 0xFF);
+      e.alu(MOV, vx, RCX);
+      e.alu(MOV, vf, RDX);
+    }
+    else if(layout == 0x800E){
+      e.alu(MOV, RDX, quirks.shiftVY ? vy : vx);
+      e.shift(SHR, RDX, 7);
+      if(quirks.shiftVY){
+        e.alu(MOV, vx, vy);
+      }
+      e.shift(SHL, vx, 1);
+      e.aluImm(ANDI, vx, 0xFF);
+      e.alu(MOV, vf, RDX);
+    }
+    else if(layout == 0xA000){
+      e.movImm(hostI, op.nnn);
+    }
+    else if(layout == 0xF01E){
+      e.alu(ADD, hostI, vx);
+      e.aluImm(ANDI, hostI, 0xFFFF);
+    }
+    else if(layout == 0xF029){
+      e.imul(hostI, vx, 5);
+    }
+    else if(how[k]->what == SKIP){
+      int cc;
+      if(layout == 0x3000 || layout == 0x4000){
+        e.aluImm(CMPI, vx, op.nn);
+        cc = layout == 0x3000 ? CC_E : CC_NE;
+      }
+      else{
+        e.alu(CMP, vx, vy);
+        cc = layout == 0x5000 ? CC_E : CC_NE;
+      }
+      if(skipTo[k] >= 0){
+        toLabel[skipTo[k]].push_back(e.jcc(cc));
+      }
+      else{
+        unsigned long over = e.jcc(cc ^ 1); // the opposite condition
+        e.storeWordImm(pcAt, pc + 4);
+        toExit.push_back(e.jmp());
+        e.patch(over, e.size);
+      }
+      if(k + 1 == length){ // not skipping falls out of the region
+        e.storeWordImm(pcAt, pc + 2);
+        toExit.push_back(e.jmp());
+      }
+    }
+    else if(how[k]->what == JUMP){
+      int t = jumpTo[k];
+      if(t >= 0 && t <= k){
+        // Loop back only while the budget covers another pass
+        e.budgetLeft(longest[t]);
+        toLabel[t].push_back(e.jcc(CC_AE));
+      }
+      else if(t > k){
+        toLabel[t].push_back(e.jmp());
+      }
+      if(t < 0 || t <= k){
+        e.storeWordImm(pcAt, op.nnn);
+        toExit.push_back(e.jmp());
+      }
+    }
+    else if(how[k]->what == JUMP_V0){
+      e.alu(MOV, RDX, host[jumpBase(op)]);
+      e.aluImm(ADDI, RDX, op.nnn);
+      e.storeWord(pcAt, RDX);
+      toExit.push_back(e.jmp());
+    }
+  }
+
+  // Running off the end of the region
+  if(how[length - 1]->what == PLAIN){
+    e.addCount(pending);
+    e.storeWordImm(pcAt, address + 2 * length);
+    toExit.push_back(e.jmp());
+  }
+
+  // Epilogue writes the host registers back
+  unsigned long epilogue = e.size;
+  for(int g = 0; g < 16; ++g){
+    if(host[g] >= 0){
+      e.storeByte(regAt + g, host[g]);
+    }
+  }
+  if(hostI >= 0){
+    e.storeWord(iAt, hostI);
+  }
+  for(int r = sizeof(SAVED) / sizeof(SAVED[0]) - 1; r >= 0; --r){
+    e.pop(SAVED[r]);
+  }
+  e.ret();
+
+  for(int k = 0; k < length; ++k){
+    for(unsigned long at : toLabel[k]){
+      e.patch(at, labels[k]);
+    }
+  }
+  for(unsigned long at : toExit){
+    e.patch(at, epilogue);
+  }
+  if(!protect(memory, used, used + REGION_SIZE, PROT_READ | PROT_EXEC)){
+    index[address] = NEVER;
+    return NEVER;
+  }
+
+  // Hand out the memory and remember the region
+  int slot;
+  if(unused.empty()){
+    slot = regions.size();
+    regions.push_back(region());
+  }
+  else{
+    slot = unused.back();
+    unused.pop_back();
+  }
+  region& r = regions[slot];
+  r.start = address;
+  r.end = address + 2 * length;
+  if(how[length - 1]->what == SKIP && c.platform == PLATFORM_XOCHIP && r.end + 2 <= 4096){
+    r.end += 2; // the instruction a skip at the end steps over mustn't become F000
+  }
+  r.needs = longest[0];
+  r.code = (entry) (memory + used);
+  used += (e.size + 15) & ~15UL;
+
+  index[address] = slot;
+  for(unsigned int a = r.start; a < r.end; ++a){
+    ++covered[a];
+  }
+  return slot;
+}
+
+void cpu::jit::invalidate(unsigned int address, unsigned int length){
+  for(unsigned int a = address; a < address + length && a < 4096; ++a){
+    // An instruction that couldn't be translated before might be now
+    if(index[a] == NEVER){
+      index[a] = NONE;
+    }
+    if(a > 0 && index[a - 1] == NEVER){
+      index[a - 1] = NONE;
+    }
+
+    // A region holding this byte has to start within one region's length before it
+    for(int start = a; covered[a] > 0 && start >= 0 && start > (int) a - 2 * MAX_LENGTH - 2; --start){
+      if(index[start] >= 0 && regions[index[start]].end > a){
+        drop(index[start]);
+      }
+    }
+  }
+}
+
+void cpu::jit::clear(){
+  for(int a = 0; a < 4096; ++a){
+    if(index[a] >= 0){
+      drop(index[a]);
+    }
+    index[a] = NONE;
+    heat[a] = 0;
+  }
+  used = 0;
+}
+
+void cpu::jit::drop(int slot){
+  region& r = regions[slot];
+  for(unsigned int a = r.start; a < r.end; ++a){
+    --covered[a];
+  }
+  index[r.start] = NONE;
+  unused.push_back(slot);
+}
+
+#else  // SKYLARK_JIT
+
+// Without x86-64 nothing is ever compiled and the interpreter runs everything
+
+cpu::jit::jit() : memory(NULL), used(0) {
+}
+
+cpu::jit::~jit(){
+}
+
+unsigned long cpu::jit::execute(cpu&, unsigned long){
+  return 0;
+}
+
+int cpu::jit::compile(cpu&, unsigned short){
+  return NEVER;
+}
+
+void cpu::jit::invalidate(unsigned int, unsigned int){
+}
+
+void cpu::jit::clear(){
+}
+
+void cpu::jit::drop(int){
+}
+
+#endif  // SKYLARK_JIT
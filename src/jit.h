@@ -0,0 +1,63 @@
+#ifndef SKYLARK_JIT_H_
+#define SKYLARK_JIT_H_
+/*
+ *  jit.h
+ *
+ *  Translates hot regions of CHIP-8 code into native x86-64 code. Registers
+ *  used by a region are kept in host registers while it runs and written back
+ *  when it exits. Only register, index and control flow instructions are
+ *  translated; a region stops before anything else so the interpreter can
+ *  run it.
+ *
+ */
+
+#include "cpu.h"
+#include <vector>
+
+struct cpu::jit {
+  static const int MAX_LENGTH = 32; // most instructions held by one region
+  static const int HOT = 16; // times an address is reached before it's compiled
+
+  static bool available(); // false when not built for x86-64
+
+  jit();
+  ~jit();
+
+  // Runs the region starting at pc if there is one and budget covers its
+  // longest path. Returns the number of instructions executed, or 0 if the
+  // interpreter has to run the next instruction instead.
+  unsigned long execute(cpu& c, unsigned long budget);
+
+  // Drops every region that holds any of the bytes from address to
+  // address + length - 1
+  void invalidate(unsigned int address, unsigned int length);
+
+  void clear(); // drops every region and frees the code they used
+
+private:
+  static const int NONE = -1; // no region yet
+  static const int NEVER = -2; // the first instruction can't be translated
+
+  typedef unsigned long (*entry)(cpu* c, unsigned long budget);
+
+  struct region {
+    unsigned short start; // address of the first instruction
+    unsigned short end; // address just past the last instruction
+    unsigned long needs; // longest path through the region
+    entry code;
+  };
+
+  int compile(cpu& c, unsigned short address);
+  void drop(int slot);
+
+  int index[4096]; // region slot for each start address, NONE or NEVER
+  unsigned char heat[4096]; // times each address was reached uncompiled
+  unsigned char covered[4096]; // number of regions holding each byte
+  std::vector<region> regions;
+  std::vector<int> unused; // slots in regions that can be reused
+
+  unsigned char* memory; // the native code, writable only while a region is written
+  unsigned long used; // bytes of memory handed out
+};
+
+#endif  // SKYLARK_JIT_H_
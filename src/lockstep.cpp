@@ -0,0 +1,659 @@
+#include "lockstep.h"
+#include <cstring>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// One byte from each lane, and the operations the kernels below are built
+// from. With AVX2 each one is an instruction or two, otherwise it's a loop.
+#ifdef __AVX2__
+
+typedef __m256i lanes8;
+
+static inline lanes8 load(const unsigned char* p){
+  return _mm256_loadu_si256((const __m256i*) p);
+}
+static inline void store(unsigned char* p, lanes8 v){
+  _mm256_storeu_si256((__m256i*) p, v);
+}
+static inline lanes8 splat(unsigned char v){
+  return _mm256_set1_epi8((char) v);
+}
+static inline lanes8 add(lanes8 a, lanes8 b){
+  return _mm256_add_epi8(a, b);
+}
+static inline lanes8 sub(lanes8 a, lanes8 b){
+  return _mm256_sub_epi8(a, b);
+}
+static inline lanes8 subSaturated(lanes8 a, lanes8 b){ // stops at 0
+  return _mm256_subs_epu8(a, b);
+}
+static inline lanes8 bitOr(lanes8 a, lanes8 b){
+  return _mm256_or_si256(a, b);
+}
+static inline lanes8 bitAnd(lanes8 a, lanes8 b){
+  return _mm256_and_si256(a, b);
+}
+static inline lanes8 bitXor(lanes8 a, lanes8 b){
+  return _mm256_xor_si256(a, b);
+}
+static inline lanes8 shiftRight(lanes8 a){ // by one
+  return _mm256_and_si256(_mm256_srli_epi16(a, 1), splat(0x7F));
+}
+static inline lanes8 equal(lanes8 a, lanes8 b){ // 0xFF where equal, 0 elsewhere
+  return _mm256_cmpeq_epi8(a, b);
+}
+static inline lanes8 carry(lanes8 a, lanes8 b){ // 1 where a + b > 255
+  return _mm256_andnot_si256(equal(_mm256_adds_epu8(a, b), add(a, b)), splat(1));
+}
+static inline lanes8 noBorrow(lanes8 a, lanes8 b){ // 1 where a >= b
+  return _mm256_and_si256(equal(_mm256_max_epu8(a, b), a), splat(1));
+}
+static inline lanes8 select(lanes8 mask, lanes8 a, lanes8 b){ // a where mask is set
+  return _mm256_blendv_epi8(b, a, mask);
+}
+static inline uint32_t bits(lanes8 mask){ // the top bit of each lane
+  return (uint32_t) _mm256_movemask_epi8(mask);
+}
+static inline lanes8 expand(uint32_t lanes){ // 0xFF for each bit set, the inverse of bits()
+  const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                          2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+  const __m256i bit = _mm256_set1_epi64x(0x8040201008040201LL);
+  __m256i v = _mm256_shuffle_epi8(_mm256_set1_epi32((int) lanes), spread);
+  return _mm256_cmpeq_epi8(_mm256_and_si256(v, bit), bit);
+}
+
+#else  // __AVX2__
+
+struct lanes8 {
+  unsigned char b[lockstep::LANES];
+};
+
+#define EACH_LANE(result, expression) \
+  lanes8 result; \
+  for(int l = 0; l < lockstep::LANES; ++l){ result.b[l] = (expression); } \
+  return result;
+
+static inline lanes8 load(const unsigned char* p){
+  EACH_LANE(v, p[l])
+}
+static inline void store(unsigned char* p, lanes8 v){
+  memcpy(p, v.b, lockstep::LANES);
+}
+static inline lanes8 splat(unsigned char v){
+  EACH_LANE(r, v)
+}
+static inline lanes8 add(lanes8 a, lanes8 b){
+  EACH_LANE(r, a.b[l] + b.b[l])
+}
+static inline lanes8 sub(lanes8 a, lanes8 b){
+  EACH_LANE(r, a.b[l] - b.b[l])
+}
+static inline lanes8 subSaturated(lanes8 a, lanes8 b){
+  EACH_LANE(r, a.b[l] > b.b[l] ? a.b[l] - b.b[l] : 0)
+}
+static inline lanes8 bitOr(lanes8 a, lanes8 b){
+  EACH_LANE(r, a.b[l] | b.b[l])
+}
+static inline lanes8 bitAnd(lanes8 a, lanes8 b){
+  EACH_LANE(r, a.b[l] & b.b[l])
+}
+static inline lanes8 bitXor(lanes8 a, lanes8 b){
+  EACH_LANE(r, a.b[l] ^ b.b[l])
+}
+static inline lanes8 shiftRight(lanes8 a){
+  EACH_LANE(r, a.b[l] >> 1)
+}
+static inline lanes8 equal(lanes8 a, lanes8 b){
+  EACH_LANE(r, a.b[l] == b.b[l] ? 0xFF : 0)
+}
+static inline lanes8 carry(lanes8 a, lanes8 b){
+  EACH_LANE(r, a.b[l] + b.b[l] > 255 ? 1 : 0)
+}
+static inline lanes8 noBorrow(lanes8 a, lanes8 b){
+  EACH_LANE(r, a.b[l] >= b.b[l] ? 1 : 0)
+}
+static inline lanes8 select(lanes8 mask, lanes8 a, lanes8 b){
+  EACH_LANE(r, mask.b[l] ? a.b[l] : b.b[l])
+}
+static inline uint32_t bits(lanes8 mask){
+  uint32_t r = 0;
+  for(int l = 0; l < lockstep::LANES; ++l){
+    r |= (uint32_t) (mask.b[l] >> 7) << l;
+  }
+  return r;
+}
+static inline lanes8 expand(uint32_t lanes){
+  EACH_LANE(r, (lanes >> l) & 1 ? 0xFF : 0)
+}
+
+#undef EACH_LANE
+
+#endif  // __AVX2__
+
+// Visits each lane with a bit set in lanes
+#define FOR_LANES(l, lanes) \
+  for(uint32_t rest_ = (lanes), l = 0; rest_ != 0 && ((l = __builtin_ctz(rest_)), true); \
+      rest_ &= rest_ - 1)
+
+lockstep::lockstep() : ram(LANES * 4096), used(0), trapped(0), drawn(0), steps(0),
+                       sharedValid(false) {
+  memset(reg, 0, sizeof(reg));
+  memset(delay_timer, 0, sizeof(delay_timer));
+  memset(sound_timer, 0, sizeof(sound_timer));
+  memset(key, 0, sizeof(key));
+  memset(i, 0, sizeof(i));
+  memset(pc, 0, sizeof(pc));
+  memset(stack, 0, sizeof(stack));
+  memset(sp, 0, sizeof(sp));
+  memset(rng, 0, sizeof(rng));
+  memset(screen, 0, sizeof(screen));
+  memset(executed, 0, sizeof(executed));
+  memset(remaining, 0, sizeof(remaining));
+}
+
+// Lanes only run CHIP-8, so a state on the 128x64 screen, drawing to the
+// second plane or running SUPER-CHIP or XO-CHIP can't be loaded
+bool lockstep::loadState(int lane, const cpu::state& in){
+  if(memcmp(in.magic, "SKST", 4) != 0 || in.version != cpu::state::VERSION ||
+     in.size != sizeof(cpu::state) || in.sp > 16 || in.pc > 0xFFF ||
+     in.platform != PLATFORM_CHIP8 || in.hires || in.planes != 1){
+    return false;
+  }
+
+  memcpy(laneRam(lane), in.ram, 4096);
+  for(int row = 0; row < 32; ++row){
+    screen[lane][row] = in.screen[0][row][0];
+  }
+  rng[lane] = in.rng;
+  for(int n = 0; n < 16; ++n){
+    stack[n][lane] = in.stack[n];
+    reg[n][lane] = in.reg[n];
+    key[n][lane] = in.key[n];
+  }
+  i[lane] = in.i;
+  pc[lane] = in.pc;
+  sp[lane] = in.sp;
+  delay_timer[lane] = in.delay_timer;
+  sound_timer[lane] = in.sound_timer;
+
+  uint32_t bit = 1u << lane;
+  used |= bit;
+  trapped = in.trapflag ? trapped | bit : trapped & ~bit;
+  drawn = in.drawflag ? drawn | bit : drawn & ~bit;
+  sharedValid = false;
+  return true;
+}
+
+// Writes the state a cpu running the same CHIP-8 program would, with the
+// parts of the machine lanes don't have left as a fresh cpu has them
+void lockstep::saveState(int lane, cpu::state& out){
+  memcpy(out.magic, "SKST", 4);
+  out.version = cpu::state::VERSION;
+  out.platform = PLATFORM_CHIP8;
+  out.hires = 0;
+  out.size = sizeof(cpu::state);
+  out.planes = 1;
+  out.pitch = 64;
+  memcpy(out.ram, laneRam(lane), 4096);
+  memset(out.ram + 4096, 0, sizeof(out.ram) - 4096);
+  memset(out.screen, 0, sizeof(out.screen));
+  for(int row = 0; row < 32; ++row){
+    out.screen[0][row][0] = screen[lane][row];
+  }
+  out.rng = rng[lane];
+  for(int n = 0; n < 16; ++n){
+    out.stack[n] = stack[n][lane];
+    out.reg[n] = reg[n][lane];
+    out.key[n] = key[n][lane];
+  }
+  out.i = i[lane];
+  out.pc = pc[lane];
+  out.sp = sp[lane];
+  out.delay_timer = delay_timer[lane];
+  out.sound_timer = sound_timer[lane];
+  memset(out.flags, 0, sizeof(out.flags));
+  memset(out.pattern, 0, sizeof(out.pattern));
+  out.drawflag = (drawn >> lane) & 1;
+  out.trapflag = (trapped >> lane) & 1;
+}
+
+void lockstep::setKey(int lane, int k, bool down){
+  key[k][lane] = down ? 1 : 0;
+}
+
+void lockstep::run(unsigned long count){
+  if(!sharedValid){
+    markShared();
+  }
+
+  uint32_t active = used & ~trapped;
+  FOR_LANES(l, active){
+    remaining[l] = count;
+  }
+
+  while(active != 0 && count > 0){
+    // Lanes at the lowest pc go next, so lanes that fell behind catch up with
+    // the rest and they can run together again
+    unsigned short at = 0xFFFF;
+    FOR_LANES(l, active){
+      at = pc[l] < at ? pc[l] : at;
+    }
+    uint32_t group = 0;
+    unsigned long most = count;
+    unsigned short limit = 0xFFFF; // where the next lanes are waiting
+    FOR_LANES(l, active){
+      if(pc[l] == at){
+        group |= 1u << l;
+        most = remaining[l] < most ? remaining[l] : most;
+      }
+      else if(pc[l] < limit){
+        limit = pc[l];
+      }
+    }
+
+    unsigned long ran = runGroup(group, at, most, limit);
+    FOR_LANES(l, group){
+      executed[l] += ran;
+      remaining[l] -= ran;
+      if(remaining[l] == 0){
+        active &= ~(1u << l);
+      }
+    }
+    active &= ~trapped;
+  }
+}
+
+// The opcode at address in one lane's ram. A CHIP-8 cpu's ram past 4KB is
+// never written and reads as zeros, so code that runs off the end fetches
+// 0000 there and traps, as it does in the cpu.
+static unsigned short opcodeAt(const unsigned char* ram, unsigned int address){
+  return (address < 4096 ? ram[address] << 8 : 0) | (address + 1 < 4096 ? ram[address + 1] : 0);
+}
+
+// Executes instructions for every lane in group at once. The lanes share a pc
+// (at) until a skip or jump sends them different ways, which ends the run
+// with each lane's own pc stored in pc[].
+unsigned long lockstep::runGroup(uint32_t& group, unsigned short at, unsigned long count,
+                                 unsigned short limit){
+  lanes8 mask = expand(group);
+  const unsigned char* code = laneRam(__builtin_ctz(group));
+  unsigned long done = 0;
+  bool split = false;
+
+  while(done < count && !split){
+    unsigned short opcode = opcodeAt(code, at);
+
+    // Code some lane has written may differ between lanes. Only the lanes that
+    // agree with the first one run it now, the others wait their turn.
+    if((at < 4096 && unshared[at]) || (at + 1 < 4096 && unshared[at + 1])){
+      uint32_t same = 0;
+      FOR_LANES(l, group){
+        if(opcodeAt(laneRam(l), at) == opcode){
+          same |= 1u << l;
+        }
+      }
+      if(same != group){
+        if(done > 0){
+          break;
+        }
+        // The group shrinks, and whoever's left behind stays at this pc
+        group = same;
+        mask = expand(group);
+        limit = at;
+      }
+    }
+
+    // A call with the stack full or a return with it empty traps, as in the
+    // cpu. Only the lanes that trap run it now, the others wait their turn.
+    if(opcode == 0x00EE || (opcode & 0xF000) == 0x2000){
+      unsigned char end = opcode == 0x00EE ? 0 : 16;
+      uint32_t stuck = 0;
+      FOR_LANES(l, group){
+        if(sp[l] == end){
+          stuck |= 1u << l;
+        }
+      }
+      if(stuck != 0){
+        if(stuck != group && done > 0){
+          break;
+        }
+        group = stuck;
+        trapped |= group;
+        ++done;
+        break;
+      }
+    }
+
+    unsigned int x = (opcode & 0x0F00) >> 8;
+    unsigned int y = (opcode & 0x00F0) >> 4;
+    unsigned int n = opcode & 0x000F;
+    unsigned char nn = opcode & 0x00FF;
+    unsigned short nnn = opcode & 0x0FFF;
+    uint32_t hit = 0; // lanes that take a skip
+    bool skip = false;
+    bool trap = false;
+
+    switch(opcode & 0xF000){
+    case 0x0000:
+      if(opcode == 0x00E0){
+        FOR_LANES(l, group){
+          memset(screen[l], 0, sizeof(screen[l]));
+        }
+        at += 2;
+      }
+      else if(opcode == 0x00EE){
+        FOR_LANES(l, group){
+          --sp[l];
+          pc[l] = stack[sp[l]][l] + 2;
+          stack[sp[l]][l] = 0;
+        }
+        split = true; // the lanes may have been called from different places
+      }
+      else{
+        trap = true;
+      }
+      break;
+    case 0x1000:
+      at = nnn;
+      break;
+    case 0x2000:
+      FOR_LANES(l, group){
+        stack[sp[l]][l] = at;
+        ++sp[l];
+      }
+      at = nnn;
+      break;
+    case 0x3000:
+      hit = bits(equal(load(reg[x]), splat(nn)));
+      skip = true;
+      break;
+    case 0x4000:
+      hit = ~bits(equal(load(reg[x]), splat(nn)));
+      skip = true;
+      break;
+    case 0x5000:
+      hit = bits(equal(load(reg[x]), load(reg[y])));
+      skip = true;
+      trap = n != 0;
+      break;
+    case 0x6000:
+      store(reg[x], select(mask, splat(nn), load(reg[x])));
+      at += 2;
+      break;
+    case 0x7000:
+      store(reg[x], select(mask, add(load(reg[x]), splat(nn)), load(reg[x])));
+      at += 2;
+      break;
+    case 0x8000:
+      // The flag is worked out before VX changes and VF is written last, as
+      // in the cpu, so X or Y being F behaves the same
+      lanes8 flag;
+      switch(n){
+      case 0x0:
+        store(reg[x], select(mask, load(reg[y]), load(reg[x])));
+        break;
+      case 0x1:
+        store(reg[x], select(mask, bitOr(load(reg[x]), load(reg[y])), load(reg[x])));
+        break;
+      case 0x2:
+        store(reg[x], select(mask, bitAnd(load(reg[x]), load(reg[y])), load(reg[x])));
+        break;
+      case 0x3:
+        store(reg[x], select(mask, bitXor(load(reg[x]), load(reg[y])), load(reg[x])));
+        break;
+      case 0x4:
+        flag = carry(load(reg[x]), load(reg[y]));
+        store(reg[x], select(mask, add(load(reg[x]), load(reg[y])), load(reg[x])));
+        store(reg[0xF], select(mask, flag, load(reg[0xF])));
+        break;
+      case 0x5:
+        flag = noBorrow(load(reg[x]), load(reg[y]));
+        store(reg[x], select(mask, sub(load(reg[x]), load(reg[y])), load(reg[x])));
+        store(reg[0xF], select(mask, flag, load(reg[0xF])));
+        break;
+      case 0x6:
+        flag = bitAnd(load(reg[x]), splat(0x1));
+        store(reg[x], select(mask, shiftRight(load(reg[x])), load(reg[x])));
+        store(reg[0xF], select(mask, flag, load(reg[0xF])));
+        break;
+      case 0x7:
+        flag = noBorrow(load(reg[y]), load(reg[x]));
+        store(reg[x], select(mask, sub(load(reg[y]), load(reg[x])), load(reg[x])));
+        store(reg[0xF], select(mask, flag, load(reg[0xF])));
+        break;
+      case 0xE:
+        flag = carry(load(reg[x]), load(reg[x])); // the top bit, shifted out
+        store(reg[x], select(mask, add(load(reg[x]), load(reg[x])), load(reg[x])));
+        store(reg[0xF], select(mask, flag, load(reg[0xF])));
+        break;
+      default:
+        trap = true;
+      }
+      at += trap ? 0 : 2;
+      break;
+    case 0x9000:
+      hit = ~bits(equal(load(reg[x]), load(reg[y])));
+      skip = true;
+      trap = n != 0;
+      break;
+    case 0xA000:
+      FOR_LANES(l, group){
+        i[l] = nnn;
+      }
+      at += 2;
+      break;
+    case 0xB000:
+      FOR_LANES(l, group){
+        pc[l] = reg[0][l] + nnn;
+      }
+      split = true;
+      break;
+    case 0xC000:
+      FOR_LANES(l, group){
+        // xorshift64*, as in cpu::randomNumber()
+        uint64_t& r = rng[l];
+        r ^= r >> 12;
+        r ^= r << 25;
+        r ^= r >> 27;
+        reg[x][l] = ((r * 0x2545F4914F6CDD1DULL) >> 56) & nn;
+      }
+      at += 2;
+      break;
+    case 0xD000:
+      // The rows each lane draws to depend on its own VY, so this is per lane
+      FOR_LANES(l, group){
+        const unsigned char* own = laneRam(l);
+        unsigned int px = reg[x][l] % 64;
+        unsigned int py = reg[y][l] % 32;
+        uint64_t collision = 0;
+        for(unsigned int yline = 0; yline < n; ++yline){
+          uint64_t pixels = (uint64_t) own[(i[l] + yline) & 0xFFF] << 56;
+          pixels = px == 0 ? pixels : (pixels >> px) | (pixels << (64 - px));
+          uint64_t& row = screen[l][(py + yline) % 32];
+          collision |= row & pixels;
+          row ^= pixels;
+        }
+        reg[0xF][l] = collision != 0 ? 1 : 0;
+      }
+      drawn |= group;
+      at += 2;
+      break;
+    case 0xE000:
+      if(nn == 0x9E || nn == 0xA1){
+        FOR_LANES(l, group){
+          bool down = reg[x][l] < 16 && key[reg[x][l]][l] != 0;
+          if(down == (nn == 0x9E)){
+            hit |= 1u << l;
+          }
+        }
+        skip = true;
+      }
+      else{
+        trap = true;
+      }
+      break;
+    case 0xF000:
+      switch(nn){
+      case 0x07:
+        store(reg[x], select(mask, load(delay_timer), load(reg[x])));
+        break;
+      case 0x0A:
+        // Waits for a key. Each key down moves pc along, as in the cpu.
+        FOR_LANES(l, group){
+          unsigned short moved = at;
+          for(int k = 0; k < 16; ++k){
+            if(key[k][l] != 0){
+              reg[x][l] = k;
+              moved += 2;
+            }
+          }
+          pc[l] = moved;
+        }
+        split = true;
+        break;
+      case 0x15:
+        store(delay_timer, select(mask, load(reg[x]), load(delay_timer)));
+        break;
+      case 0x18:
+        store(sound_timer, select(mask, load(reg[x]), load(sound_timer)));
+        break;
+      case 0x1E:
+        FOR_LANES(l, group){
+          i[l] += reg[x][l];
+        }
+        break;
+      case 0x29:
+        FOR_LANES(l, group){
+          i[l] = reg[x][l] * 0x5;
+        }
+        break;
+      case 0x33:
+        FOR_LANES(l, group){
+          unsigned char* own = laneRam(l);
+          own[i[l] & 0xFFF] = reg[x][l] / 100;
+          own[(i[l] + 1) & 0xFFF] = (reg[x][l] / 10) % 10;
+          own[(i[l] + 2) & 0xFFF] = reg[x][l] % 10;
+          for(int k = 0; k < 3; ++k){
+            unshared[(i[l] + k) & 0xFFF] = 1;
+          }
+        }
+        break;
+      case 0x55:
+        FOR_LANES(l, group){
+          unsigned char* own = laneRam(l);
+          for(unsigned int k = 0; k <= x; ++k){
+            own[(i[l] + k) & 0xFFF] = reg[k][l];
+            unshared[(i[l] + k) & 0xFFF] = 1;
+          }
+        }
+        break;
+      case 0x65:
+        FOR_LANES(l, group){
+          const unsigned char* own = laneRam(l);
+          for(unsigned int k = 0; k <= x; ++k){
+            reg[k][l] = own[(i[l] + k) & 0xFFF];
+          }
+        }
+        break;
+      default:
+        trap = true;
+      }
+      if(!split && !trap){
+        at += 2;
+      }
+      break;
+    }
+
+    // Lanes that jumped or returned to the same place carry on together
+    if(split){
+      unsigned short first = pc[__builtin_ctz(group)];
+      bool together = true;
+      FOR_LANES(l, group){
+        together = together && pc[l] == first;
+      }
+      if(together){
+        at = first;
+        split = false;
+      }
+    }
+
+    if(trap){
+      // The pc stays on the opcode, as in the cpu
+      trapped |= group;
+      split = false;
+      ++done;
+      break;
+    }
+
+    if(skip){
+      hit &= group;
+      if(hit == group){
+        at += 4;
+      }
+      else if(hit == 0){
+        at += 2;
+      }
+      else{
+        FOR_LANES(l, group){
+          pc[l] = at + ((hit >> l) & 1 ? 4 : 2);
+        }
+        split = true;
+      }
+    }
+
+    ++done;
+    ++steps;
+
+    // Stop once other lanes are waiting at or behind where this group is
+    if(at >= limit){
+      break;
+    }
+  }
+
+  if(!split){
+    FOR_LANES(l, group){
+      pc[l] = at;
+    }
+  }
+  return done;
+}
+
+void lockstep::tickTimers(uint32_t lanes){
+  lanes8 mask = expand(lanes & used);
+  store(delay_timer, select(mask, subSaturated(load(delay_timer), splat(1)), load(delay_timer)));
+  store(sound_timer, select(mask, subSaturated(load(sound_timer), splat(1)), load(sound_timer)));
+}
+
+uint32_t lockstep::getTrapped(){
+  return trapped;
+}
+
+unsigned long lockstep::getExecuted(int lane){
+  return executed[lane];
+}
+
+unsigned long lockstep::getSteps(){
+  return steps;
+}
+
+unsigned char* lockstep::laneRam(int lane){
+  return &ram[lane * 4096];
+}
+
+// Finds the addresses where the lanes' ram doesn't all match
+void lockstep::markShared(){
+  memset(unshared, 0, sizeof(unshared));
+  if(used != 0){
+    const unsigned char* first = laneRam(__builtin_ctz(used));
+    FOR_LANES(l, used){
+      const unsigned char* own = laneRam(l);
+      for(int a = 0; a < 4096; ++a){
+        unshared[a] |= own[a] != first[a];
+      }
+    }
+  }
+  sharedValid = true;
+}
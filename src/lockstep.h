@@ -0,0 +1,75 @@
+#ifndef SKYLARK_LOCKSTEP_H_
+#define SKYLARK_LOCKSTEP_H_
+/*
+ *  lockstep.h
+ *
+ *  Runs many copies of one ROM side by side, one copy per lane. The state of
+ *  every lane is stored lane-wise (all the V0s together, then all the V1s and
+ *  so on) so that while the lanes are on the same instruction it is executed
+ *  for all of them at once with vector instructions. Lanes that go different
+ *  ways, e.g. because they were given different keys or seeds, are run in
+ *  groups that share a pc until they meet up again.
+ *
+ */
+
+#include "cpu.h"
+#include <vector>
+
+class lockstep {
+public:
+  static const int LANES = 32; // one AVX2 register of bytes
+
+  lockstep();
+
+  // Lanes are set up from a saved cpu, so a ROM is loaded and seeded the same
+  // way as for a single cpu. Lanes that are never loaded don't run.
+  bool loadState(int lane, const cpu::state& in);
+  void saveState(int lane, cpu::state& out);
+
+  void setKey(int lane, int key, bool down);
+
+  // Runs count instructions on every lane that hasn't trapped. A lane that
+  // hits an opcode that isn't implemented stops there, like cpu::run().
+  void run(unsigned long count);
+  void tickTimers(uint32_t lanes); // counts the timers down, one bit per lane
+
+  uint32_t getTrapped(); // lanes stopped on an opcode that isn't implemented, one bit each
+  unsigned long getExecuted(int lane); // instructions run by lane so far
+  unsigned long getSteps(); // instructions run for groups of lanes so far
+
+private:
+  // Runs up to count instructions for the lanes in group, which are all at
+  // address at, until they go different ways or pass limit. Lanes whose code
+  // differs there are dropped from group.
+  unsigned long runGroup(uint32_t& group, unsigned short at, unsigned long count,
+                         unsigned short limit);
+  unsigned char* laneRam(int lane);
+  void markShared();
+
+  // Lane-wise state, indexed [what][lane]
+  unsigned char reg[16][LANES];
+  unsigned char delay_timer[LANES];
+  unsigned char sound_timer[LANES];
+  unsigned char key[16][LANES];
+  unsigned short i[LANES];
+  unsigned short pc[LANES];
+  unsigned short stack[16][LANES];
+  unsigned char sp[LANES];
+  uint64_t rng[LANES];
+  uint64_t screen[LANES][32];
+  std::vector<unsigned char> ram; // 4096 bytes for each lane, one after the other
+
+  unsigned long executed[LANES];
+  unsigned long remaining[LANES]; // instructions left in the current run()
+  uint32_t used; // lanes that have been loaded
+  uint32_t trapped;
+  uint32_t drawn; // lanes whose drawflag is set
+  unsigned long steps;
+
+  // Addresses where some lane's ram differs from the others. Instructions
+  // anywhere else are fetched once for all lanes.
+  unsigned char unshared[4096];
+  bool sharedValid; // unshared[] is up to date
+};
+
+#endif  // SKYLARK_LOCKSTEP_H_
@@ -1,30 +1,175 @@
 #include "cpu.h"
+#include "scheduler.h"
+#include "trace.h"
+#include "profiler.h"
+#include "movie.h"
+#include "rom.h"
+#include "audio.h"
+#include "triplebuffer.h"
 #include <iostream> // for input/output to terminal
 #include <fstream> // to open and read from ROM file
+#include <random>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
 #include "SDL2/SDL.h"
 
 using namespace std;
 
+static const char* TRACE_FILE = "skylark.trace";
+static const char* STATE_FILE = "skylark.state";
+
+// A finished frame, handed from the emulation thread to the render thread
+struct screen_frame {
+  uint64_t planes[2][64][2]; // the cpu's planes, as getPlane() lays them out
+  bool hires;
+};
+
+static void uploadRows(const screen_frame& screen, SDL_Texture* texture,
+                       unsigned int* pixel_buffer, int first, int count);
+static void playSamples(void* ring, Uint8* stream, int length);
+
 int main(int argc, char* argv[]){
 
   // Makes sure there's a proper number of arguments
-  if(argc != 2){
-    cout << "USAGE: skylark.exe <ROM_FILENAME>" << endl;
+  string game;
+  unsigned long rate = scheduler::DEFAULT_RATE; // instructions per second
+  bool tracing = false; // records the last instructions run if set
+  string profileFile; // where to write the profile report on exit, if anywhere
+  string seed; // seed for the random number generator, if given
+  string recordFile; // where to record a movie of the session, if anywhere
+  string playFile; // movie to play back, if any
+  unsigned long seekFrame = 0; // frames of the movie run without being shown
+  unsigned long runAhead = 0; // frames shown ahead of the emulation
+  bool startFast = false; // starts fast-forwarding if set
+  unsigned long showEvery = 1; // while fast-forwarding, frames run per frame shown
+  string quirks; // quirk profile to run with, if not the ROM's platform's
+  for(int a = 1; a < argc; ++a){
+    string arg(argv[a]);
+    if(arg == "-r" && a + 1 < argc){
+      rate = strtoul(argv[++a], NULL, 10);
+    }
+    else if(arg == "-t"){
+      tracing = true;
+    }
+    else if(arg == "-P" && a + 1 < argc){
+      profileFile = argv[++a];
+    }
+    else if(arg == "-s" && a + 1 < argc){
+      seed = argv[++a];
+    }
+    else if(arg == "-m" && a + 1 < argc){
+      recordFile = argv[++a];
+    }
+    else if(arg == "-p" && a + 1 < argc){
+      playFile = argv[++a];
+    }
+    else if(arg == "-g" && a + 1 < argc){
+      seekFrame = strtoul(argv[++a], NULL, 10);
+    }
+    else if(arg == "-a" && a + 1 < argc){
+      runAhead = strtoul(argv[++a], NULL, 10);
+    }
+    else if(arg == "-F"){
+      startFast = true;
+    }
+    else if(arg == "-k" && a + 1 < argc){
+      showEvery = max(1UL, strtoul(argv[++a], NULL, 10));
+    }
+    else if(arg == "-Q" && a + 1 < argc){
+      quirks = argv[++a];
+    }
+    else if(game.empty() && arg[0] != '-'){
+      game = arg;
+    }
+    else{
+      game.clear();
+      break;
+    }
+  }
+  if(game.empty() || (!recordFile.empty() && !playFile.empty())){
+    cout << "USAGE: skylark.exe <ROM_FILENAME> [-r INSTRUCTIONS_PER_SECOND] [-t] [-P PROFILE_FILE] [-s SEED]" << endl;
+    cout << "       [-m MOVIE_FILE | -p MOVIE_FILE [-g FRAME]] [-a FRAMES] [-F] [-k FRAMES]" << endl;
+    cout << "       [-Q modern|cosmac|schip|xochip]" << endl;
+    cout << "       (a rate of 0 runs as fast as the host allows)" << endl;
+    cout << "       (-t keeps a trace of the last instructions, dumped to" << endl;
+    cout << "        " << TRACE_FILE << " with F9 or on a crash)" << endl;
+    cout << "       (-P writes a profile report on exit, and folded stacks to" << endl;
+    cout << "        PROFILE_FILE.folded)" << endl;
+    cout << "       (F5 saves the state to " << STATE_FILE << ", F8 loads it)" << endl;
+    cout << "       (-m records the keys to a movie, -p plays one back, skipping" << endl;
+    cout << "        ahead to FRAME if given)" << endl;
+    cout << "       (-a shows each frame as it will be FRAMES frames later if the" << endl;
+    cout << "        keys stay the same, hiding that many frames of input lag)" << endl;
+    cout << "       (Tab or -F fast-forwards, running frames back to back and" << endl;
+    cout << "        showing one per refresh, or at most one every FRAMES with -k)" << endl;
+    cout << "       (-Q runs with another machine's quirks than the one the ROM" << endl;
+    cout << "        looks like it was written for)" << endl;
     exit(EXIT_FAILURE);
   }
+
+  // A movie is only the same run again if the seed and rate are too
+  movie replay;
+  if(!playFile.empty()){
+    if(!movie::load(playFile, replay)){
+      cout << "Not a valid movie file." << endl;
+      return EXIT_FAILURE;
+    }
+    seed = to_string(replay.getSeed());
+    rate = replay.getRate();
+  }
+  if(seed.empty()){
+    seed = to_string(((uint64_t) random_device()() << 32) | random_device()());
+  }
+  if(!recordFile.empty() && rate == 0){
+    cout << "Movies need a fixed rate, not -r 0." << endl;
+    return EXIT_FAILURE;
+  }
+  if(runAhead > 0 && rate == 0){
+    cout << "Running ahead needs a fixed rate, not -r 0." << endl;
+    return EXIT_FAILURE;
+  }
+  movie recording(strtoull(seed.c_str(), NULL, 0), rate);
+
   // Initialize the emulator
   cpu skylark;
-  string game(argv[1]);
+  skylark.seed(strtoull(seed.c_str(), NULL, 0));
+  scheduler clock(rate);
 
-  // Load ROM file
-  ifstream is(game, ifstream::binary);
-  if(is.is_open()){
-    skylark.loadGame(is);
+  // Record the last instructions run, and keep them if the emulator crashes
+  tracer trace;
+  if(tracing){
+    skylark.setTracer(&trace);
+    trace.dumpOnCrash(TRACE_FILE);
   }
-  else{
+
+  // Count where the instructions go, for a report when the window closes
+  profiler profile;
+  if(!profileFile.empty()){
+    skylark.setProfiler(&profile);
+  }
+
+  // Load ROM file
+  rom_image rom;
+  if(!rom.open(game)){
     cout << "Not a valid file." << endl;
     return 0;
   }
+  skylark.setPlatform(detectPlatform(rom.data(), rom.size()));
+  if(!skylark.loadGame(rom.data(), rom.size())){
+    cout << "The ROM is too big. It can be at most "
+         << cpu::maxRomSize(skylark.getPlatform()) << " bytes." << endl;
+    return 0;
+  }
+  quirk_profile chosen = cpu::defaultQuirks(skylark.getPlatform());
+  if(!quirks.empty() && !parseQuirks(quirks, chosen)){
+    cout << "Unknown quirk profile. It can be modern, cosmac, schip or xochip." << endl;
+    return EXIT_FAILURE;
+  }
+  skylark.setQuirks(chosen);
 
   // Set up input
   uint8_t keymap[16] = {
@@ -45,6 +190,27 @@ int main(int argc, char* argv[]){
     SDLK_f,
     SDLK_v,
 };
+  // Set up sound. The buzzer renders each frame's samples on the emulation
+  // thread and SDL's audio thread takes them from the ring, without either
+  // waiting.
+  SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO);
+  sample_ring samples;
+  buzzer sound(samples);
+  SDL_AudioSpec want = {};
+  want.freq = buzzer::RATE;
+  want.format = AUDIO_S16SYS;
+  want.channels = 1;
+  want.samples = 512;
+  want.callback = playSamples;
+  want.userdata = &samples;
+  SDL_AudioDeviceID speaker = SDL_OpenAudioDevice(NULL, 0, &want, NULL, 0);
+  if(speaker != 0){
+    skylark.setBuzzer(&sound);
+  }
+  else{
+    cout << "No sound: " << SDL_GetError() << endl;
+  }
+
   // Set up graphics
   // Size of window to be created
   const int SCREEN_WIDTH = 512;
@@ -57,70 +223,343 @@ int main(int argc, char* argv[]){
                               SCREEN_HEIGHT, SDL_WINDOW_SHOWN );
 
   // Creates the renderer object
-  SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, 0);
+  // Creates the renderer object. Presenting waits for the display's refresh,
+  // which only holds up this thread.
+  SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
 
-  // Creates the texture object
+  // Creates the texture object. It's big enough for the 128x64 screen, and
+  // the 64x32 one only uses its top left corner.
   SDL_Texture* texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
-                                           SDL_TEXTUREACCESS_STREAMING, 64, 32);
+                                           SDL_TEXTUREACCESS_STREAMING, 128, 64);
 
-  // Screen buffer
-  unsigned int pixel_buffer[64 * 32];
+  // Screen buffer. The whole texture is uploaded once, then only rows that change.
+  unsigned int pixel_buffer[128 * 64];
+  screen_frame shown; // what the texture holds
+  memset(&shown, 0, sizeof(shown));
+  uploadRows(shown, texture, pixel_buffer, 0, 32);
 
-  // Loop variable
-  bool gameOn = true;
+  // The emulator runs on its own thread and this one shows its frames and
+  // handles the keyboard. They share only atomics and the triple buffer, so
+  // a slow present never holds up emulation and vice versa.
+  atomic<bool> gameOn(true);
+  atomic<uint16_t> held(0); // keys down on the keyboard, one bit each
+  atomic<bool> dumpWanted(false), saveWanted(false), loadWanted(false);
+  atomic<bool> fastForward(startFast);
+  triple_buffer<screen_frame> frames;
 
-  while(gameOn){
-    // Emulate one cycle
-    skylark.cycle();
-    cout << "Opcode: 0x" << hex << skylark.getOpcode() <<
-            " pc = 0x" << hex << skylark.getProgramCounter() << endl;
-
-    // If the draw flag is set, update the screen
-    if(skylark.drawflag){
-      // draw graphics
-      for(int i = 0; i < 2048; ++i){
-        if(skylark.screen[i] == 0){ // if the pixel is off, set it to black
-          pixel_buffer[i] = 0xFF000000;
+  // When the program is only waiting for a key the emulation thread sleeps
+  // until the keyboard changes. Each time this thread handles events it
+  // counts them in inputs and wakes it, and the emulation thread nudges this
+  // one with an event when it falls asleep or wakes, so it knows whether to
+  // wait for frames or only for input.
+  atomic<unsigned long> inputs(0);
+  atomic<bool> asleep(false);
+  mutex waking;
+  condition_variable woken;
+  const Uint32 NUDGE = SDL_RegisterEvents(1);
+  auto nudge = [&](){
+    SDL_Event e = {};
+    e.type = NUDGE;
+    SDL_PushEvent(&e);
+  };
+
+  thread emulator([&](){
+    bool trapped = false;
+    cpu::state snapshot; // the real machine while frames are run ahead
+    unsigned long skipped = 0; // frames not shown since the last one that was
+    bool heard = false; // the audio device is playing
+    while(gameOn){
+      // The keys each frame runs with are recorded, or come from the movie
+      unsigned long seen = inputs.load();
+      unsigned long frame = clock.getFrame();
+      bool playing = !playFile.empty() && frame < replay.getLength();
+      if(playing){
+        replay.play(frame, skylark.key);
+      }
+      else{
+        uint16_t keys = held.load(memory_order_relaxed);
+        for(int k = 0; k < 16; ++k){
+          skylark.key[k] = (keys >> k) & 1;
         }
-        else{ // if it's on, set it to white
-          pixel_buffer[i] = 0xFFFFFFFF;
+        if(!recordFile.empty()){
+          recording.record(frame, skylark.key);
         }
       }
-      // Update the texture
-      SDL_UpdateTexture(texture, NULL, pixel_buffer, 64 * sizeof(unsigned int));
 
-      // Clear screen
-    	SDL_RenderClear(renderer); // clears the screen
-    	SDL_RenderCopy(renderer, texture, NULL, NULL); // copy texture to rendering target
-    	SDL_RenderPresent(renderer); // updates the screen with new rendering
+      // Fast-forwarding, and seeking, are silent, since the sound would come
+      // far faster than it can be played
+      bool fast = fastForward.load(memory_order_relaxed) || frame + 1 < seekFrame;
+      buzzer* buzzing = speaker != 0 && !fast ? &sound : NULL;
+      skylark.setBuzzer(buzzing);
+
+      // Emulate one frame's worth of instructions and tick the timers
+      clock.runFrame(skylark);
+
+      // Sound starts once a couple of frames are queued, so it doesn't begin
+      // by running dry, and pauses while fast-forwarding
+      bool audible = buzzing != NULL && (heard || samples.available() >= 2 * buzzer::FRAME);
+      if(audible != heard){
+        SDL_PauseAudioDevice(speaker, !audible);
+        heard = audible;
+      }
+
+      // Report the first opcode that isn't implemented, or that overflowed
+      // the stack. The cpu stays on it.
+      if(skylark.trapflag && !trapped){
+        unsigned short stuck = skylark.getOpcode();
+        bool stack = stuck == 0x00EE || (stuck & 0xF000) == 0x2000;
+        cout << "Ruh roh! Opcode 0x" << hex << stuck <<
+                (stack ? " ran off the end of the stack!" : " wasn't implemented!") << endl;
+        trapped = true;
+      }
+
+      // Dump the trace, or suspend to and resume from the state file, when
+      // the keyboard asks for it
+      if(dumpWanted.exchange(false) && trace.dump(TRACE_FILE)){
+        cout << "Trace written to " << TRACE_FILE << endl;
+      }
+      if(saveWanted.exchange(false)){
+        cpu::state saved;
+        skylark.saveState(saved);
+        ofstream os(STATE_FILE, ofstream::binary);
+        if(os.write((const char*) &saved, sizeof(saved))){
+          cout << "State saved to " << STATE_FILE << endl;
+        }
+      }
+      if(loadWanted.exchange(false)){
+        cpu::state saved;
+        ifstream is(STATE_FILE, ifstream::binary);
+        if(is.read((char*) &saved, sizeof(saved)) && skylark.loadState(saved)){
+          trapped = skylark.trapflag;
+          cout << "State loaded from " << STATE_FILE << endl;
+        }
+      }
+
+      // Frames before the one being sought are run back to back and not
+      // shown, and so are all but one in showEvery while fast-forwarding.
+      // The window shows the newest frame at each refresh, so even when every
+      // one is handed over, drawing never holds up fast-forwarding.
+      if(frame + 1 < seekFrame){
+        continue;
+      }
+      if(fast && ++skipped < showEvery){
+        continue;
+      }
+      skipped = 0;
+
+      // When running ahead, the frames after this one are run from a
+      // snapshot as if the keys stay as they are, and the last of them is
+      // shown. They aren't heard, traced or profiled.
+      bool ahead = runAhead > 0 && !fast;
+      if(ahead){
+        skylark.saveState(snapshot);
+        skylark.setBuzzer(NULL);
+        skylark.setTracer(NULL);
+        skylark.setProfiler(NULL);
+        for(unsigned long n = 0; n < runAhead; ++n){
+          clock.runFrameAhead(skylark, n);
+        }
+      }
+
+      // If the draw flag is set and any rows changed, the screen is handed
+      // over to be shown. If none did (e.g. a sprite was drawn and erased),
+      // nothing is.
+      if(skylark.drawflag && skylark.takeDirtyRows() != 0){
+        screen_frame& next = frames.writing();
+        memcpy(next.planes[0], skylark.getPlane(0), sizeof(next.planes[0]));
+        memcpy(next.planes[1], skylark.getPlane(1), sizeof(next.planes[1]));
+        next.hires = skylark.isHires();
+        frames.publish();
+      }
+      skylark.drawflag = false;
+
+      // Put the real machine back. Only the ram that changed is copied, so
+      // nothing else is dropped from the caches. If the snapshot won't load,
+      // the frames run ahead are kept as if they'd been real, and running
+      // ahead stops so it can't happen again.
+      if(ahead){
+        if(!skylark.loadState(snapshot)){
+          cout << "Couldn't go back after running ahead, so running ahead is off." << endl;
+          runAhead = 0;
+        }
+        skylark.setBuzzer(buzzing);
+        skylark.setTracer(tracing ? &trace : NULL);
+        skylark.setProfiler(profileFile.empty() ? NULL : &profile);
+      }
+
+      // Sleep until the next frame is due, unless fast-forwarding
+      if(!fast){
+        clock.waitForFrame();
+      }
+
+      // A program waiting for a key, or stopped for good (jumping to itself
+      // or exited with SUPER-CHIP's 00FD), with no timers running won't do
+      // anything until the keyboard changes, so instead of running frames
+      // that change nothing, sleep until it does. Sound is paused meanwhile,
+      // and starts again once frames are queued.
+      cpu::idle_state idle = skylark.getIdle();
+      if((idle == cpu::WAIT_KEY || idle == cpu::HALTED) && !playing && !fast &&
+         skylark.getDelayTimer() == 0 && skylark.getSoundTimer() == 0){
+        if(heard){
+          SDL_PauseAudioDevice(speaker, 1);
+          heard = false;
+        }
+        asleep = true;
+        nudge();
+        unique_lock<mutex> lock(waking);
+        woken.wait(lock, [&](){ return inputs != seen || !gameOn; });
+        asleep = false;
+        nudge();
+      }
     }
+  });
 
+  while(gameOn){
     // Process SDL events
     SDL_Event e;
+    bool handled = false;
     while (SDL_PollEvent(&e)) {
-        if (e.type == SDL_QUIT) exit(0);
+        handled = handled || e.type != NUDGE;
+        if (e.type == SDL_QUIT) gameOn = false;
 
-        // Process keydown events
-        if (e.type == SDL_KEYDOWN) {
-            for (int i = 0; i < 16; ++i) {
-                if (e.key.keysym.sym == keymap[i]) {
-                    skylark.key[i] = 1;
-                }
-            }
+        // Ask for the trace, a save or a load, which happen between frames
+        if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_F9 && tracing) {
+            dumpWanted = true;
         }
-        // Process keyup events
-        if (e.type == SDL_KEYUP) {
+        if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_F5) {
+            saveWanted = true;
+        }
+        if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_F8) {
+            loadWanted = true;
+        }
+
+        // Toggle fast-forwarding
+        if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_TAB && !e.key.repeat) {
+            fastForward = !fastForward;
+        }
+
+        // Process keydown and keyup events. They're ignored while a movie
+        // has the keys.
+        if (e.type == SDL_KEYDOWN || e.type == SDL_KEYUP) {
             for (int i = 0; i < 16; ++i) {
                 if (e.key.keysym.sym == keymap[i]) {
-                    skylark.key[i] = 0;
+                    if (e.type == SDL_KEYDOWN) {
+                        held.fetch_or(1 << i);
+                    }
+                    else {
+                        held.fetch_and(~(1 << i));
+                    }
                 }
             }
         }
     }
-    skylark.drawflag = false;
-    SDL_Delay(2);
+
+    // Wake the emulation thread if it's waiting on the keyboard
+    if(handled){
+      {
+        lock_guard<mutex> lock(waking);
+        ++inputs;
+      }
+      woken.notify_one();
+    }
+
+    // Show the newest frame, or wait for input if there isn't one. A moment
+    // is long enough while frames are coming, but a sleeping emulation thread
+    // sends none, so then this one sleeps too.
+    if(!frames.take()){
+      if(asleep){
+        SDL_WaitEvent(NULL);
+      }
+      else{
+        SDL_WaitEventTimeout(NULL, 2);
+      }
+      continue;
+    }
+    const screen_frame& next = frames.read();
+    int height = next.hires ? 64 : 32;
+
+    // Update the rows of the texture that differ from the frame it holds, or
+    // all of them if it holds the other resolution
+    uint64_t dirty = 0;
+    for(int row = 0; row < height; ++row){
+      if(next.hires != shown.hires ||
+         memcmp(next.planes[0][row], shown.planes[0][row], sizeof(next.planes[0][row])) != 0 ||
+         memcmp(next.planes[1][row], shown.planes[1][row], sizeof(next.planes[1][row])) != 0){
+        dirty |= 1ULL << row;
+      }
+    }
+    for(int row = 0; row < height; ){
+      if((dirty & (1ULL << row)) == 0){
+        ++row;
+        continue;
+      }
+      // Upload each run of changed rows as one rectangle
+      int first = row;
+      while(row < height && (dirty & (1ULL << row)) != 0){
+        ++row;
+      }
+      uploadRows(next, texture, pixel_buffer, first, row - first);
+    }
+    shown = next;
+
+    // Clear screen
+    SDL_Rect visible = {0, 0, next.hires ? 128 : 64, height};
+    SDL_RenderClear(renderer); // clears the screen
+    SDL_RenderCopy(renderer, texture, &visible, NULL); // copy texture to rendering target
+    SDL_RenderPresent(renderer); // updates the screen with new rendering
   }
+  emulator.join();
 
+  if(speaker != 0){
+    SDL_CloseAudioDevice(speaker);
+    if(samples.getUnderruns() != 0 || samples.getDropped() != 0){
+      cout << "Sound ran dry " << samples.getUnderruns() << " times and dropped "
+           << samples.getDropped() << " samples." << endl;
+    }
+  }
+
+  if(!profileFile.empty()){
+    if(profile.writeReport(profileFile) && profile.writeFolded(profileFile + ".folded")){
+      cout << "Profile written to " << profileFile << endl;
+    }
+    else{
+      cout << "Couldn't write the profile." << endl;
+    }
+  }
+
+  if(!recordFile.empty()){
+    if(recording.save(recordFile)){
+      cout << "Movie written to " << recordFile << endl;
+    }
+    else{
+      cout << "Couldn't write the movie file." << endl;
+    }
+  }
 
   return 0;
 }
+
+// Converts rows first through first + count - 1 of the screen to pixels and
+// uploads just those rows to the texture. Pixels lit in the first plane are
+// white, in the second grey and in both light grey.
+static void uploadRows(const screen_frame& screen, SDL_Texture* texture,
+                       unsigned int* pixel_buffer, int first, int count){
+  static const unsigned int palette[4] = {0xFF000000, 0xFFFFFFFF, 0xFF555555, 0xFFAAAAAA};
+  int width = screen.hires ? 128 : 64;
+  for(int y = first; y < first + count; ++y){
+    for(int x = 0; x < width; ++x){
+      int word = x / 64;
+      int bit = 63 - x % 64;
+      pixel_buffer[y * width + x] = palette[((screen.planes[0][y][word] >> bit) & 1) |
+                                            (((screen.planes[1][y][word] >> bit) & 1) << 1)];
+    }
+  }
+
+  SDL_Rect rect = {0, first, width, count};
+  SDL_UpdateTexture(texture, &rect, pixel_buffer + first * width, width * sizeof(unsigned int));
+}
+
+// Called on SDL's audio thread whenever it needs more sound
+static void playSamples(void* ring, Uint8* stream, int length){
+  ((sample_ring*) ring)->pop((int16_t*) stream, length / sizeof(int16_t));
+}
@@ -0,0 +1,77 @@
+#include "movie.h"
+#include <fstream>
+#include <cstring>
+
+using namespace std;
+
+movie::movie(uint64_t seed, uint32_t rate) : seed(seed), rate(rate), length(0), next(0) {
+}
+
+void movie::record(uint32_t frame, const unsigned char* key){
+  uint16_t keys = 0;
+  for(int n = 0; n < 16; ++n){
+    keys |= (key[n] != 0 ? 1 : 0) << n;
+  }
+  uint16_t last = events.empty() ? 0 : events.back().keys;
+  if(keys != last){
+    movie_event e = {frame, keys, 0};
+    events.push_back(e);
+  }
+  length = frame + 1;
+}
+
+bool movie::save(const string& filename){
+  movie_header header;
+  memcpy(header.magic, "SKMV", 4);
+  header.version = VERSION;
+  header.reserved = 0;
+  header.seed = seed;
+  header.rate = rate;
+  header.length = length;
+  header.count = events.size();
+  header.reserved2 = 0;
+
+  ofstream out(filename, ofstream::binary);
+  out.write((const char*) &header, sizeof(header));
+  if(!events.empty()){
+    out.write((const char*) &events[0], events.size() * sizeof(movie_event));
+  }
+  return (bool) out;
+}
+
+bool movie::load(const string& filename, movie& out){
+  ifstream in(filename, ifstream::binary);
+  movie_header header;
+  if(!in.read((char*) &header, sizeof(header)) || memcmp(header.magic, "SKMV", 4) != 0 ||
+     header.version != VERSION){
+    return false;
+  }
+  out.seed = header.seed;
+  out.rate = header.rate;
+  out.length = header.length;
+  out.events.resize(header.count);
+  out.next = 0;
+  return header.count == 0 ||
+         (bool) in.read((char*) &out.events[0], header.count * sizeof(movie_event));
+}
+
+void movie::play(uint32_t frame, unsigned char* key){
+  while(next < events.size() && events[next].frame <= frame){
+    for(int n = 0; n < 16; ++n){
+      key[n] = (events[next].keys >> n) & 1;
+    }
+    ++next;
+  }
+}
+
+uint64_t movie::getSeed(){
+  return seed;
+}
+
+uint32_t movie::getRate(){
+  return rate;
+}
+
+uint32_t movie::getLength(){
+  return length;
+}
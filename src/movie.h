@@ -0,0 +1,64 @@
+#ifndef SKYLARK_MOVIE_H_
+#define SKYLARK_MOVIE_H_
+/*
+ *  movie.h
+ *
+ *  Records the keypad against the emulated frame number so a session can be
+ *  played back exactly, with or without a display and at any speed. Along
+ *  with the keys, a movie holds the seed for CXNN and the instruction rate,
+ *  which together with the ROM decide everything the cpu does.
+ *
+ */
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Layout of a movie file: this header followed by count events, in frame order
+struct movie_header {
+  char magic[4]; // "SKMV"
+  uint16_t version;
+  uint16_t reserved;
+  uint64_t seed; // seed given to cpu::seed()
+  uint32_t rate; // instructions per second, see scheduler
+  uint32_t length; // frames recorded
+  uint32_t count; // events in the file
+  uint32_t reserved2;
+};
+
+// The whole keypad, one bit per key, from the start of the given frame on
+struct movie_event {
+  uint32_t frame;
+  uint16_t keys;
+  uint16_t reserved;
+};
+
+class movie {
+public:
+  static const uint16_t VERSION = 1;
+
+  movie(uint64_t seed = 0, uint32_t rate = 0);
+
+  // Recording. Called at the start of every frame with the keypad the frame
+  // will run with; only changes are kept.
+  void record(uint32_t frame, const unsigned char* key);
+  bool save(const std::string& filename);
+
+  // Playback. Sets key[] to what was recorded for frame. Frames have to be
+  // played in order, starting from 0.
+  static bool load(const std::string& filename, movie& out);
+  void play(uint32_t frame, unsigned char* key);
+
+  uint64_t getSeed();
+  uint32_t getRate();
+  uint32_t getLength(); // number of frames recorded
+
+private:
+  uint64_t seed;
+  uint32_t rate;
+  uint32_t length;
+  std::vector<movie_event> events;
+  size_t next; // next event to play
+};
+
+#endif  // SKYLARK_MOVIE_H_
@@ -0,0 +1,162 @@
+#ifndef SKYLARK_OPS_H_
+#define SKYLARK_OPS_H_
+/*
+ *  ops.h
+ *
+ *  The opcode handlers of the cpu and the table of opcode layouts they are
+ *  decoded from. Only the core includes this.
+ *
+ */
+
+#include "cpu.h"
+
+// The opcode handlers. Each one executes a single decoded instruction and
+// moves the program counter along.
+struct cpu::ops {
+  // An opcode layout the cpu understands: any opcode where
+  // (opcode & mask) == pattern is executed by exec, on platform and the ones
+  // after it. The disassembler writes it out from text (assembly) or about (a
+  // sentence), filling in {x}, {y}, {n}, {nn} and {nnn} from the opcode.
+  struct spec {
+    unsigned short mask;
+    unsigned short pattern;
+    const char* name;
+    void (*exec)(cpu& chip8, const instruction& op);
+    unsigned char flags;
+    rom_platform platform; // the first machine that has it
+    const char* text;
+    const char* about;
+  };
+  static const spec specs[];
+  static const int SPEC_COUNT;
+  typedef void (*handler)(cpu& chip8, const instruction& op);
+
+  // Quirk policies, one for each quirk_profile. The handlers in quirky<Q>
+  // are compiled once for each, so every copy has its quirks built in and
+  // none of them are checked as it runs.
+  struct modern {
+    static const bool SHIFT_VY = false; // 8XY6 and 8XYE shift VY into VX
+    static const bool MOVE_I = false; // FX55 and FX65 leave I past the registers
+    static const bool JUMP_VX = false; // BXNN jumps to XNN plus VX
+    static const bool CLIP = false; // sprites are cut off at the edges
+    static const bool RESET_VF = false; // 8XY1, 8XY2 and 8XY3 set VF to 0
+  };
+  struct cosmac {
+    static const bool SHIFT_VY = true;
+    static const bool MOVE_I = true;
+    static const bool JUMP_VX = false;
+    static const bool CLIP = true;
+    static const bool RESET_VF = true;
+  };
+  struct schip {
+    static const bool SHIFT_VY = false;
+    static const bool MOVE_I = false;
+    static const bool JUMP_VX = true;
+    static const bool CLIP = true;
+    static const bool RESET_VF = false;
+  };
+  struct xochip {
+    static const bool SHIFT_VY = true;
+    static const bool MOVE_I = true;
+    static const bool JUMP_VX = false;
+    static const bool CLIP = false;
+    static const bool RESET_VF = false;
+  };
+
+  // The same quirks as values, for the jit to translate with
+  struct quirk_set {
+    bool shiftVY, moveI, jumpVX, clip, resetVF;
+  };
+  static quirk_set quirksOf(quirk_profile profile);
+
+  // The decode table built from specs with profile Q's handlers and only the
+  // opcodes the platform has, built the first time it's asked for
+  template <class Q> static const instruction* table(rom_platform platform);
+  template <class Q> static handler pick(handler h);
+
+  // The index into specs of the layout opcode matches, or SPEC_COUNT if it
+  // isn't implemented. Looked up in a table built once, like the decode table.
+  static int find(unsigned short opcode);
+  static size_t format(const char* text, unsigned short opcode, const char* label,
+                       char* out, size_t size);
+
+  // Two instructions that often appear back to back, executed together by
+  // one handler. The handler is given the first instruction and finds the
+  // second right after it.
+  struct fusion {
+    void (*first)(cpu& chip8, const instruction& op);
+    void (*second)(cpu& chip8, const instruction& op);
+    void (*exec)(cpu& chip8, const instruction& op);
+  };
+  static const fusion fusions[];
+
+  static void skip(cpu& c, bool taken);
+
+  static void op00CN(cpu& c, const instruction& op);
+  static void op00DN(cpu& c, const instruction& op);
+  static void op00E0(cpu& c, const instruction& op);
+  static void op00EE(cpu& c, const instruction& op);
+  static void op00FB(cpu& c, const instruction& op);
+  static void op00FC(cpu& c, const instruction& op);
+  static void op00FD(cpu& c, const instruction& op);
+  static void op00FE(cpu& c, const instruction& op);
+  static void op00FF(cpu& c, const instruction& op);
+  static void op1NNN(cpu& c, const instruction& op);
+  static void op2NNN(cpu& c, const instruction& op);
+  static void op3XNN(cpu& c, const instruction& op);
+  static void op4XNN(cpu& c, const instruction& op);
+  static void op5XY0(cpu& c, const instruction& op);
+  static void op5XY2(cpu& c, const instruction& op);
+  static void op5XY3(cpu& c, const instruction& op);
+  static void op6XNN(cpu& c, const instruction& op);
+  static void op7XNN(cpu& c, const instruction& op);
+  static void op8XY0(cpu& c, const instruction& op);
+  static void op8XY4(cpu& c, const instruction& op);
+  static void op8XY5(cpu& c, const instruction& op);
+  static void op8XY7(cpu& c, const instruction& op);
+  static void op9XY0(cpu& c, const instruction& op);
+  static void opANNN(cpu& c, const instruction& op);
+  static void opCXNN(cpu& c, const instruction& op);
+  static void opEX9E(cpu& c, const instruction& op);
+  static void opEXA1(cpu& c, const instruction& op);
+  static void opF000(cpu& c, const instruction& op);
+  static void opFN01(cpu& c, const instruction& op);
+  static void opF002(cpu& c, const instruction& op);
+  static void opFX07(cpu& c, const instruction& op);
+  static void opFX0A(cpu& c, const instruction& op);
+  static void opFX15(cpu& c, const instruction& op);
+  static void opFX18(cpu& c, const instruction& op);
+  static void opFX1E(cpu& c, const instruction& op);
+  static void opFX29(cpu& c, const instruction& op);
+  static void opFX33(cpu& c, const instruction& op);
+  static void opFX30(cpu& c, const instruction& op);
+  static void opFX3A(cpu& c, const instruction& op);
+  static void opFX75(cpu& c, const instruction& op);
+  static void opFX85(cpu& c, const instruction& op);
+  static void trap(cpu& c, const instruction& op);
+
+  // Superinstructions
+  static void op6XNN_6XNN(cpu& c, const instruction& op);
+
+  // The handlers whose opcodes interpreters disagree on, for quirk policy Q
+  template <class Q> struct quirky {
+    static void op8XY1(cpu& c, const instruction& op);
+    static void op8XY2(cpu& c, const instruction& op);
+    static void op8XY3(cpu& c, const instruction& op);
+    static void op8XY6(cpu& c, const instruction& op);
+    static void op8XYE(cpu& c, const instruction& op);
+    static void opBNNN(cpu& c, const instruction& op);
+    static void opDXYN(cpu& c, const instruction& op);
+    static void opFX55(cpu& c, const instruction& op);
+    static void opFX65(cpu& c, const instruction& op);
+    static void opANNN_DXYN(cpu& c, const instruction& op); // superinstruction
+  };
+};
+
+// Each policy's handlers are compiled once, in cpu.cpp
+extern template struct cpu::ops::quirky<cpu::ops::modern>;
+extern template struct cpu::ops::quirky<cpu::ops::cosmac>;
+extern template struct cpu::ops::quirky<cpu::ops::schip>;
+extern template struct cpu::ops::quirky<cpu::ops::xochip>;
+
+#endif  // SKYLARK_OPS_H_
@@ -0,0 +1,180 @@
+#include "profiler.h"
+#include "cpu.h"
+#include <algorithm>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+
+static const size_t HOT_ADDRESSES = 32; // addresses listed in the report
+
+profiler::profiler() : byAddress(0x10000), opcodeAt(0x10000), byOpcode(0x10000), total(0),
+                       path(0), draws(0), drawTotal(0), drawMost(0), frames(0),
+                       waits(0), waitFrames(0), waited(false) {
+  call_path root = {0, 0x200, 0};
+  paths.push_back(root);
+  memset(drawFrames, 0, sizeof(drawFrames));
+}
+
+void profiler::enter(uint16_t routine){
+  ++calls[(uint32_t) paths[path].routine << 16 | routine];
+
+  uint64_t key = (uint64_t) path << 16 | routine;
+  unordered_map<uint64_t, uint32_t>::iterator child = children.find(key);
+  if(child == children.end()){
+    call_path p = {path, routine, 0};
+    paths.push_back(p);
+    child = children.insert(make_pair(key, (uint32_t) paths.size() - 1)).first;
+  }
+  stack.push_back(path);
+  path = child->second;
+}
+
+// A return with nothing to return to (e.g. the program manages the stack
+// itself) leaves the path where it is
+void profiler::leave(){
+  if(!stack.empty()){
+    path = stack.back();
+    stack.pop_back();
+  }
+}
+
+void profiler::frame(){
+  ++frames;
+  drawTotal += draws;
+  drawMost = max(drawMost, draws);
+  ++drawFrames[min<uint64_t>(draws, MAX_DRAWS)];
+  draws = 0;
+
+  if(waited){
+    ++waitFrames;
+    waited = false;
+  }
+}
+
+uint64_t profiler::getTotal(){
+  return total;
+}
+
+// The share of all instructions that count is, as a percentage
+static double percent(uint64_t count, uint64_t total){
+  return total == 0 ? 0.0 : 100.0 * count / total;
+}
+
+bool profiler::writeReport(const string& filename){
+  ofstream out(filename);
+  if(!out.is_open()){
+    return false;
+  }
+  char line[128];
+  char text[32];
+
+  snprintf(line, sizeof(line), "instructions %llu\nframes %llu\n",
+           (unsigned long long) total, (unsigned long long) frames);
+  out << "# skylark profile\n" << line;
+
+  // The addresses run most, with what was last run there
+  vector<uint16_t> hot;
+  for(unsigned int a = 0; a < 0x10000; ++a){
+    if(byAddress[a] != 0){
+      hot.push_back(a);
+    }
+  }
+  sort(hot.begin(), hot.end(), [this](uint16_t a, uint16_t b){
+    return byAddress[a] != byAddress[b] ? byAddress[a] > byAddress[b] : a < b;
+  });
+  out << "\n## hottest addresses\n";
+  for(size_t n = 0; n < hot.size() && n < HOT_ADDRESSES; ++n){
+    uint16_t a = hot[n];
+    cpu::disassemble(opcodeAt[a], text, sizeof(text));
+    snprintf(line, sizeof(line), "%14llu %6.2f%%  %03X  %04X  %s\n",
+             (unsigned long long) byAddress[a], percent(byAddress[a], total), a,
+             opcodeAt[a], text);
+    out << line;
+  }
+
+  // Opcodes grouped by layout, e.g. every 6XNN together
+  vector<pair<uint64_t, string> > kinds;
+  unordered_map<string, uint64_t> byKind;
+  for(unsigned int oc = 0; oc < 0x10000; ++oc){
+    if(byOpcode[oc] != 0){
+      const char* name = cpu::opcodeName(oc);
+      byKind[name != NULL ? name : "????"] += byOpcode[oc];
+    }
+  }
+  for(const pair<const string, uint64_t>& k : byKind){
+    kinds.push_back(make_pair(k.second, k.first));
+  }
+  sort(kinds.rbegin(), kinds.rend());
+  out << "\n## opcodes\n";
+  for(const pair<uint64_t, string>& k : kinds){
+    snprintf(line, sizeof(line), "%14llu %6.2f%%  %s\n",
+             (unsigned long long) k.first, percent(k.first, total), k.second.c_str());
+    out << line;
+  }
+
+  out << "\n## draws per frame\n";
+  snprintf(line, sizeof(line), "draws %llu\nmean %.2f\nmost %llu\n",
+           (unsigned long long) drawTotal, frames == 0 ? 0.0 : (double) drawTotal / frames,
+           (unsigned long long) drawMost);
+  out << line;
+  for(int d = 0; d <= MAX_DRAWS; ++d){
+    if(drawFrames[d] != 0){
+      snprintf(line, sizeof(line), "%14llu frames with %s%d\n",
+               (unsigned long long) drawFrames[d], d == MAX_DRAWS ? ">=" : "", d);
+      out << line;
+    }
+  }
+
+  out << "\n## key waits\n";
+  snprintf(line, sizeof(line), "instructions %llu (%.2f%%)\nframes %llu\n",
+           (unsigned long long) waits, percent(waits, total), (unsigned long long) waitFrames);
+  out << line;
+
+  // Call graph edges, busiest first
+  vector<pair<uint64_t, uint32_t> > edges;
+  for(const pair<const uint32_t, uint64_t>& c : calls){
+    edges.push_back(make_pair(c.second, c.first));
+  }
+  sort(edges.rbegin(), edges.rend());
+  out << "\n## calls\n";
+  for(const pair<uint64_t, uint32_t>& e : edges){
+    snprintf(line, sizeof(line), "%14llu  S%03X -> S%03X\n",
+             (unsigned long long) e.first, e.second >> 16, e.second & 0xFFF);
+    out << line;
+  }
+  return (bool) out;
+}
+
+// One line per call path that ran any instructions, outermost routine first,
+// in the format flamegraph.pl and similar tools read
+bool profiler::writeFolded(const string& filename){
+  ofstream out(filename);
+  if(!out.is_open()){
+    return false;
+  }
+  char frame[8];
+  string names;
+  vector<uint16_t> routines;
+  for(uint32_t p = 0; p < paths.size(); ++p){
+    if(paths[p].count == 0){
+      continue;
+    }
+    routines.clear();
+    for(uint32_t at = p; ; at = paths[at].parent){
+      routines.push_back(paths[at].routine);
+      if(at == 0){
+        break;
+      }
+    }
+    names.clear();
+    for(size_t r = routines.size(); r-- > 0; ){
+      snprintf(frame, sizeof(frame), "S%03X", routines[r]);
+      names += frame;
+      names += r > 0 ? ";" : " ";
+    }
+    out << names << paths[p].count << '\n';
+  }
+  return (bool) out;
+}
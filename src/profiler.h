@@ -0,0 +1,95 @@
+#ifndef SKYLARK_PROFILER_H_
+#define SKYLARK_PROFILER_H_
+/*
+ *  profiler.h
+ *
+ *  Counts what a cpu spends its instructions on: how often each address and
+ *  each kind of opcode runs, how many sprites are drawn in each frame, how
+ *  long the program waits on FX0A for keys, and which subroutines call which.
+ *  The results are written as a readable report and as folded stacks, one
+ *  line per call path, that flame graph tools take as input.
+ *
+ */
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+class profiler {
+public:
+  static const int MAX_DRAWS = 64; // frames with more draws are counted together
+
+  profiler();
+
+  // Called by the cpu after each instruction it runs while profiling, with
+  // the address it ran from and where pc ended up
+  void record(uint16_t at, uint16_t opcode, uint16_t next){
+    ++byAddress[at];
+    opcodeAt[at] = opcode;
+    ++byOpcode[opcode];
+    ++paths[path].count;
+    ++total;
+
+    switch(opcode >> 12){
+      case 0x0:
+        if(opcode == 0x00EE){
+          leave();
+        }
+      break;
+      case 0x2:
+        enter(opcode & 0xFFF);
+      break;
+      case 0xD:
+        ++draws;
+      break;
+      case 0xF:
+        if((opcode & 0xFF) == 0x0A && next == at){
+          ++waits;
+          waited = true;
+        }
+      break;
+    }
+  }
+  void frame(); // called by the cpu each time the timers tick
+
+  uint64_t getTotal(); // instructions counted
+
+  bool writeReport(const std::string& filename);
+  bool writeFolded(const std::string& filename);
+
+private:
+  // A node in the tree of call paths. Each instruction is counted against
+  // the path it ran on, so a flame graph can be drawn from the counts.
+  struct call_path {
+    uint32_t parent;
+    uint16_t routine; // address of the subroutine, 0x200 for the program itself
+    uint64_t count;
+  };
+
+  void enter(uint16_t routine);
+  void leave();
+
+  std::vector<uint64_t> byAddress; // 65536 counts
+  std::vector<uint16_t> opcodeAt; // the opcode last run at each address
+  std::vector<uint64_t> byOpcode; // 65536 counts
+  uint64_t total;
+
+  std::vector<call_path> paths;
+  std::unordered_map<uint64_t, uint32_t> children; // parent << 16 | routine to path
+  std::unordered_map<uint32_t, uint64_t> calls; // caller << 16 | callee to count
+  std::vector<uint32_t> stack; // paths that will be returned to
+  uint32_t path; // the path running now
+
+  uint64_t draws; // DXYN run in this frame
+  uint64_t drawTotal;
+  uint64_t drawMost;
+  uint64_t drawFrames[MAX_DRAWS + 1]; // frames with each number of draws
+  uint64_t frames;
+
+  uint64_t waits; // FX0A run without a key to take
+  uint64_t waitFrames; // frames that waited at all
+  bool waited; // FX0A waited in this frame
+};
+
+#endif  // SKYLARK_PROFILER_H_
@@ -0,0 +1,254 @@
+#include "rom.h"
+#include "cpu.h"
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+static const char* INDEX_HEADER = "# skylark rom index 1";
+
+rom_image::rom_image() : mapping(NULL), length(0) {
+}
+
+rom_image::~rom_image(){
+  close();
+}
+
+bool rom_image::open(const string& filename){
+  close();
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if(fd < 0){
+    return false;
+  }
+  struct stat info;
+  bool ok = fstat(fd, &info) == 0 && S_ISREG(info.st_mode);
+  if(ok && info.st_size > 0){
+    // An empty file can't be mapped, but it's still a valid (empty) ROM
+    void* p = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ok = p != MAP_FAILED;
+    if(ok){
+      mapping = p;
+      length = info.st_size;
+    }
+  }
+  ::close(fd);
+  return ok;
+}
+
+const unsigned char* rom_image::data() const{
+  return (const unsigned char*) mapping;
+}
+
+size_t rom_image::size() const{
+  return length;
+}
+
+void rom_image::close(){
+  if(mapping != NULL){
+    munmap(mapping, length);
+  }
+  mapping = NULL;
+  length = 0;
+}
+
+uint64_t hashRom(const unsigned char* data, size_t length){
+  uint64_t hash = 14695981039346656037ULL;
+  for(size_t n = 0; n < length; ++n){
+    hash = (hash ^ data[n]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+const char* platformName(rom_platform platform){
+  switch(platform){
+  case PLATFORM_SCHIP:
+    return "schip";
+  case PLATFORM_XOCHIP:
+    return "xochip";
+  default:
+    return "chip8";
+  }
+}
+
+const char* quirksName(quirk_profile quirks){
+  switch(quirks){
+  case QUIRKS_COSMAC:
+    return "cosmac";
+  case QUIRKS_SCHIP:
+    return "schip";
+  case QUIRKS_XOCHIP:
+    return "xochip";
+  default:
+    return "modern";
+  }
+}
+
+bool parseQuirks(const string& name, quirk_profile& quirks){
+  static const quirk_profile all[] = {QUIRKS_MODERN, QUIRKS_COSMAC, QUIRKS_SCHIP, QUIRKS_XOCHIP};
+  for(quirk_profile q : all){
+    if(name == quirksName(q)){
+      quirks = q;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Follows the code from the start of the ROM, through jumps, calls and skips,
+// and looks for opcodes only the later machines have. Only code that can be
+// reached counts, since sprites and other data can look like any opcode.
+rom_platform detectPlatform(const unsigned char* data, size_t length){
+  bool schip = false;
+  bool xochip = false;
+  vector<bool> seen(length, false);
+  vector<size_t> pending(1, 0);
+  while(!pending.empty()){
+    size_t at = pending.back();
+    pending.pop_back();
+
+    // Straight-line code from at until something ends it
+    while(at + 1 < length && !seen[at]){
+      seen[at] = true;
+      unsigned short opcode = data[at] << 8 | data[at + 1];
+      unsigned short nnn = opcode & 0x0FFF;
+      unsigned char nn = opcode & 0x00FF;
+      size_t target = nnn >= 0x200 ? nnn - 0x200 : length; // outside the ROM if below 0x200
+
+      if((opcode & 0xFFF0) == 0x00C0 || opcode == 0x00FB || opcode == 0x00FC ||
+         opcode == 0x00FD || opcode == 0x00FE || opcode == 0x00FF ||
+         ((opcode & 0xF000) == 0xF000 && (nn == 0x30 || nn == 0x75 || nn == 0x85))){
+        schip = true;
+      }
+      if((opcode & 0xFFF0) == 0x00D0 || (opcode & 0xF00E) == 0x5002 || opcode == 0xF000 ||
+         opcode == 0xF002 || (opcode & 0xF0FF) == 0xF001 || (opcode & 0xF0FF) == 0xF03A){
+        xochip = true;
+      }
+
+      if(opcode == 0x0000 || opcode == 0x00EE || opcode == 0x00FD ||
+         (opcode & 0xF000) == 0xB000){
+        break; // no way of telling where it goes from here
+      }
+      else if((opcode & 0xF000) == 0x1000){
+        at = target;
+      }
+      else if((opcode & 0xF000) == 0x2000){
+        pending.push_back(target);
+        at += 2;
+      }
+      else if((opcode & 0xF000) == 0x3000 || (opcode & 0xF000) == 0x4000 ||
+              (opcode & 0xF00F) == 0x5000 || (opcode & 0xF00F) == 0x9000 ||
+              (opcode & 0xF0FF) == 0xE09E || (opcode & 0xF0FF) == 0xE0A1){
+        // Skipping F000 skips its address too, as on XO-CHIP. Reaching the
+        // F000 makes the ROM XO-CHIP anyway, so that's how the cpu will skip.
+        bool isLong = at + 3 < length && data[at + 2] == 0xF0 && data[at + 3] == 0x00;
+        pending.push_back(at + (isLong ? 6 : 4));
+        at += 2;
+      }
+      else{
+        at += opcode == 0xF000 ? 4 : 2; // F000 is followed by a 16-bit address
+      }
+    }
+  }
+
+  if(xochip){
+    return PLATFORM_XOCHIP;
+  }
+  return schip ? PLATFORM_SCHIP : PLATFORM_CHIP8;
+}
+
+bool rom_library::load(const string& filename){
+  roms.clear();
+  byPath.clear();
+  byHash.clear();
+
+  ifstream in(filename);
+  if(!in.is_open()){
+    return true;
+  }
+  string line;
+  if(!getline(in, line) || line != INDEX_HEADER){
+    return false;
+  }
+
+  // Each line holds the hash, size, modification time and platform, then the
+  // path, which takes up the rest of the line
+  while(getline(in, line)){
+    istringstream ss(line);
+    rom_info r;
+    string platform;
+    if(!(ss >> hex >> r.hash >> dec >> r.size >> r.modified >> platform) || ss.get() != ' ' ||
+       !getline(ss, r.path)){
+      return false;
+    }
+    r.platform = platform == "xochip" ? PLATFORM_XOCHIP :
+                 platform == "schip" ? PLATFORM_SCHIP : PLATFORM_CHIP8;
+    r.fits = r.size <= cpu::maxRomSize(r.platform);
+    byPath[r.path] = roms.size();
+    byHash[r.hash] = roms.size();
+    roms.push_back(r);
+  }
+  return true;
+}
+
+bool rom_library::save(const string& filename){
+  ofstream out(filename);
+  out << INDEX_HEADER << '\n';
+  for(const rom_info& r : roms){
+    out << hex << r.hash << dec << ' ' << r.size << ' ' << r.modified << ' '
+        << platformName(r.platform) << ' ' << r.path << '\n';
+  }
+  return (bool) out;
+}
+
+const rom_info* rom_library::update(const string& path){
+  struct stat info;
+  if(stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode)){
+    return NULL;
+  }
+
+  // Files that haven't changed are taken from the index without reading them
+  map<string, size_t>::iterator known = byPath.find(path);
+  if(known != byPath.end() && roms[known->second].size == (uint64_t) info.st_size &&
+     roms[known->second].modified == (int64_t) info.st_mtime){
+    return &roms[known->second];
+  }
+
+  rom_image image;
+  if(!image.open(path)){
+    return NULL;
+  }
+  rom_info r;
+  r.path = path;
+  r.hash = hashRom(image.data(), image.size());
+  r.size = image.size();
+  r.modified = info.st_mtime;
+  r.platform = detectPlatform(image.data(), image.size());
+  r.fits = r.size <= cpu::maxRomSize(r.platform);
+
+  size_t slot = known != byPath.end() ? known->second : roms.size();
+  if(slot == roms.size()){
+    roms.push_back(r);
+  }
+  else{
+    if(byHash[roms[slot].hash] == slot){
+      byHash.erase(roms[slot].hash); // the old contents are gone
+    }
+    roms[slot] = r;
+  }
+  byPath[path] = slot;
+  byHash[r.hash] = slot;
+  return &roms[slot];
+}
+
+const rom_info* rom_library::find(uint64_t hash){
+  map<uint64_t, size_t>::iterator found = byHash.find(hash);
+  return found != byHash.end() ? &roms[found->second] : NULL;
+}
+
+const vector<rom_info>& rom_library::entries(){
+  return roms;
+}
@@ -0,0 +1,83 @@
+#ifndef SKYLARK_ROM_H_
+#define SKYLARK_ROM_H_
+/*
+ *  rom.h
+ *
+ *  ROM files mapped straight into memory, so loading one is a single copy
+ *  into the cpu's ram, and a library index of ROMs with their hash, size and
+ *  what they look like they were written for. The index is kept in a file so
+ *  large collections only have to be read and hashed once.
+ *
+ */
+
+#include "cpu.h"
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <map>
+
+// A whole file mapped read-only into memory
+class rom_image {
+public:
+  rom_image();
+  ~rom_image();
+
+  bool open(const std::string& filename); // false if the file can't be read
+  const unsigned char* data() const;
+  size_t size() const;
+
+private:
+  rom_image(const rom_image&); // not copyable, it owns the mapping
+  rom_image& operator=(const rom_image&);
+
+  void close();
+
+  void* mapping;
+  size_t length;
+};
+
+// 64-bit FNV-1a of a ROM's contents
+uint64_t hashRom(const unsigned char* data, size_t length);
+
+// Which machine a ROM is written for, guessed from the opcodes in it: SUPER-CHIP
+// if it uses opcodes such as scrolling or 00FF, XO-CHIP for ones such as
+// F000 NNNN or 5XY2
+const char* platformName(rom_platform platform);
+rom_platform detectPlatform(const unsigned char* data, size_t length);
+
+// Names for the quirk profiles, for picking one on the command line. Returns
+// false if name isn't one of modern, cosmac, schip or xochip.
+const char* quirksName(quirk_profile quirks);
+bool parseQuirks(const std::string& name, quirk_profile& quirks);
+
+// What the library knows about one ROM file
+struct rom_info {
+  std::string path;
+  uint64_t hash;
+  uint64_t size;
+  int64_t modified; // seconds since the epoch, to tell if the file changed
+  rom_platform platform;
+  bool fits; // small enough to be loaded into the cpu for its platform
+};
+
+class rom_library {
+public:
+  // Reads an index written by save(). A missing file is an empty library.
+  bool load(const std::string& filename);
+  bool save(const std::string& filename);
+
+  // Adds the ROM at path, or refreshes it if the file has changed since it
+  // was indexed. Returns NULL if it can't be read.
+  const rom_info* update(const std::string& path);
+
+  const rom_info* find(uint64_t hash); // NULL if no ROM has that hash
+  const std::vector<rom_info>& entries();
+
+private:
+  std::vector<rom_info> roms;
+  std::map<std::string, size_t> byPath;
+  std::map<uint64_t, size_t> byHash;
+};
+
+#endif  // SKYLARK_ROM_H_
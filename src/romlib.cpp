@@ -0,0 +1,74 @@
+/*
+ *  romlib.cpp
+ *
+ *  Maintains a ROM library index. Every ROM file given, or found directly
+ *  inside a directory given, is added to the index or refreshed if it has
+ *  changed, and then the whole index is listed.
+ *
+ */
+
+#include "rom.h"
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <dirent.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+static void addPath(rom_library& library, const string& path);
+
+int main(int argc, char* argv[]){
+
+  // Makes sure there's a proper number of arguments
+  if(argc < 2){
+    cout << "USAGE: romlib.exe <INDEX_FILE> [ROM_FILE | ROM_DIRECTORY]..." << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  string index(argv[1]);
+  rom_library library;
+  if(!library.load(index)){
+    cout << "Not a valid index file." << endl;
+    return EXIT_FAILURE;
+  }
+
+  for(int a = 2; a < argc; ++a){
+    addPath(library, argv[a]);
+  }
+  if(argc > 2 && !library.save(index)){
+    cout << "Couldn't write the index file." << endl;
+    return EXIT_FAILURE;
+  }
+
+  // One line per ROM, with the ones that are too big to load marked
+  for(const rom_info& r : library.entries()){
+    cout << hex << setfill('0') << setw(16) << r.hash << dec << setfill(' ')
+         << setw(8) << r.size << "  " << left << setw(7) << platformName(r.platform)
+         << right << (r.fits ? "  " : "! ") << r.path << '\n';
+  }
+  cout << flush;
+  return 0;
+}
+
+static void addPath(rom_library& library, const string& path){
+  struct stat info;
+  if(stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode)){
+    DIR* dir = opendir(path.c_str());
+    if(dir == NULL){
+      cout << "Couldn't read " << path << endl;
+      return;
+    }
+    for(dirent* entry = readdir(dir); entry != NULL; entry = readdir(dir)){
+      string name(entry->d_name);
+      string full = path + "/" + name;
+      if(name[0] != '.' && stat(full.c_str(), &info) == 0 && S_ISREG(info.st_mode)){
+        library.update(full);
+      }
+    }
+    closedir(dir);
+  }
+  else if(library.update(path) == NULL){
+    cout << "Couldn't read " << path << endl;
+  }
+}
@@ -0,0 +1,70 @@
+#include "scheduler.h"
+#include <thread>
+
+using namespace std;
+
+static const chrono::nanoseconds FRAME_LENGTH(1000000000 / scheduler::FRAME_RATE);
+static const int MAX_BEHIND = 5; // frames the host can lag before giving up on them
+static const unsigned long BATCH = 1000; // instructions run between clock checks when unlimited
+
+scheduler::scheduler(unsigned long rate) : rate(rate), frame(0) {
+  deadline = clock::now() + FRAME_LENGTH;
+}
+
+unsigned long scheduler::runFrame(cpu& chip8){
+  unsigned long executed = 0;
+  if(rate > 0){
+    executed = chip8.run(instructionsIn(frame));
+  }
+  else{
+    do{
+      unsigned long n = chip8.run(BATCH);
+      executed += n;
+      // Stopped on an opcode that isn't implemented, or waiting for a key or
+      // the timer, which won't come before the frame ends
+      if(n < BATCH || chip8.getIdle() != cpu::BUSY){
+        break;
+      }
+    } while(clock::now() < deadline);
+  }
+
+  chip8.tickTimers();
+  ++frame;
+  return executed;
+}
+
+unsigned long scheduler::runFrameAhead(cpu& chip8, unsigned long ahead){
+  unsigned long executed = chip8.run(instructionsIn(frame + ahead));
+  chip8.tickTimers();
+  return executed;
+}
+
+// Rates that don't divide into 60 still come out exact over each second
+unsigned long scheduler::instructionsIn(unsigned long number){
+  unsigned long second = number % FRAME_RATE;
+  return rate * (second + 1) / FRAME_RATE - rate * second / FRAME_RATE;
+}
+
+void scheduler::waitForFrame(){
+  clock::time_point now = clock::now();
+  if(now > deadline + MAX_BEHIND * FRAME_LENGTH){
+    // Too far behind to catch up, so start counting from now
+    deadline = now;
+  }
+  else if(now < deadline){
+    this_thread::sleep_until(deadline);
+  }
+  deadline += FRAME_LENGTH;
+}
+
+void scheduler::setRate(unsigned long rate){
+  this->rate = rate;
+}
+
+unsigned long scheduler::getRate(){
+  return rate;
+}
+
+unsigned long scheduler::getFrame(){
+  return frame;
+}
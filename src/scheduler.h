@@ -0,0 +1,45 @@
+#ifndef SKYLARK_SCHEDULER_H_
+#define SKYLARK_SCHEDULER_H_
+/*
+ *  scheduler.h
+ *
+ *  Paces emulation against the wall clock. Each 60Hz frame runs its share of
+ *  instructions in one batch, ticks the timers once, and then the host sleeps
+ *  until the next frame is due.
+ *
+ */
+
+#include "cpu.h"
+#include <chrono>
+
+class scheduler {
+public:
+  static const unsigned long FRAME_RATE = 60; // frames per second
+  static const unsigned long DEFAULT_RATE = 600; // instructions per second
+
+  // rate is the number of instructions run each second of emulated time, or
+  // 0 to run as many as the host can fit in each frame
+  explicit scheduler(unsigned long rate = DEFAULT_RATE);
+
+  unsigned long runFrame(cpu& chip8); // runs one frame, returns instructions run
+  // Runs the frame that comes ahead frames after the next one, with its
+  // share of instructions, but doesn't count it. It's for running ahead from
+  // a snapshot that's restored after, and needs a fixed rate.
+  unsigned long runFrameAhead(cpu& chip8, unsigned long ahead);
+  void waitForFrame(); // sleeps until the next frame is due
+
+  void setRate(unsigned long rate);
+  unsigned long getRate();
+  unsigned long getFrame(); // number of frames run so far
+
+private:
+  typedef std::chrono::steady_clock clock;
+
+  unsigned long instructionsIn(unsigned long number); // at a fixed rate
+
+  unsigned long rate;
+  unsigned long frame;
+  clock::time_point deadline; // when the current frame should end
+};
+
+#endif  // SKYLARK_SCHEDULER_H_
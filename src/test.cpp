@@ -2,6 +2,8 @@
 #include <iostream>
 #include <fstream>
 #include <iomanip>
+#include <sstream>
+#include <cstdlib>
 
 using namespace std;
 
@@ -17,13 +19,14 @@ int main(int argc, char* argv[]){
   string game(argv[1]);
 
   ifstream is(game, ifstream::binary);
-  if(is.is_open()){
-    debug.loadGame(is);
-  }
-  else{
+  if(!is.is_open()){
     cout << "that's not a file" << endl;
     return 0;
   }
+  if(!debug.loadGame(is)){
+    cout << "that ROM is too big" << endl;
+    return 0;
+  }
 
   cout << "Press enter to step through emulation. Type 'h' for other commands." << endl;
 
@@ -55,6 +58,63 @@ int main(int argc, char* argv[]){
       debug.printStackPointer();
     }
 
+    else if(input == "continue" || input == "c"){
+      debug.continueRun();
+      debug.printStop();
+      debug.printOpcode();
+      debug.printProgramCounter();
+    }
+
+    else if(input.compare(0, 4, "run ") == 0){
+      unsigned long count = strtoul(input.c_str() + 4, NULL, 0);
+      cout << "Ran " << dec << debug.run(count) << " instructions" << endl;
+      debug.printStop();
+      debug.printOpcode();
+      debug.printProgramCounter();
+    }
+
+    else if(input.compare(0, 6, "break ") == 0){
+      debug.addBreakpoint(strtoul(input.c_str() + 6, NULL, 16));
+    }
+
+    else if(input.compare(0, 7, "delete ") == 0){
+      if(!debug.removeBreakpoint(strtoul(input.c_str() + 7, NULL, 16))){
+        cout << "There's no breakpoint there." << endl;
+      }
+    }
+
+    else if(input == "delete"){
+      debug.clearBreakpoints();
+    }
+
+    else if(input.compare(0, 5, "cond ") == 0){
+      if(!debug.addCondition(input.substr(5))){
+        cout << "Conditions look like V3 == 5, I >= 0x300 or DT == 0." << endl;
+      }
+    }
+
+    else if(input.compare(0, 6, "watch ") == 0 || input.compare(0, 7, "rwatch ") == 0 ||
+            input.compare(0, 7, "awatch ") == 0){
+      istringstream words(input);
+      string command;
+      unsigned short first, last;
+      words >> command >> hex >> first;
+      if(!words){
+        cout << "Give the address to watch, and optionally the last one." << endl;
+        continue;
+      }
+      if(!(words >> last)){
+        last = first;
+      }
+      debug.watch(first, last, command == "watch" ? breakpoints::WATCH_WRITE :
+                               command == "rwatch" ? breakpoints::WATCH_READ :
+                               breakpoints::WATCH_READ | breakpoints::WATCH_WRITE);
+    }
+
+    else if(input == "info"){
+      debug.printBreakpoints();
+    }
+
     else if(input == "q"){
       return 0;
     }
@@ -65,6 +125,13 @@ int main(int argc, char* argv[]){
       cout << "   pc: Prints the program counter" << endl;
       cout << "stack: List contents of the stack" << endl;
       cout << "   sp: Prints the stack pointer" << endl;
+      cout << "    c: Runs until a breakpoint (also 'continue')" << endl;
+      cout << "run N: Runs at most N instructions, stopping at breakpoints" << endl;
+      cout << "break ADDR / delete ADDR: Sets or removes a breakpoint (hex)" << endl;
+      cout << "delete: Removes every breakpoint, condition and watch" << endl;
+      cout << "cond EXPR: Stops when e.g. V3 == 5, I >= 0x300 or DT == 0 becomes true" << endl;
+      cout << "watch ADDR [LAST]: Stops after ram is written (rwatch: read, awatch: both)" << endl;
+      cout << " info: Lists breakpoints, conditions and watches" << endl;
       cout << "    q: Exits the debugger" << endl;
     }
 
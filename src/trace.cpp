@@ -0,0 +1,108 @@
+#include "trace.h"
+#include <cstring>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+// The trace dumped by the crash handler. A plain array is used for the file
+// name since nothing can be allocated inside a signal handler.
+static tracer* crashTracer = NULL;
+static char crashFile[4096];
+
+static void onCrash(int sig){
+  int fd = open(crashFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd >= 0){
+    crashTracer->dump(fd);
+    close(fd);
+  }
+  // Let the default handler finish the crash
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+tracer::tracer(size_t capacity) : total(0) {
+  size_t size = 1;
+  while(size < capacity){
+    size <<= 1;
+  }
+  records.resize(size);
+  mask = size - 1;
+}
+
+size_t tracer::size(){
+  return total < records.size() ? total : records.size();
+}
+
+uint64_t tracer::getTotal(){
+  return total;
+}
+
+// Writes all of buffer, retrying short writes
+static bool writeAll(int fd, const void* buffer, size_t length){
+  const char* p = (const char*) buffer;
+  while(length > 0){
+    ssize_t n = write(fd, p, length);
+    if(n <= 0){
+      return false;
+    }
+    p += n;
+    length -= n;
+  }
+  return true;
+}
+
+bool tracer::dump(int fd){
+  trace_header header;
+  memcpy(header.magic, "SKTR", 4);
+  header.version = VERSION;
+  header.recordSize = sizeof(trace_record);
+  header.total = total;
+  header.count = size();
+  header.reserved = 0;
+  if(!writeAll(fd, &header, sizeof(header))){
+    return false;
+  }
+
+  // Oldest first: the part of the ring after the write position, then before it
+  size_t next = total & mask;
+  if(total > records.size()){
+    if(!writeAll(fd, &records[next], (records.size() - next) * sizeof(trace_record))){
+      return false;
+    }
+  }
+  return writeAll(fd, &records[0], next * sizeof(trace_record));
+}
+
+bool tracer::dump(const string& filename){
+  int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0){
+    return false;
+  }
+  bool ok = dump(fd);
+  close(fd);
+  return ok;
+}
+
+void tracer::dumpOnCrash(const string& filename){
+  strncpy(crashFile, filename.c_str(), sizeof(crashFile) - 1);
+  crashTracer = this;
+  signal(SIGSEGV, onCrash);
+  signal(SIGBUS, onCrash);
+  signal(SIGFPE, onCrash);
+  signal(SIGILL, onCrash);
+  signal(SIGABRT, onCrash);
+}
+
+bool tracer::load(istream& in, vector<trace_record>& out, uint64_t& total){
+  trace_header header;
+  if(!in.read((char*) &header, sizeof(header)) || memcmp(header.magic, "SKTR", 4) != 0 ||
+     header.version != VERSION || header.recordSize != sizeof(trace_record)){
+    return false;
+  }
+  out.resize(header.count);
+  total = header.total;
+  return header.count == 0 ||
+         (bool) in.read((char*) &out[0], header.count * sizeof(trace_record));
+}
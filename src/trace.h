@@ -0,0 +1,74 @@
+#ifndef SKYLARK_TRACE_H_
+#define SKYLARK_TRACE_H_
+/*
+ *  trace.h
+ *
+ *  Records the most recent instructions executed by a cpu in a fixed-size
+ *  ring buffer. The buffer can be dumped to a compact binary file at any time,
+ *  including from a crash handler, and read back with tracedump.
+ *
+ */
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <istream>
+
+// One executed instruction
+struct trace_record {
+  uint16_t pc; // address the opcode was fetched from
+  uint16_t opcode;
+  uint16_t i; // index register after the instruction ran
+  uint8_t reg; // register the instruction changed, or NO_REGISTER
+  uint8_t value; // new value of that register
+};
+
+// Layout of a trace file: this header followed by count records, oldest first
+struct trace_header {
+  char magic[4]; // "SKTR"
+  uint16_t version;
+  uint16_t recordSize; // sizeof(trace_record)
+  uint64_t total; // instructions recorded over the whole run
+  uint32_t count; // records in the file
+  uint32_t reserved;
+};
+
+class tracer {
+public:
+  static const uint16_t VERSION = 1;
+  static const uint8_t NO_REGISTER = 0xFF;
+
+  // capacity is rounded up to a power of two
+  explicit tracer(size_t capacity = 1 << 16);
+
+  void record(uint16_t pc, uint16_t opcode, uint16_t i, uint8_t reg, uint8_t value){
+    trace_record& r = records[total & mask];
+    r.pc = pc;
+    r.opcode = opcode;
+    r.i = i;
+    r.reg = reg;
+    r.value = value;
+    ++total;
+  }
+
+  size_t size(); // records currently held
+  uint64_t getTotal(); // instructions recorded over the whole run
+
+  // Writes the trace with write(2) only, so it's safe from a signal handler
+  bool dump(int fd);
+  bool dump(const std::string& filename);
+
+  // Dumps this trace to filename if the process crashes
+  void dumpOnCrash(const std::string& filename);
+
+  // Reads a dumped trace. Returns false if it isn't a valid trace file.
+  static bool load(std::istream& in, std::vector<trace_record>& out, uint64_t& total);
+
+private:
+  std::vector<trace_record> records;
+  size_t mask;
+  uint64_t total;
+};
+
+#endif  // SKYLARK_TRACE_H_
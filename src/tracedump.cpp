@@ -0,0 +1,50 @@
+/*
+ *  tracedump.cpp
+ *
+ *  Turns a binary instruction trace written by the emulator into readable
+ *  text, one instruction per line, oldest first, with each opcode
+ *  disassembled.
+ *
+ */
+
+#include "cpu.h"
+#include "trace.h"
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace std;
+
+int main(int argc, char* argv[]){
+
+  // Makes sure there's a proper number of arguments
+  if(argc != 2){
+    cout << "USAGE: tracedump.exe <TRACE_FILENAME>" << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  ifstream in(argv[1], ifstream::binary);
+  vector<trace_record> records;
+  uint64_t total;
+  if(!in.is_open() || !tracer::load(in, records, total)){
+    cout << "Not a valid trace file." << endl;
+    return EXIT_FAILURE;
+  }
+
+  // The first record held is instruction number total - records.size()
+  uint64_t number = total - records.size();
+  char line[96];
+  char text[32];
+  for(const trace_record& r : records){
+    cpu::disassemble(r.opcode, text, sizeof(text));
+    int length = snprintf(line, sizeof(line), "%10llu  %04X  %04X  %-18s  I=%04X",
+                          (unsigned long long) number++, r.pc, r.opcode, text, r.i);
+    if(r.reg != tracer::NO_REGISTER){
+      snprintf(line + length, sizeof(line) - length, "  V%X=%02X", r.reg, r.value);
+    }
+    cout << line << '\n';
+  }
+  cout << flush;
+  return 0;
+}
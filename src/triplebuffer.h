@@ -0,0 +1,58 @@
+#ifndef SKYLARK_TRIPLEBUFFER_H_
+#define SKYLARK_TRIPLEBUFFER_H_
+/*
+ *  triplebuffer.h
+ *
+ *  Hands whole values, such as finished frames, from one thread to another
+ *  without either of them waiting. There are three slots: the writer fills
+ *  one, the reader holds one, and the third is the newest finished value.
+ *  Publishing and taking each swap a slot with that third one in a single
+ *  atomic exchange, so the reader always gets the newest value and values it
+ *  didn't get to in time are simply overwritten.
+ *
+ */
+
+#include <atomic>
+
+template <typename T>
+class triple_buffer {
+public:
+  triple_buffer() : back(0), middle(1), front(2) {}
+
+  // The writer's slot. Fill it in, then publish() it.
+  T& writing(){
+    return slots[back];
+  }
+
+  // Makes the slot just written the newest value and takes the old middle
+  // slot to write the next one into
+  void publish(){
+    back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX;
+  }
+
+  // Takes the newest value if one has been published since the last take.
+  // Returns false, leaving read() as it was, if there isn't one.
+  bool take(){
+    if((middle.load(std::memory_order_relaxed) & FRESH) == 0){
+      return false;
+    }
+    front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+    return true;
+  }
+
+  // The reader's slot, holding the value it last took
+  const T& read(){
+    return slots[front];
+  }
+
+private:
+  static const unsigned char INDEX = 0x03; // the slot in middle
+  static const unsigned char FRESH = 0x04; // middle hasn't been taken yet
+
+  T slots[3];
+  unsigned char back; // only used by the writer
+  std::atomic<unsigned char> middle;
+  unsigned char front; // only used by the reader
+};
+
+#endif  // SKYLARK_TRIPLEBUFFER_H_